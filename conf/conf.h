@@ -11,6 +11,7 @@
 
 #include "lib/resource.h"
 #include "lib/timer.h"
+#include "lib/hash.h"
 
 
 /* Configuration structure */
@@ -22,8 +23,9 @@ struct config {
   list tables;				/* Configured routing tables (struct rtable_config) */
   list roa_tables;			/* Configured ROA tables (struct roa_table_config) */
   list logfiles;			/* Configured log files (sysdep) */
+  HASH(struct filter) filter_hash;	/* Anonymous filters, see filter_share() */
 
-  int mrtdump_file;			/* Configured MRTDump file (sysdep, fd in unix) */
+  struct mrt_stream *mrtdump_stream;	/* Configured MRTDump stream (sysdep) */
   char *syslog_name;			/* Name used for syslog (NULL -> no syslog) */
   struct rtable_config *master_rtc;	/* Configuration of master routing table */
   struct iface_patt *router_id_from;	/* Configured list of router ID iface patterns */
@@ -39,6 +41,7 @@ struct config {
   struct timeformat tf_log;		/* Time format for the logfile */
   struct timeformat tf_base;		/* Time format for other purposes */
   u32 gr_wait;				/* Graceful restart wait timeout */
+  u32 import_workers;			/* Number of threads running import filters (0 = disabled) */
 
   int cli_debug;			/* Tracing of CLI connections and commands */
   int latency_debug;			/* I/O loop tracks duration of each event */
@@ -13,7 +13,8 @@
  * You can find sources of the filter language in |filter/|
  * directory. File |filter/config.Y| contains filter grammar and basically translates
  * the source from user into a tree of &f_inst structures. These trees are
- * later interpreted using code in |filter/filter.c|.
+ * compiled to linear code, which is later interpreted using code in
+ * |filter/filter.c|.
  *
  * A filter is represented by a tree of &f_inst structures, one structure per
  * "instruction". Each &f_inst contains @code, @aux value which is
@@ -37,6 +38,7 @@
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/socket.h"
+#include "lib/alloca.h"
 #include "lib/string.h"
 #include "lib/unaligned.h"
 #include "nest/route.h"
@@ -50,6 +52,8 @@
 
 #define CMP_ERROR 999
 
+#define FF_SILENT 0x100		/* Internal: do not log runtime errors */
+
 static struct adata *
 adata_empty(struct linpool *pool, int l)
 {
@@ -84,7 +88,7 @@ pm_format(struct f_path_mask *p, buffer *buf)
       break;
 
     case PM_ASN_EXPR:
-      buffer_print(buf, "%u ", f_eval_asn((struct f_inst *) p->val));
+      buffer_print(buf, "%u ", f_eval_asn(p));
       break;
     }
 
@@ -551,12 +555,16 @@ val_format(struct f_val v, buffer *buf)
   }
 }
 
-static struct rte **f_rte;
-static struct rta *f_old_rta;
-static struct ea_list **f_tmp_attrs;
-static struct linpool *f_pool;
-static struct buffer f_buf;
-static int f_flags;
+/*
+ * Interpreter state is per thread, as filters accepted by filter_thread_safe()
+ * may be run by import workers (see f_run_mt()).
+ */
+static _Thread_local struct rte **f_rte;
+static _Thread_local struct rta *f_old_rta;
+static _Thread_local struct ea_list **f_tmp_attrs;
+static _Thread_local struct linpool *f_pool;
+static _Thread_local struct buffer f_buf;
+static _Thread_local int f_flags;
 
 static inline void f_rte_cow(void)
 {
@@ -587,23 +595,87 @@ f_rta_cow(void)
   (*f_rte)->attrs = rta_do_cow((*f_rte)->attrs, f_pool);
 }
 
+/*
+ * Filters often read the same attribute several times (e.g. bgp_path in a
+ * sequence of tests), so results of attribute lookups are kept in a small
+ * direct-mapped cache. Entries are valid only for the current generation,
+ * which is bumped by f_ea_reset() at the beginning of each filter run, and
+ * an entry is dropped when the attribute is set.
+ */
+
+#define F_EA_CACHE_SIZE 32
+
+struct f_ea_cache {
+  u32 gen;
+  u16 code;
+  eattr *e;
+};
+
+static _Thread_local struct f_ea_cache f_ea_cache[F_EA_CACHE_SIZE];
+static _Thread_local u32 f_ea_gen;
+
+static inline struct f_ea_cache *
+f_ea_slot(u16 code)
+{
+  return &f_ea_cache[(code ^ (code >> 5)) % F_EA_CACHE_SIZE];
+}
+
+static void
+f_ea_reset(void)
+{
+  if (!++f_ea_gen)
+  {
+    /* Generation counter wrapped around, old entries could look valid */
+    memset(f_ea_cache, 0, sizeof(f_ea_cache));
+    f_ea_gen = 1;
+  }
+}
+
+static eattr *
+f_ea_find(u16 code)
+{
+  struct f_ea_cache *c = f_ea_slot(code);
+  eattr *e = NULL;
+
+  if ((c->gen == f_ea_gen) && (c->code == code))
+    return c->e;
+
+  if (!(f_flags & FF_FORCE_TMPATTR))
+    e = ea_find((*f_rte)->attrs->eattrs, code);
+  if (!e)
+    e = ea_find((*f_tmp_attrs), code);
+  if ((!e) && (f_flags & FF_FORCE_TMPATTR))
+    e = ea_find((*f_rte)->attrs->eattrs, code);
+
+  c->gen = f_ea_gen;
+  c->code = code;
+  c->e = e;
+  return e;
+}
+
+static inline void
+f_ea_forget(u16 code)
+{
+  struct f_ea_cache *c = f_ea_slot(code);
+
+  if (c->code == code)
+    c->gen = 0;
+}
+
 static struct tbf rl_runtime_err = TBF_DEFAULT_LOG_LIMITS;
 
 #define runtime(x) do { \
-    log_rl(&rl_runtime_err, L_ERR "filters, line %d: %s", what->lineno, x); \
+    if (!(f_flags & FF_SILENT)) \
+      log_rl(&rl_runtime_err, L_ERR "filters, line %d: %s", what->lineno, x); \
     res.type = T_RETURN; \
     res.val.i = F_ERROR; \
     return res; \
   } while(0)
 
-#define ARG(x,y) \
-	x = interpret(what->y); \
-	if (x.type & T_RETURN) \
-		return x;
-
-#define ONEARG ARG(v1, a1.p)
-#define TWOARGS ARG(v1, a1.p) \
-		ARG(v2, a2.p)
+/* Arguments were already evaluated by the VM into consecutive registers */
+#define ONEARG v1 = args[0];
+#define TWOARGS v1 = args[0]; \
+		v2 = args[1];
 #define TWOARGS_C TWOARGS \
                   if (v1.type != v2.type) \
 		    runtime( "Can't operate with values of incompatible types" );
@@ -615,23 +687,27 @@ static struct tbf rl_runtime_err = TBF_DEFAULT_LOG_LIMITS;
 
 /**
  * interpret
- * @what: filter to interpret
+ * @what: instruction to execute
+ * @args: values of its arguments
  *
- * Interpret given tree of filter instructions. This is core function
- * of filter system and does all the hard work.
+ * Execute one filter instruction. This is core function of filter
+ * system and does all the hard work, while f_exec() only takes care
+ * of argument evaluation and control flow.
  *
  * Each instruction has 4 fields: code (which is instruction code),
  * aux (which is extension to instruction code, typically type),
  * arg1 and arg2 - arguments. Depending on instruction, arguments
- * are either integers, or pointers to instruction trees. Common
- * instructions like +, that have two expressions as arguments use
- * TWOARGS macro to get both of them evaluated.
+ * are either integers, or pointers to instruction trees. Values of
+ * argument trees are computed by preceding VM operations and passed
+ * in @args (in order @a1, @a2, third argument), common instructions
+ * like +, that have two expressions as arguments use TWOARGS macro to
+ * fetch both of them. Instruction @next is not followed.
  *
  * &f_val structures are copied around, so there are no problems with
  * memory managment.
  */
 static struct f_val
-interpret(struct f_inst *what)
+interpret(struct f_inst *what, struct f_val *args)
 {
   struct symbol *sym;
   struct f_val v1, v2, res, *vp;
@@ -640,8 +716,6 @@ interpret(struct f_inst *what)
   u32 as;
 
   res.type = T_VOID;
-  if (!what)
-    return res;
 
   switch(what->code) {
   case ',':
@@ -683,24 +757,6 @@ interpret(struct f_inst *what)
     }
     break;
 
-  case '&':
-  case '|':
-    ARG(v1, a1.p);
-    if (v1.type != T_BOOL)
-      runtime( "Can't do boolean operation on non-booleans" );
-    if (v1.val.i == (what->code == '|')) {
-      res.type = T_BOOL;
-      res.val.i = v1.val.i;
-      break;
-    }
-
-    ARG(v2, a2.p);
-    if (v2.type != T_BOOL)
-      runtime( "Can't do boolean operation on non-booleans" );
-    res.type = T_BOOL;
-    res.val.i = v2.val.i;
-    break;
-
   case P('m','p'):
     TWOARGS;
     if ((v1.type != T_INT) || (v2.type != T_INT))
@@ -766,9 +822,7 @@ interpret(struct f_inst *what)
       TWOARGS;
 
       /* Third argument hack */
-      struct f_val v3 = interpret(INST3(what).p);
-      if (v3.type & T_RETURN)
-	return v3;
+      struct f_val v3 = args[2];
 
       if ((v1.type != T_INT) || (v2.type != T_INT) || (v3.type != T_INT))
 	runtime( "Can't operate with value of non-integer type in LC constructor" );
@@ -836,7 +890,7 @@ interpret(struct f_inst *what)
 
   /* Set to indirect value, a1 = variable, a2 = value */
   case 's':
-    ARG(v2, a2.p);
+    v2 = args[0];
     sym = what->a1.p;
     vp = sym->def;
     if ((sym->class != (SYM_VARIABLE | v2.type)) && (v2.type != T_VOID)) {
@@ -874,16 +928,6 @@ interpret(struct f_inst *what)
     ONEARG;
     val_format(v1, &f_buf);
     break;
-  case '?':	/* ? has really strange error value, so we can implement if ... else nicely :-) */
-    ONEARG;
-    if (v1.type != T_BOOL)
-      runtime( "If requires boolean expression" );
-    if (v1.val.i) {
-      ARG(res,a2.p);
-      res.val.i = 0;
-    } else res.val.i = 1;
-    res.type = T_BOOL;
-    break;
   case '0':
     debug( "No operation\n" );
     break;
@@ -989,15 +1033,8 @@ interpret(struct f_inst *what)
   case P('e','a'):	/* Access to extended attributes */
     ACCESS_RTE;
     {
-      eattr *e = NULL;
       u16 code = what->a2.i;
-
-      if (!(f_flags & FF_FORCE_TMPATTR))
-	e = ea_find((*f_rte)->attrs->eattrs, code);
-      if (!e)
-	e = ea_find((*f_tmp_attrs), code);
-      if ((!e) && (f_flags & FF_FORCE_TMPATTR))
-	e = ea_find((*f_rte)->attrs->eattrs, code);
+      eattr *e = f_ea_find(code);
 
       if (!e) {
 	/* A special case: undefined int_set looks like empty int_set */
@@ -1129,13 +1166,7 @@ interpret(struct f_inst *what)
 	  runtime( "Setting bit in bitfield attribute to non-bool value" );
 	{
 	  /* First, we have to find the old value */
-	  eattr *e = NULL;
-	  if (!(f_flags & FF_FORCE_TMPATTR))
-	    e = ea_find((*f_rte)->attrs->eattrs, code);
-	  if (!e)
-	    e = ea_find((*f_tmp_attrs), code);
-	  if ((!e) && (f_flags & FF_FORCE_TMPATTR))
-	    e = ea_find((*f_rte)->attrs->eattrs, code);
+	  eattr *e = f_ea_find(code);
 	  u32 data = e ? e->u.data : 0;
 
 	  if (v1.val.i)
@@ -1175,6 +1206,8 @@ interpret(struct f_inst *what)
 	l->next = (*f_tmp_attrs);
 	(*f_tmp_attrs) = l;
       }
+
+      f_ea_forget(code);
     }
     break;
   case 'P':
@@ -1248,36 +1281,10 @@ interpret(struct f_inst *what)
     res = v1;
     res.type |= T_RETURN;
     return res;
-  case P('c','a'): /* CALL: this is special: if T_RETURN and returning some value, mask it out  */
-    ONEARG;
-    res = interpret(what->a2.p);
-    if (res.type == T_RETURN)
-      return res;
-    res.type &= ~T_RETURN;
-    break;
   case P('c','v'):	/* Clear local variables */
     for (sym = what->a1.p; sym != NULL; sym = sym->aux2)
       ((struct f_val *) sym->def)->type = T_VOID;
     break;
-  case P('S','W'):
-    ONEARG;
-    {
-      struct f_tree *t = find_tree(what->a2.p, v1);
-      if (!t) {
-	v1.type = T_VOID;
-	t = find_tree(what->a2.p, v1);
-	if (!t) {
-	  debug( "No else statement?\n");
-	  break;
-	}
-      }
-      /* It is actually possible to have t->data NULL */
-
-      res = interpret(t->data);
-      if (res.type & T_RETURN)
-	return res;
-    }
-    break;
   case P('i','M'): /* IP.MASK(val) */
     TWOARGS;
     if (v2.type != T_INT)
@@ -1510,12 +1517,644 @@ interpret(struct f_inst *what)
   default:
     bug( "Unknown instruction %d (%c)", what->code, what->code & 0xff);
   }
-  if (what->next)
-    return interpret(what->next);
   return res;
 }
 
-#undef ARG
+/*
+ * Filter VM
+ *
+ * Before a filter is run, its instruction tree is compiled by f_compile()
+ * into &f_line, a linear array of &f_op operations. Each operation stores
+ * its result to a register (a slot in a frame of &f_val values) given at
+ * compile time; arguments of an instruction are evaluated by preceding
+ * operations into consecutive registers starting with its result register,
+ * so no allocation of values or recursion is needed at runtime. Control
+ * instructions (if, boolean operators, case, function calls) are translated
+ * to jumps, all other instructions are executed by interpret(). Functions
+ * called from the filter are compiled into the same &f_line, their frames
+ * start at the result register of the call.
+ *
+ * Instructions without side effects with constant arguments are evaluated
+ * during compilation (constant folding), unless they fail.
+ */
+
+#define FO_END		0	/* End of code, the result is in register 0 */
+#define FO_CONST	1	/* Load constant */
+#define FO_INST		2	/* Execute instruction by interpret() */
+#define FO_JUMP		3	/* Jump to @arg */
+#define FO_IF		4	/* Check condition, skip to @arg if false */
+#define FO_AND		5	/* Check boolean, skip to @arg if false */
+#define FO_OR		6	/* Check boolean, skip to @arg if true */
+#define FO_BOOL		7	/* Check boolean */
+#define FO_SWITCH	8	/* Jump to case body, or to @arg if none matches */
+#define FO_CALL		9	/* Call function at @arg */
+#define FO_RET		10	/* Return from function */
+
+#define FO_JUMP_END	(~0u)	/* Jump target to be filled in */
+
+struct f_op {
+  u16 code;				/* FO_* */
+  uint dst;				/* Result register, relative to the frame */
+  uint arg;				/* Jump target, called function */
+  union {
+    struct f_inst *inst;		/* Instruction, also for line numbers */
+    const struct f_val *val;		/* Constant for FO_CONST */
+    struct f_tree *tree;		/* Case tree with op indices as data */
+  } u;
+};
+
+struct f_line {
+  uint len;				/* Number of operations */
+  uint regs;				/* Registers needed, including called functions */
+  uint depth;				/* Maximal depth of function calls */
+  struct f_op ops[0];
+};
+
+struct f_func {
+  struct f_inst *body;
+  uint start, end;			/* Operations of the function */
+  uint regs, depth;			/* Frame requirements, zero if not known yet */
+};
+
+struct f_case {
+  struct f_case *next;
+  void *data;
+  uint pos;
+};
+
+struct f_compiler {
+  linpool *lp;
+  int masks;				/* Attach code to path mask expressions */
+  struct f_op *ops;
+  uint len, size;
+  struct f_func *fn;
+  uint fn_count, fn_size;
+  struct f_case *cases;
+};
+
+static const struct f_val f_const_void = { .type = T_VOID };
+static const struct f_val f_const_bool[2] = { { .type = T_BOOL, .val.i = 0 }, { .type = T_BOOL, .val.i = 1 } };
+
+static void f_compile_chain(struct f_compiler *c, struct f_inst *what, uint dst);
+static struct f_line *f_compile_line(struct f_inst *root, struct linpool *lp, int masks);
+
+static struct f_op *
+f_emit(struct f_compiler *c, uint code, uint dst)
+{
+  if (c->len == c->size)
+  {
+    uint size = c->size ? 2 * c->size : 32;
+    struct f_op *ops = lp_alloc(c->lp, size * sizeof(struct f_op));
+    memcpy(ops, c->ops, c->len * sizeof(struct f_op));
+    c->ops = ops;
+    c->size = size;
+  }
+
+  struct f_op *op = &c->ops[c->len++];
+  memset(op, 0, sizeof(struct f_op));
+  op->code = code;
+  op->dst = dst;
+  return op;
+}
+
+static inline void
+f_emit_const(struct f_compiler *c, uint dst, const struct f_val *val)
+{
+  f_emit(c, FO_CONST, dst)->u.val = val;
+}
+
+static inline void
+f_emit_value(struct f_compiler *c, uint dst, struct f_val val)
+{
+  struct f_val *v = lp_alloc(c->lp, sizeof(struct f_val));
+  *v = val;
+  f_emit_const(c, dst, v);
+}
+
+/* Compile argument, return its value if it is a constant */
+static const struct f_val *
+f_compile_arg(struct f_compiler *c, struct f_inst *what, uint dst)
+{
+  uint start = c->len;
+  f_compile_chain(c, what, dst);
+
+  if ((c->len == start + 1) && (c->ops[start].code == FO_CONST))
+    return c->ops[start].u.val;
+
+  return NULL;
+}
+
+static int
+f_inst_args(struct f_inst *what, struct f_inst **args)
+{
+  switch (what->code)
+  {
+  case P('m','l'):
+    args[2] = INST3(what).p;
+    /* fall through */
+  case ',':
+  case '+':
+  case '-':
+  case '*':
+  case '/':
+  case P('m','p'):
+  case P('m','c'):
+  case P('!','='):
+  case P('=','='):
+  case '<':
+  case P('<','='):
+  case '~':
+  case P('!','~'):
+  case P('i','M'):
+  case P('A','p'):
+  case P('C','a'):
+    args[0] = what->a1.p;
+    args[1] = what->a2.p;
+    return (what->code == P('m','l')) ? 3 : 2;
+
+  case P('R','C'):
+    if (!what->arg1)
+      return 0;
+    args[0] = what->a1.p;
+    args[1] = what->a2.p;
+    return 2;
+
+  case 's':
+    args[0] = what->a2.p;
+    return 1;
+
+  case '!':
+  case P('d','e'):
+  case 'p':
+  case 'r':
+  case P('p',','):
+  case P('a','S'):
+  case P('e','S'):
+  case P('P','S'):
+  case 'L':
+  case P('c','p'):
+  case P('a','f'):
+  case P('a','l'):
+  case P('a','L'):
+    args[0] = what->a1.p;
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+/* Instructions which depend only on their arguments */
+static int
+f_inst_pure(struct f_inst *what)
+{
+  switch (what->code)
+  {
+  case '+':
+  case '-':
+  case '*':
+  case '/':
+  case P('m','p'):
+  case P('m','c'):
+  case P('m','l'):
+  case P('!','='):
+  case P('=','='):
+  case '<':
+  case P('<','='):
+  case '!':
+  case '~':
+  case P('!','~'):
+  case P('d','e'):
+  case 'L':
+  case P('c','p'):
+  case P('i','M'):
+  case P('a','f'):
+  case P('a','l'):
+  case P('a','L'):
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+static void
+f_compile_path_mask(struct f_compiler *c, const struct f_val *v)
+{
+  struct f_path_mask *pm;
+
+  if (!c->masks || (v->type != T_PATH_MASK))
+    return;
+
+  for (pm = v->val.path_mask; pm; pm = pm->next)
+    if ((pm->kind == PM_ASN_EXPR) && !pm->val2)
+      pm->val2 = (uintptr_t) f_compile_line((struct f_inst *) pm->val, c->lp, 1);
+}
+
+static uint
+f_compile_case(struct f_compiler *c, void *data, uint dst)
+{
+  struct f_case *cs;
+
+  /* Several case labels may share the same body */
+  for (cs = c->cases; cs; cs = cs->next)
+    if (cs->data == data)
+      return cs->pos;
+
+  cs = lp_alloc(c->lp, sizeof(struct f_case));
+  cs->data = data;
+  cs->pos = c->len;
+  cs->next = c->cases;
+  c->cases = cs;
+
+  f_compile_chain(c, data, dst);
+  f_emit(c, FO_JUMP, dst)->arg = FO_JUMP_END;
+  return cs->pos;
+}
+
+static struct f_tree *
+f_compile_cases(struct f_compiler *c, struct f_tree *t, uint dst)
+{
+  if (!t)
+    return NULL;
+
+  struct f_tree *n = lp_alloc(c->lp, sizeof(struct f_tree));
+  *n = *t;
+  n->left = f_compile_cases(c, t->left, dst);
+  n->data = (void *) (uintptr_t) f_compile_case(c, t->data, dst);
+  n->right = f_compile_cases(c, t->right, dst);
+  return n;
+}
+
+static uint
+f_function(struct f_compiler *c, struct f_inst *body)
+{
+  uint i;
+
+  for (i = 0; i < c->fn_count; i++)
+    if (c->fn[i].body == body)
+      return i;
+
+  if (c->fn_count == c->fn_size)
+  {
+    uint size = c->fn_size ? 2 * c->fn_size : 8;
+    struct f_func *fn = lp_alloc(c->lp, size * sizeof(struct f_func));
+    memcpy(fn, c->fn, c->fn_count * sizeof(struct f_func));
+    c->fn = fn;
+    c->fn_size = size;
+  }
+
+  c->fn[i] = (struct f_func) { .body = body };
+  return c->fn_count++;
+}
+
+static void
+f_compile_inst(struct f_compiler *c, struct f_inst *what, uint dst)
+{
+  struct f_inst *arg[3];
+  const struct f_val *val[3];
+  struct f_val args[3], res;
+  struct f_case *cases;
+  uint i, n, pos;
+
+  switch (what->code)
+  {
+  case 'c':
+    f_emit_value(c, dst, interpret(what, NULL));
+    return;
+
+  case 'C':
+    f_compile_path_mask(c, what->a1.p);
+    f_emit_const(c, dst, what->a1.p);
+    return;
+
+  case '?':	/* Result of if is false when the condition was true, see filter_body */
+    val[0] = f_compile_arg(c, what->a1.p, dst);
+    if (val[0] && (val[0]->type == T_BOOL))
+    {
+      i = val[0]->val.i;
+      c->len--;
+
+      if (i)
+	f_compile_chain(c, what->a2.p, dst + 1);
+      f_emit_const(c, dst, &f_const_bool[!i]);
+      return;
+    }
+
+    pos = c->len;
+    f_emit(c, FO_IF, dst)->u.inst = what;
+    f_compile_chain(c, what->a2.p, dst + 1);
+    c->ops[pos].arg = c->len;
+    return;
+
+  case '&':
+  case '|':
+    i = (what->code == '|');
+    val[0] = f_compile_arg(c, what->a1.p, dst);
+    if (val[0] && (val[0]->type == T_BOOL))
+    {
+      if (val[0]->val.i == i)
+	return;
+
+      c->len--;
+      val[1] = f_compile_arg(c, what->a2.p, dst);
+      if (!val[1] || (val[1]->type != T_BOOL))
+	f_emit(c, FO_BOOL, dst)->u.inst = what;
+      return;
+    }
+
+    pos = c->len;
+    f_emit(c, i ? FO_OR : FO_AND, dst)->u.inst = what;
+    f_compile_chain(c, what->a2.p, dst);
+    f_emit(c, FO_BOOL, dst)->u.inst = what;
+    c->ops[pos].arg = c->len;
+    return;
+
+  case P('c','a'):
+    /* Arguments are assigned to variables of the function */
+    f_compile_chain(c, what->a1.p, dst);
+
+    if (!what->a2.p)
+    {
+      f_emit_const(c, dst, &f_const_void);
+      return;
+    }
+
+    pos = f_function(c, what->a2.p);
+    f_emit(c, FO_CALL, dst)->arg = pos;
+    return;
+
+  case P('S','W'):
+    f_compile_chain(c, what->a1.p, dst);
+    pos = c->len;
+    f_emit(c, FO_SWITCH, dst);
+
+    cases = c->cases;
+    c->cases = NULL;
+    c->ops[pos].u.tree = f_compile_cases(c, what->a2.p, dst);
+    c->cases = cases;
+
+    c->ops[pos].arg = c->len;
+    for (i = pos + 1; i < c->len; i++)
+      if ((c->ops[i].code == FO_JUMP) && (c->ops[i].arg == FO_JUMP_END))
+	c->ops[i].arg = c->len;
+    return;
+  }
+
+  pos = c->len;
+  n = f_inst_args(what, arg);
+  for (i = 0; i < n; i++)
+    val[i] = f_compile_arg(c, arg[i], dst + i);
+
+  if (f_inst_pure(what))
+  {
+    for (i = 0; i < n; i++)
+    {
+      if (!val[i] || (val[i]->type == T_PATH_MASK))
+	break;
+      args[i] = *val[i];
+    }
+
+    /* Runtime errors are left to be reported when the filter is run */
+    if ((i == n) && !((res = interpret(what, args)).type & T_RETURN))
+    {
+      c->len = pos;
+      f_emit_value(c, dst, res);
+      return;
+    }
+  }
+
+  f_emit(c, FO_INST, dst)->u.inst = what;
+}
+
+static void
+f_compile_chain(struct f_compiler *c, struct f_inst *what, uint dst)
+{
+  if (!what)
+    f_emit_const(c, dst, &f_const_void);
+
+  for (; what; what = what->next)
+    f_compile_inst(c, what, dst);
+}
+
+static void
+f_compile_frame(struct f_compiler *c, uint start, uint end, uint *regs, uint *depth)
+{
+  uint i, r, d;
+
+  *regs = *depth = 0;
+  for (i = start; i < end; i++)
+  {
+    struct f_op *op = &c->ops[i];
+    r = op->dst + 1;
+    d = 0;
+
+    if (op->code == FO_CALL)
+    {
+      struct f_func *fn = &c->fn[op->arg];
+      if (!fn->regs)
+	f_compile_frame(c, fn->start, fn->end, &fn->regs, &fn->depth);
+
+      r = op->dst + fn->regs;
+      d = fn->depth + 1;
+    }
+
+    *regs = MAX(*regs, r);
+    *depth = MAX(*depth, d);
+  }
+}
+
+static struct f_line *
+f_compile_line(struct f_inst *root, struct linpool *lp, int masks)
+{
+  struct f_compiler c = { .lp = lp, .masks = masks };
+  struct f_line *line;
+  uint i, main_len, regs, depth;
+
+  /* Constant folding runs instructions, keep the state of a running filter */
+  struct rte **rte = f_rte;
+  struct ea_list **tmp_attrs = f_tmp_attrs;
+  struct linpool *pool = f_pool;
+  int flags = f_flags;
+
+  f_rte = NULL;
+  f_tmp_attrs = NULL;
+  f_pool = lp;
+  f_flags = FF_SILENT;
+
+  f_compile_chain(&c, root, 0);
+  f_emit(&c, FO_END, 0);
+  main_len = c.len;
+
+  /* Functions may call other functions, c.fn_count grows */
+  for (i = 0; i < c.fn_count; i++)
+  {
+    c.fn[i].start = c.len;
+    f_compile_chain(&c, c.fn[i].body, 0);
+    f_emit(&c, FO_RET, 0);
+    c.fn[i].end = c.len;
+  }
+
+  f_compile_frame(&c, 0, main_len, &regs, &depth);
+
+  for (i = 0; i < c.len; i++)
+    if (c.ops[i].code == FO_CALL)
+      c.ops[i].arg = c.fn[c.ops[i].arg].start;
+
+  line = lp_alloc(lp, sizeof(struct f_line) + c.len * sizeof(struct f_op));
+  line->len = c.len;
+  line->regs = regs;
+  line->depth = depth;
+  memcpy(line->ops, c.ops, c.len * sizeof(struct f_op));
+
+  f_rte = rte;
+  f_tmp_attrs = tmp_attrs;
+  f_pool = pool;
+  f_flags = flags;
+
+  return line;
+}
+
+/**
+ * f_compile - compile filter code
+ * @root: instruction tree
+ * @lp: linear pool for the code
+ *
+ * Translates the instruction tree @root (including all functions called
+ * from it) to linear code executed by f_run(). It is called when a filter
+ * is parsed, so the code is allocated from the config memory and path
+ * masks used by the filter get their expressions compiled, too.
+ */
+struct f_line *
+f_compile(struct f_inst *root, struct linpool *lp)
+{
+  return f_compile_line(root, lp, 1);
+}
+
+/*
+ * f_exec - execute compiled filter code
+ */
+static struct f_val
+f_exec(const struct f_line *line)
+{
+  struct f_frame {
+    const struct f_op *ret;
+    struct f_val *base;
+  } *stack, *sp;
+
+  const struct f_op *op = line->ops;
+  struct f_val *regs = alloca(line->regs * sizeof(struct f_val));
+  struct f_val *base = regs, *r, res;
+  struct f_inst *what;
+  struct f_tree *t;
+
+  stack = sp = alloca(line->depth * sizeof(struct f_frame));
+
+  for (;;)
+  {
+    r = base + op->dst;
+
+    switch (op->code)
+    {
+    case FO_END:
+      return *r;
+
+    case FO_CONST:
+      *r = *op->u.val;
+      break;
+
+    case FO_INST:
+      *r = interpret(op->u.inst, r);
+      if (!(r->type & T_RETURN))
+	break;
+
+      /* Accept, reject and errors end the filter, as return outside of function */
+      if ((r->type == T_RETURN) || (sp == stack))
+	return *r;
+
+      /* Return from function, its register 0 is the result register of the call */
+      base[0] = *r;
+      base[0].type &= ~T_RETURN;
+      sp--;
+      op = sp->ret;
+      base = sp->base;
+      break;
+
+    case FO_JUMP:
+      op = line->ops + op->arg;
+      continue;
+
+    case FO_IF:
+      what = op->u.inst;
+      if (r->type != T_BOOL)
+	runtime( "If requires boolean expression" );
+
+      r->val.i = !r->val.i;
+      if (r->val.i)
+      {
+	op = line->ops + op->arg;
+	continue;
+      }
+      break;
+
+    case FO_AND:
+    case FO_OR:
+      what = op->u.inst;
+      if (r->type != T_BOOL)
+	runtime( "Can't do boolean operation on non-booleans" );
+
+      if (r->val.i == (op->code == FO_OR))
+      {
+	op = line->ops + op->arg;
+	continue;
+      }
+      break;
+
+    case FO_BOOL:
+      what = op->u.inst;
+      if (r->type != T_BOOL)
+	runtime( "Can't do boolean operation on non-booleans" );
+      break;
+
+    case FO_SWITCH:
+      t = find_tree(op->u.tree, *r);
+      if (!t) {
+	r->type = T_VOID;
+	t = find_tree(op->u.tree, *r);
+	if (!t) {
+	  debug( "No else statement?\n");
+	  op = line->ops + op->arg;
+	  continue;
+	}
+      }
+
+      op = line->ops + (uintptr_t) t->data;
+      continue;
+
+    case FO_CALL:
+      sp->ret = op;
+      sp->base = base;
+      sp++;
+      base = r;
+      op = line->ops + op->arg;
+      continue;
+
+    case FO_RET:
+      sp--;
+      op = sp->ret;
+      base = sp->base;
+      break;
+
+    default:
+      bug("Unknown filter operation %u", op->code);
+    }
+
+    op++;
+  }
+}
+
+#undef ONEARG
+#undef TWOARGS
 #define ARG(x,y) \
 	if (!i_same(f1->y, f2->y)) \
 		return 0;
@@ -1698,8 +2337,9 @@ f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struc
   f_flags = flags;
 
   LOG_BUFFER_INIT(f_buf);
+  f_ea_reset();
 
-  struct f_val res = interpret(filter->root);
+  struct f_val res = f_exec(filter->line);
 
   if (f_old_rta) {
     /*
@@ -1729,6 +2369,53 @@ f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struc
   return res.val.i;
 }
 
+/**
+ * f_run_mt - run a filter outside of the main thread
+ * @filter: filter to run, it must pass filter_thread_safe()
+ * @rte: route being filtered, it must be a private (non-COW) copy
+ * @tmp_attrs: temporary attributes, prepared by caller or generated by f_run()
+ * @tmp_pool: all filter allocations go from this pool
+ * @old_rta: cached rta to be released by the caller
+ *
+ * This is a variant of f_run() with no flags which does not touch the rta
+ * cache, so it may be called from an import worker thread. If the filter
+ * modified a cached rta, *@rte keeps the uncached copy and the original rta
+ * is returned in @old_rta (otherwise it is set to NULL). The caller must then
+ * obtain the cached rta by rta_lookup() before releasing @old_rta by
+ * rta_free(), both from the main thread.
+ */
+int
+f_run_mt(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, struct rta **old_rta)
+{
+  *old_rta = NULL;
+
+  if (filter == FILTER_ACCEPT)
+    return F_ACCEPT;
+
+  if (filter == FILTER_REJECT)
+    return F_REJECT;
+
+  ASSERT(!((*rte)->flags & REF_COW));
+
+  f_rte = rte;
+  f_old_rta = NULL;
+  f_tmp_attrs = tmp_attrs;
+  f_pool = tmp_pool;
+  f_flags = 0;
+
+  LOG_BUFFER_INIT(f_buf);
+  f_ea_reset();
+
+  struct f_val res = f_exec(filter->line);
+  *old_rta = f_old_rta;
+
+  if (res.type != T_RETURN) {
+    log_rl(&rl_runtime_err, L_ERR "Filter %s did not return accept nor reject. Make up your mind", filter->name);
+    return F_ERROR;
+  }
+  return res.val.i;
+}
+
 /* TODO: perhaps we could integrate f_eval(), f_eval_rte() and f_run() */
 
 struct f_val
@@ -1743,9 +2430,10 @@ f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool)
   f_flags = 0;
 
   LOG_BUFFER_INIT(f_buf);
+  f_ea_reset();
 
   /* Note that in this function we assume that rte->attrs is private / uncached */
-  struct f_val res = interpret(expr);
+  struct f_val res = f_exec(f_compile_line(expr, tmp_pool, 0));
 
   /* Hack to include EAF_TEMP attributes to the main list */
   (*rte)->attrs->eattrs = ea_append(tmp_attrs, (*rte)->attrs->eattrs);
@@ -1762,8 +2450,9 @@ f_eval(struct f_inst *expr, struct linpool *tmp_pool)
   f_pool = tmp_pool;
 
   LOG_BUFFER_INIT(f_buf);
+  f_ea_reset();
 
-  return interpret(expr);
+  return f_exec(f_compile_line(expr, tmp_pool, 0));
 }
 
 uint
@@ -1779,10 +2468,16 @@ f_eval_int(struct f_inst *expr)
 }
 
 u32
-f_eval_asn(struct f_inst *expr)
+f_eval_asn(struct f_path_mask *pm)
 {
-  /* Called as a part of another interpret call, therefore no log_reset() */
-  struct f_val res = interpret(expr);
+  /* Called as a part of another filter run, therefore no log_reset() */
+  struct f_line *line = (struct f_line *) pm->val2;
+
+  /* Path masks which are not a part of any filter, e.g. in static routes */
+  if (!line)
+    line = f_compile_line((struct f_inst *) pm->val, f_pool, 0);
+
+  struct f_val res = f_exec(line);
   return (res.type == T_INT) ? res.val.i : 0;
 }
 
@@ -1806,3 +2501,379 @@ filter_same(struct filter *new, struct filter *old)
     return 0;
   return i_same(new->root, old->root);
 }
+
+static inline u32
+f_hash_mix(u32 h, u32 x)
+{
+  return (h * 0x9e3779b1) ^ x;
+}
+
+static u32
+f_hash_string(const char *str)
+{
+  u32 h = 0;
+
+  while (*str)
+    h = f_hash_mix(h, (byte) *str++);
+
+  return h;
+}
+
+static int
+i_hash(struct f_inst *what, void *data)
+{
+  u32 *h = data;
+
+  *h = f_hash_mix(*h, (what->code << 16) ^ what->aux);
+
+  /* Values compared by i_same(), except constant sets and tries */
+  switch (what->code)
+  {
+  case 'c':
+    if (what->aux == T_STRING)
+      *h = f_hash_mix(*h, f_hash_string(what->a2.p));
+    else if ((what->aux != T_PREFIX_SET) && (what->aux != T_SET))
+      *h = f_hash_mix(*h, what->a2.i);
+    break;
+
+  case 'C':
+    *h = f_hash_mix(*h, ((struct f_val *) what->a1.p)->type);
+    break;
+
+  case 's':
+    *h = f_hash_mix(*h, f_hash_string(((struct symbol *) what->a1.p)->name));
+    break;
+
+  case 'V':
+    *h = f_hash_mix(*h, f_hash_string(what->a2.p));
+    break;
+
+  case P('p',','):
+  case 'P':
+  case 'a':
+  case P('e','a'):
+  case P('P','S'):
+  case P('a','S'):
+  case P('e','S'):
+    *h = f_hash_mix(*h, what->a2.i);
+    break;
+  }
+
+  return 0;
+}
+
+#define FSH_KEY(n)		n->hash, n
+#define FSH_NEXT(n)		n->next
+#define FSH_EQ(h1,f1,h2,f2)	h1 == h2 && filter_same(f1, f2)
+#define FSH_FN(h,f)		h
+
+#define FSH_REHASH		filter_share_rehash
+#define FSH_PARAMS		/8, *2, 2, 2, 6, 20
+
+HASH_DEFINE_REHASH_FN(FSH, struct filter)
+
+/**
+ * filter_share - share equal anonymous filters
+ * @f: newly parsed anonymous filter
+ *
+ * Anonymous filters (e.g. 'export where ...' in many protocols) are
+ * often written the same way several times. This function returns a
+ * previously parsed anonymous filter of the same configuration which is
+ * equal to @f, or registers and returns @f itself. Equal filters may be then
+ * recognized just by comparing pointers, which is used by the export
+ * filter cache in rte_announce(). Filters are looked up by a hash of their
+ * instructions, so just filters with the same hash are compared. Filters
+ * parsed from CLI commands have no config pool and are not shared.
+ */
+struct filter *
+filter_share(struct filter *f)
+{
+  struct filter *g;
+  u32 h = 0;
+
+  if (!new_config->pool)
+    return f;
+
+  if (!new_config->filter_hash.data)
+    HASH_INIT(new_config->filter_hash, new_config->pool, 6);
+
+  i_walk(f->root, i_hash, &h);
+  f->hash = h;
+
+  g = HASH_FIND(new_config->filter_hash, FSH, h, f);
+  if (g)
+    return g;
+
+  HASH_INSERT2(new_config->filter_hash, FSH, new_config->pool, f);
+  return f;
+}
+
+static int
+tree_walk(struct f_tree *t, int (*hook)(struct f_inst *, void *), void *data)
+{
+  if (!t)
+    return 0;
+
+  return tree_walk(t->left, hook, data) || tree_walk(t->right, hook, data) ||
+    i_walk(t->data, hook, data);
+}
+
+/**
+ * i_walk - walk instructions of a filter
+ * @what: first instruction of a sequence
+ * @hook: function called for each instruction
+ * @data: user data passed to @hook
+ *
+ * Calls @hook for each instruction in the sequence @what and for all its
+ * argument instructions, including bodies of called functions and cases of
+ * switch statements. When @hook returns nonzero, the walk is stopped.
+ * Returns nonzero if it was stopped by @hook.
+ */
+int
+i_walk(struct f_inst *what, int (*hook)(struct f_inst *, void *), void *data)
+{
+#define WALK(x) if (i_walk(x, hook, data)) return 1
+
+  for (; what; what = what->next)
+  {
+    if (hook(what, data))
+      return 1;
+
+    switch(what->code) {
+    case ',':
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '|':
+    case '&':
+    case P('m','p'):
+    case P('m','c'):
+    case P('!','='):
+    case P('=','='):
+    case '<':
+    case P('<','='):
+    case P('!', '~'):
+    case '~':
+    case '?':
+    case P('i','M'):
+    case P('A','p'):
+    case P('C','a'):
+    case P('R','C'):
+    case P('c','a'): /* Function body is in a2 */
+      WALK(what->a1.p);
+      WALK(what->a2.p);
+      break;
+
+    case P('m','l'):
+      WALK(what->a1.p);
+      WALK(what->a2.p);
+      WALK(INST3(what).p);
+      break;
+
+    case 's':
+      WALK(what->a2.p);
+      break;
+
+    case '!':
+    case P('d','e'):
+    case 'p':
+    case 'L':
+    case P('p',','):
+    case P('P','S'):
+    case P('a','S'):
+    case P('e','S'):
+    case 'r':
+    case P('c','p'):
+    case P('a','f'):
+    case P('a','l'):
+    case P('a','L'):
+      WALK(what->a1.p);
+      break;
+
+    case P('S','W'):
+      WALK(what->a1.p);
+      if (tree_walk(what->a2.p, hook, data))
+	return 1;
+      break;
+    }
+  }
+
+#undef WALK
+  return 0;
+}
+
+static int
+i_uses_roa(struct f_inst *what, void *data)
+{
+  return (what->code == P('R','C')) &&
+    (((struct f_inst_roa_check *) what)->rtc == data);
+}
+
+/**
+ * filter_uses_roa - check whether a filter depends on a ROA table
+ * @filter: filter to be examined
+ * @rtc: ROA table configuration
+ *
+ * Returns 1 if @filter contains roa_check() on ROA table @rtc (either
+ * directly or in a called function), otherwise 0.
+ */
+int
+filter_uses_roa(struct filter *filter, struct roa_table_config *rtc)
+{
+  if (filter == FILTER_ACCEPT || filter == FILTER_REJECT)
+    return 0;
+
+  return i_walk(filter->root, i_uses_roa, rtc);
+}
+
+static int
+i_route_specific(struct f_inst *what, void *data UNUSED)
+{
+  struct f_path_mask *pm;
+
+  switch (what->code)
+  {
+  case 'a':		/* Network prefix */
+    return what->a2.i == SA_NET;
+
+  case P('R','C'):	/* Implicit roa_check() uses network prefix */
+    return !what->arg1;
+
+  case P('P','S'):	/* Preference is a part of rte, not of rta */
+  case 'p':		/* Printing */
+    return 1;
+
+  case P('p',','):	/* Plain accept / reject has no side effects */
+    return what->a1.p || ((what->a2.i != F_ACCEPT) && (what->a2.i != F_REJECT) && (what->a2.i != F_ERROR));
+
+  case 'C':		/* Path masks may contain expressions */
+    if (((struct f_val *) what->a1.p)->type != T_PATH_MASK)
+      return 0;
+
+    for (pm = ((struct f_val *) what->a1.p)->val.path_mask; pm; pm = pm->next)
+      if ((pm->kind == PM_ASN_EXPR) &&
+	  i_walk((struct f_inst *) pm->val, i_route_specific, NULL))
+	return 1;
+    return 0;
+  }
+
+  return 0;
+}
+
+/**
+ * filter_attrs_only - check whether a filter result depends just on route attributes
+ * @filter: filter to be examined
+ *
+ * Returns 1 if @filter neither reads the network prefix (directly or by
+ * implicit roa_check()) nor changes route preference nor prints anything.
+ * Such filter gives the same result for all routes with the same cached
+ * &rta and preference, so its result may be reused for them (see the import
+ * filter memo in nest/rt-table.c). Returns 0 for %FILTER_ACCEPT and
+ * %FILTER_REJECT, as there is nothing to reuse.
+ */
+int
+filter_attrs_only(struct filter *filter)
+{
+  if (filter == FILTER_ACCEPT || filter == FILTER_REJECT)
+    return 0;
+
+  return !i_walk(filter->root, i_route_specific, NULL);
+}
+
+static int
+i_side_effect(struct f_inst *what, void *data UNUSED)
+{
+  struct f_path_mask *pm;
+
+  switch (what->code)
+  {
+  case 'p':		/* Printing */
+    return 1;
+
+  case P('p',','):	/* Plain accept / reject has no side effects */
+    return what->a1.p || ((what->a2.i != F_ACCEPT) && (what->a2.i != F_REJECT) && (what->a2.i != F_ERROR));
+
+  case 'C':		/* Path masks may contain expressions */
+    if (((struct f_val *) what->a1.p)->type != T_PATH_MASK)
+      return 0;
+
+    for (pm = ((struct f_val *) what->a1.p)->val.path_mask; pm; pm = pm->next)
+      if ((pm->kind == PM_ASN_EXPR) &&
+	  i_walk((struct f_inst *) pm->val, i_side_effect, NULL))
+	return 1;
+    return 0;
+  }
+
+  return 0;
+}
+
+/**
+ * filter_shareable - check whether filter results may be shared
+ * @filter: filter to be examined
+ *
+ * Returns 1 if @filter neither prints anything nor calls die. The result of
+ * such filter may be computed once and used for all protocols with the same
+ * export filter (see the export filter cache in nest/rt-table.c) without
+ * users noticing. Filters with print statements are run for each protocol,
+ * so their messages are logged for each of them. Returns 0 for
+ * %FILTER_ACCEPT and %FILTER_REJECT, as there is nothing to share.
+ */
+int
+filter_shareable(struct filter *filter)
+{
+  if (filter == FILTER_ACCEPT || filter == FILTER_REJECT)
+    return 0;
+
+  return !i_walk(filter->root, i_side_effect, NULL);
+}
+
+static int
+i_thread_unsafe(struct f_inst *what, void *data UNUSED)
+{
+  struct f_path_mask *pm;
+
+  switch (what->code)
+  {
+  case 's':		/* Local variables are stored in shared symbols */
+  case 'V':
+  case P('c','v'):
+    return 1;
+
+  case P('a','S'):	/* Neighbor lookup may create a new neighbor entry */
+    return what->a2.i == SA_GW;
+
+  case P('p',','):
+    return what->a2.i == F_QUITBIRD;
+
+  case 'C':		/* Path masks may contain expressions */
+    if (((struct f_val *) what->a1.p)->type != T_PATH_MASK)
+      return 0;
+
+    for (pm = ((struct f_val *) what->a1.p)->val.path_mask; pm; pm = pm->next)
+      if ((pm->kind == PM_ASN_EXPR) &&
+	  i_walk((struct f_inst *) pm->val, i_thread_unsafe, NULL))
+	return 1;
+    return 0;
+  }
+
+  return 0;
+}
+
+/**
+ * filter_thread_safe - check whether a filter may be run by import workers
+ * @filter: filter to be examined
+ *
+ * Returns 1 if @filter touches no state shared between filter runs, so it may
+ * be run by f_run_mt() in parallel with other filters. That excludes filters
+ * using local variables or function arguments (which are kept in symbols),
+ * setting gw (which may allocate a neighbor entry) and calling die.
+ */
+int
+filter_thread_safe(struct filter *filter)
+{
+  if (filter == FILTER_ACCEPT || filter == FILTER_REJECT)
+    return 1;
+
+  return !i_walk(filter->root, i_thread_unsafe, NULL);
+}
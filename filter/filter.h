@@ -75,9 +75,14 @@ struct f_val {
   } val;
 };
 
+struct f_line;
+
 struct filter {
   char *name;
   struct f_inst *root;
+  struct f_line *line;		/* Compiled code, see f_compile() */
+  struct filter *next;		/* Next in hash chain of anonymous filters, see filter_share() */
+  u32 hash;			/* Hash of instructions, see filter_share() */
 };
 
 struct f_inst *f_new_inst(void);
@@ -117,17 +122,26 @@ trie_match_fprefix(struct f_trie *t, struct f_prefix *px)
 
 struct ea_list;
 struct rte;
+struct rta;
 
 int f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, int flags);
+int f_run_mt(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, struct rta **old_rta);
 struct f_val f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool);
 struct f_val f_eval(struct f_inst *expr, struct linpool *tmp_pool);
 uint f_eval_int(struct f_inst *expr);
-u32 f_eval_asn(struct f_inst *expr);
+u32 f_eval_asn(struct f_path_mask *pm);
+struct f_line *f_compile(struct f_inst *root, struct linpool *lp);
 
 char *filter_name(struct filter *filter);
 int filter_same(struct filter *new, struct filter *old);
+struct filter *filter_share(struct filter *f);
 
 int i_same(struct f_inst *f1, struct f_inst *f2);
+int i_walk(struct f_inst *what, int (*hook)(struct f_inst *, void *), void *data);
+int filter_uses_roa(struct filter *filter, struct roa_table_config *rtc);
+int filter_thread_safe(struct filter *filter);
+int filter_attrs_only(struct filter *filter);
+int filter_shareable(struct filter *filter);
 
 int val_compare(struct f_val v1, struct f_val v2);
 int val_same(struct f_val v1, struct f_val v2);
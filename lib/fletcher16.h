@@ -45,6 +45,17 @@ fletcher16_init(struct fletcher16_context *ctx)
   ctx->c0 = ctx->c1 = 0;
 }
 
+/*
+ * Four steps of c1 += c0 += b, with bytes b0, b1, b2, b3. Both sums are updated
+ * just once, which makes the dependency chain shorter.
+ */
+static inline void
+fletcher16_step4(int *c0, int *c1, int b0, int b1, int b2, int b3)
+{
+  *c1 += 4 * *c0 + 4 * b0 + 3 * b1 + 2 * b2 + b3;
+  *c0 += b0 + b1 + b2 + b3;
+}
+
 /**
  * fletcher16_update - process data to Fletcher-16 context
  * @ctx: the context
@@ -62,38 +73,38 @@ fletcher16_update(struct fletcher16_context *ctx, const u8* buf, int len)
    * The Fletcher-16 sum is essentially a sequence of
    * ctx->c1 += ctx->c0 += *buf++, modulo 255.
    *
-   * In the inner loop, we eliminate modulo operation and we do some loop
-   * unrolling. MODX is the maximal number of steps that can be done without
+   * In the inner loop, we eliminate modulo operation and we process four bytes
+   * in one step. MODX is the maximal number of steps that can be done without
    * modulo before overflow, see RFC 1008 for details. We use a bit smaller
-   * value to cover for initial steps due to loop unrolling.
+   * value to cover for initial steps due to loop unrolling. The sums are kept
+   * in local variables, as stores to the context could alias with @buf.
    */
 
 #define MODX 4096
 
+  int c0 = ctx->c0, c1 = ctx->c1;
   int blen, i;
 
   blen = len % 4;
   len -= blen;
 
   for (i = 0; i < blen; i++)
-    ctx->c1 += ctx->c0 += *buf++;
+    c1 += c0 += *buf++;
 
   do {
     blen = MIN(len, MODX);
     len -= blen;
 
-    for (i = 0; i < blen; i += 4)
-    {
-      ctx->c1 += ctx->c0 += *buf++;
-      ctx->c1 += ctx->c0 += *buf++;
-      ctx->c1 += ctx->c0 += *buf++;
-      ctx->c1 += ctx->c0 += *buf++;
-    }
+    for (i = 0; i < blen; i += 4, buf += 4)
+      fletcher16_step4(&c0, &c1, buf[0], buf[1], buf[2], buf[3]);
 
-    ctx->c0 %= 255;
-    ctx->c1 %= 255;
+    c0 %= 255;
+    c1 %= 255;
 
   } while (len);
+
+  ctx->c0 = c0;
+  ctx->c1 = c1;
 }
 
 
@@ -116,32 +127,29 @@ fletcher16_update_n32(struct fletcher16_context *ctx, const u8* buf, int len)
 {
   /* See fletcher16_update() for details */
 
+  int c0 = ctx->c0, c1 = ctx->c1;
   int blen, i;
 
   do {
     blen = MIN(len, MODX);
     len -= blen;
 
-    for (i = 0; i < blen; i += 4)
+    for (i = 0; i < blen; i += 4, buf += 4)
     {
 #ifdef CPU_BIG_ENDIAN
-      ctx->c1 += ctx->c0 += *buf++;
-      ctx->c1 += ctx->c0 += *buf++;
-      ctx->c1 += ctx->c0 += *buf++;
-      ctx->c1 += ctx->c0 += *buf++;
+      fletcher16_step4(&c0, &c1, buf[0], buf[1], buf[2], buf[3]);
 #else
-      ctx->c1 += ctx->c0 += buf[3];
-      ctx->c1 += ctx->c0 += buf[2];
-      ctx->c1 += ctx->c0 += buf[1];
-      ctx->c1 += ctx->c0 += buf[0];
-      buf += 4;
+      fletcher16_step4(&c0, &c1, buf[3], buf[2], buf[1], buf[0]);
 #endif
     }
 
-    ctx->c0 %= 255;
-    ctx->c1 %= 255;
+    c0 %= 255;
+    c1 %= 255;
 
   } while (len);
+
+  ctx->c0 = c0;
+  ctx->c1 = c1;
 }
 
 /**
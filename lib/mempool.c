@@ -40,6 +40,11 @@ struct linpool {
   uint chunk_size, threshold, total, total_large;
 };
 
+#define LP_PAGE_DATA	(ARENA_PAGE_SIZE - sizeof(struct lp_chunk))
+
+/* Normal chunks fitting in a page are allocated as whole pages */
+static inline int lp_paged(linpool *m) { return m->chunk_size == LP_PAGE_DATA; }
+
 static void lp_free(resource *);
 static void lp_dump(resource *);
 static resource *lp_lookup(resource *, unsigned long);
@@ -61,14 +66,14 @@ static struct resclass lp_class = {
  *
  * lp_new() creates a new linear memory pool resource inside the pool @p.
  * The linear pool consists of a list of memory chunks of size at least
- * @blk.
+ * @blk. Chunks smaller than a page are extended to a whole page.
  */
 linpool
 *lp_new(pool *p, uint blk)
 {
   linpool *m = ralloc(p, &lp_class);
   m->plast = &m->first;
-  m->chunk_size = blk;
+  m->chunk_size = (blk <= LP_PAGE_DATA) ? LP_PAGE_DATA : blk;
   m->threshold = 3*blk/4;
   return m;
 }
@@ -121,7 +126,7 @@ lp_alloc(linpool *m, uint size)
 	  else
 	    {
 	      /* Need to allocate a new chunk */
-	      c = xmalloc(sizeof(struct lp_chunk) + m->chunk_size);
+	      c = lp_paged(m) ? alloc_page() : xmalloc(sizeof(struct lp_chunk) + m->chunk_size);
 	      m->total += m->chunk_size;
 	      *m->plast = c;
 	      m->plast = &c->next;
@@ -208,7 +213,10 @@ lp_free(resource *r)
   for(d=m->first; d; d = c)
     {
       c = d->next;
-      xfree(d);
+      if (lp_paged(m))
+	free_page(d);
+      else
+	xfree(d);
     }
   for(d=m->first_large; d; d = c)
     {
@@ -242,15 +250,19 @@ lp_memsize(resource *r)
 {
   linpool *m = (linpool *) r;
   struct lp_chunk *c;
-  int cnt = 0;
+  int cnt = 0, cntl = 0;
 
   for(c=m->first; c; c=c->next)
     cnt++;
   for(c=m->first_large; c; c=c->next)
-    cnt++;
+    cntl++;
+
+  if (lp_paged(m))
+    return ALLOC_OVERHEAD + sizeof(struct linpool) + cnt * ARENA_PAGE_SIZE +
+      cntl * (ALLOC_OVERHEAD + sizeof(struct lp_chunk)) + m->total_large;
 
   return ALLOC_OVERHEAD + sizeof(struct linpool) +
-    cnt * (ALLOC_OVERHEAD + sizeof(struct lp_chunk)) +
+    (cnt + cntl) * (ALLOC_OVERHEAD + sizeof(struct lp_chunk)) +
     m->total + m->total_large;
 }
 
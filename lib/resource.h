@@ -78,6 +78,12 @@ void sl_free(slab *, void *);
  * outside resource manager and possibly sysdep code.
  */
 
+#define ARENA_PAGE_SIZE 4096
+
+void *alloc_page(void);			/* Page of ARENA_PAGE_SIZE, see sysdep/unix/alloc.c */
+void free_page(void *);
+void page_stats(size_t *used, size_t *mapped);
+
 void buffer_realloc(void **buf, unsigned *size, unsigned need, unsigned item_size);
 
 
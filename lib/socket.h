@@ -47,9 +47,12 @@ typedef struct birdsock {
 
   int af;				/* Address family (AF_INET, AF_INET6 or 0 for non-IP) of fd */
   int fd;				/* System-dependent data */
-  int index;				/* Index in poll buffer */
+  int index;				/* Index in the array of ready sockets, -1 if none */
   int rcv_ttl;				/* TTL of last received datagram */
   node n;
+  u64 seq;				/* Insertion order, keeps order of the socket list */
+  u32 poll_events;			/* Events registered with the kernel (epoll) */
+  int poll_dirty;			/* Registered events should be recomputed */
   void *rbuf_alloc, *tbuf_alloc;
   char *password;			/* Password for MD5 authentication */
   char *err;				/* Error message */
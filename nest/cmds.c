@@ -92,6 +92,11 @@ cmd_show_memory(void)
   print_size("ROA tables:", rmemsize(roa_pool));
   print_size("Protocols:", rmemsize(proto_pool));
   print_size("Total:", rmemsize(&root_pool));
+
+  size_t used, mapped;
+  page_stats(&used, &mapped);
+  print_size("Pages in use:", used);
+  print_size("Pages mapped:", mapped);
   cli_msg(0, "");
 }
 
@@ -15,16 +15,27 @@
 
 /* MRTdump types */
 
+#define TABLE_DUMP_V2		13
 #define BGP4MP			16
 
 /* MRTdump subtypes */
 
+#define PEER_INDEX_TABLE	1
+#define RIB_IPV4_UNICAST	2
+#define RIB_IPV6_UNICAST	4
+
 #define BGP4MP_MESSAGE		1
 #define BGP4MP_MESSAGE_AS4	4
 #define BGP4MP_STATE_CHANGE_AS4	5
 
 
 /* implemented in sysdep */
+struct mrt_stream;
+
+struct mrt_stream *mrt_stream_open(pool *p, char *name, int expand, uint rotate);
+void mrt_stream_write(struct mrt_stream *s, u16 type, u16 subtype, byte *buf, u32 len);
+void mrt_stream_flush(struct mrt_stream *s);
+void mrt_flush_all(void);
 void mrt_dump_message(struct proto *p, u16 type, u16 subtype, byte *buf, u32 len);
 
 #endif
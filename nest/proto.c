@@ -442,6 +442,9 @@ proto_reconfigure(struct proto *p, struct proto_config *oc, struct proto_config
       ah->in_limit = nc->in_limit;
       ah->out_limit = nc->out_limit;
       ah->in_keep_filtered = nc->in_keep_filtered;
+      ah->in_parallel = p->proto->parallel_import && filter_thread_safe(nc->in_filter);
+      ah->in_memo = filter_attrs_only(nc->in_filter);
+      ah->out_shared = filter_shareable(nc->out_filter);
       proto_verify_limits(ah);
     }
 
@@ -923,6 +926,9 @@ protos_build(void)
 #ifdef CONFIG_BABEL
   proto_build(&proto_babel);
 #endif
+#ifdef CONFIG_MRT
+  proto_build(&proto_mrt);
+#endif
 
   proto_pool = rp_new(&root_pool, "Protocols");
   proto_flush_event = ev_new(proto_pool);
@@ -1234,6 +1240,9 @@ proto_want_core_up(struct proto *p)
       p->main_ahook->in_limit = p->cf->in_limit;
       p->main_ahook->out_limit = p->cf->out_limit;
       p->main_ahook->in_keep_filtered = p->cf->in_keep_filtered;
+      p->main_ahook->in_parallel = p->proto->parallel_import && filter_thread_safe(p->cf->in_filter);
+      p->main_ahook->in_memo = filter_attrs_only(p->cf->in_filter);
+      p->main_ahook->out_shared = filter_shareable(p->cf->out_filter);
 
       proto_reset_limit(p->main_ahook->rx_limit);
       proto_reset_limit(p->main_ahook->in_limit);
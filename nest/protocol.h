@@ -40,8 +40,10 @@ struct protocol {
   int name_counter;			/* Counter for automatic name generation */
   int attr_class;			/* Attribute class known to this protocol */
   int multitable;			/* Protocol handles all announce hooks itself */
+  int parallel_import;			/* Import filters may be run by import workers */
   uint preference;			/* Default protocol preference */
   uint config_size;			/* Size of protocol config */
+  uint rte_size;			/* Size of protocol-dependent data in &rte, see RTE_DATA_SIZE() */
 
   void (*preconfig)(struct protocol *, struct config *);	/* Just before configuring */
   void (*postconfig)(struct proto_config *);			/* After configuring each instance */
@@ -76,7 +78,7 @@ void protos_dump_all(void);
 
 extern struct protocol
   proto_device, proto_radv, proto_rip, proto_static,
-  proto_ospf, proto_pipe, proto_bgp, proto_bfd, proto_babel;
+  proto_ospf, proto_pipe, proto_bgp, proto_bfd, proto_babel, proto_mrt;
 
 /*
  *	Routing Protocol Instance
@@ -93,6 +95,7 @@ struct proto_config {
   u32 debug, mrtdump;			/* Debugging bitfields, both use D_* constants */
   unsigned preference, disabled;	/* Generic parameters */
   int in_keep_filtered;			/* Routes rejected in import filter are kept */
+  int roa_reload;			/* Reload routes when ROA tables used in import filter change */
   u32 router_id;			/* Protocol specific router ID */
   struct rtable_config *table;		/* Table we're attached to */
   struct filter *in_filter, *out_filter; /* Attached filters */
@@ -455,6 +458,9 @@ struct announce_hook {
   struct proto_stats *stats;		/* Per-table protocol statistics */
   struct announce_hook *next;		/* Next hook for the same protocol */
   int in_keep_filtered;			/* Routes rejected in import filter are kept */
+  int in_parallel;			/* Imported routes are filtered by import workers */
+  int in_memo;				/* Import filter results may be reused, see filter_attrs_only() */
+  int out_shared;			/* Export filter results may be shared, see filter_shareable() */
 };
 
 struct announce_hook *proto_add_announce_hook(struct proto *p, struct rtable *t, struct proto_stats *stats);
@@ -11,6 +11,8 @@
 
 #include "lib/lists.h"
 #include "lib/resource.h"
+#include "lib/buffer.h"
+#include "lib/hash.h"
 #include "lib/timer.h"
 #include "nest/protocol.h"
 
@@ -50,7 +52,15 @@ struct fib_iterator {			/* See lib/slists.h for an explanation */
   uint hash;
 };
 
+struct fib_trie_node {			/* Node of optional radix trie index */
+  struct fib_trie_node *c[2];		/* Children, by the bit following the prefix */
+  struct fib_node *node;		/* FIB node for this prefix, NULL for branching nodes */
+  ip_addr addr;
+  byte plen;
+};
+
 typedef void (*fib_init_func)(struct fib_node *);
+typedef void (*fib_walk_func)(struct fib_node *, void *);
 
 struct fib {
   pool *fib_pool;			/* Pool holding all our data */
@@ -62,6 +72,8 @@ struct fib {
   uint entries;				/* Number of entries */
   uint entries_min, entries_max;	/* Entry count limits (else start rehashing) */
   fib_init_func init;			/* Constructor */
+  slab *trie_slab;			/* Slab for trie nodes, NULL if trie index not used */
+  struct fib_trie_node *trie;		/* Root of the radix trie index (0/0) */
 };
 
 void fib_init(struct fib *, pool *, unsigned node_size, unsigned hash_order, fib_init_func init);
@@ -71,6 +83,10 @@ void *fib_route(struct fib *, ip_addr, int);	/* Longest-match routing lookup */
 void fib_delete(struct fib *, void *);	/* Remove fib entry */
 void fib_free(struct fib *);		/* Destroy the fib */
 void fib_check(struct fib *);		/* Consistency check for debugging */
+void fib_init_trie(struct fib *);	/* Build and maintain radix trie index */
+void fib_free_trie(struct fib *);	/* Drop radix trie index */
+int fib_route_all(struct fib *, ip_addr, int, struct fib_node **); /* All matching nodes, shortest first */
+void fib_walk_subtree(struct fib *, ip_addr, int, fib_walk_func, void *); /* Visit nodes inside a prefix */
 
 void fit_init(struct fib_iterator *, struct fib *); /* Internal functions, don't call */
 struct fib_node *fit_get(struct fib *, struct fib_iterator *);
@@ -129,6 +145,12 @@ struct rtable_config {
   int gc_max_ops;			/* Maximum number of operations before GC is run */
   int gc_min_time;			/* Minimum time between two consecutive GC runs */
   byte sorted;				/* Routes of network are sorted according to rte_better() */
+  byte trie;				/* Keep radix trie index for longest-prefix lookups */
+};
+
+struct rt_nhu_net {
+  ip_addr prefix;			/* Network to be checked by next hop update */
+  int pxlen;
 };
 
 typedef struct rtable {
@@ -150,9 +172,12 @@ typedef struct rtable {
   byte gc_scheduled;			/* GC is scheduled */
   byte prune_state;			/* Table prune state, 1 -> scheduled, 2-> running */
   byte hcu_scheduled;			/* Hostcache update is scheduled */
-  byte nhu_state;			/* Next Hop Update state */
+  byte nhu_state;			/* Next Hop Update is scheduled */
+  uint rt_count;			/* Number of valid (non-filtered) routes */
+  uint net_count;			/* Number of networks with a valid route */
   struct fib_iterator prune_fit;	/* Rtable prune FIB iterator */
-  struct fib_iterator nhu_fit;		/* Next Hop Update FIB iterator */
+  BUFFER(struct rt_nhu_net) nhu_queue;	/* Networks to be checked by Next Hop Update */
+  uint nhu_pos;				/* Position in nhu_queue */
 } rtable;
 
 #define RPS_NONE	0
@@ -176,6 +201,12 @@ struct hostcache {
   byte update_hostcache;
 };
 
+struct hostdep {
+  struct hostdep *next;			/* Next in hostentry->deps hash chain */
+  net *net;				/* Network with routes using the hostentry, key */
+  uint uc;				/* Number of such routes */
+};
+
 struct hostentry {
   node ln;
   ip_addr addr;				/* IP address of host, part of key */
@@ -189,6 +220,7 @@ struct hostentry {
   ip_addr gw;				/* Chosen next hop */
   byte dest;				/* Chosen route destination type (RTD_...) */
   u32 igp_metric;			/* Chosen route IGP metric */
+  HASH(struct hostdep) deps;		/* Networks in tab with routes using this hostentry */
 };
 
 typedef struct rte {
@@ -199,8 +231,8 @@ typedef struct rte {
   byte flags;				/* Flags (REF_...) */
   byte pflags;				/* Protocol-specific flags */
   word pref;				/* Route preference */
-  bird_clock_t lastmod;			/* Last modified */
-  union {				/* Protocol-dependent data (metrics etc.) */
+  u32 lastmod;				/* Last modified (bird_clock_t) */
+  union {				/* Protocol-dependent data (metrics etc.), allocated just for the source protocol, see rte_get_temp() */
 #ifdef CONFIG_RIP
     struct {
       struct iface *from;		/* Incoming iface */
@@ -236,6 +268,9 @@ typedef struct rte {
   } u;
 } rte;
 
+/* Size of protocol-dependent data @x of &rte, for protocol->rte_size */
+#define RTE_DATA_SIZE(x)	sizeof(((rte *) 0)->u.x)
+
 #define REF_COW		1		/* Copy this rte on write */
 #define REF_FILTERED	2		/* Route is rejected by import filter */
 #define REF_STALE	4		/* Route is stale in a refresh cycle */
@@ -273,6 +308,7 @@ static inline net *net_get(rtable *tab, ip_addr addr, unsigned len) { return (ne
 rte *rte_find(net *net, struct rte_src *src);
 rte *rte_get_temp(struct rta *);
 void rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src);
+void rte_update_flush(void);
 static inline void rte_update(struct proto *p, net *net, rte *new) { rte_update2(p->main_ahook, net, new, p->main_source); }
 int rt_examine(rtable *t, ip_addr prefix, int pxlen, struct proto *p, struct filter *filter);
 rte *rt_export_merged(struct announce_hook *ah, net *net, rte **rt_free, struct ea_list **tmpa, linpool *pool, int silent);
@@ -290,6 +326,8 @@ void rt_feed_baby_abort(struct proto *p);
 int rt_prune_loop(void);
 struct rtable_config *rt_new_table(struct symbol *s);
 
+extern u32 rte_announce_id;
+
 static inline void
 rt_mark_for_prune(rtable *tab)
 {
@@ -356,7 +394,7 @@ typedef struct rta {
   byte dest;				/* Route destination type (RTD_...) */
   byte flags;				/* Route flags (RTF_...), now unused */
   byte aflags;				/* Attribute cache flags (RTAF_...) */
-  u16 hash_key;				/* Hash over important fields */
+  u32 hash_key;				/* Hash over important fields */
   u32 igp_metric;			/* IGP metric to next hop (for iBGP routes) */
   ip_addr gw;				/* Next hop */
   ip_addr from;				/* Advertising router */
@@ -498,7 +536,8 @@ void ea_sort(ea_list *);		/* Sort entries in all sub-lists */
 unsigned ea_scan(ea_list *);		/* How many bytes do we need for merged ea_list */
 void ea_merge(ea_list *from, ea_list *to); /* Merge sub-lists to allocated buffer */
 int ea_same(ea_list *x, ea_list *y);	/* Test whether two ea_lists are identical */
-uint ea_hash(ea_list *e);	/* Calculate 16-bit hash value */
+uint ea_hash(ea_list *e);	/* Calculate 32-bit hash value */
+int rte_tmpa_same(ea_list *x, ea_list *y);	/* The same for chained lists of temporary attributes */
 ea_list *ea_append(ea_list *to, ea_list *what);
 void ea_format_bitfield(struct eattr *a, byte *buf, int bufsize, const char **names, int min, int max);
 
@@ -572,13 +611,16 @@ struct roa_item {
   u32 asn;
   byte maxlen;
   byte src;
-  struct roa_item *next;
 };
 
 struct roa_node {
   struct fib_node n;
-  struct roa_item *items;
-  // u32 cached_asn;
+  BUFFER(struct roa_item) items;	/* Sorted by ASN, then by maxlen (descending) */
+};
+
+struct roa_change {
+  ip_addr prefix;
+  byte pxlen;
 };
 
 struct roa_table {
@@ -586,6 +628,10 @@ struct roa_table {
   struct fib fib;
   char *name;				/* Name of this ROA table */
   struct roa_table_config *cf;		/* Configuration of this ROA table */
+  BUFFER(struct roa_change) changes;	/* Prefixes changed since last revalidation */
+  byte changes_all;			/* Too many changes, consider everything changed */
+  timer *change_timer;			/* Postponed revalidation of dependent protocols */
+  bird_clock_t last_reload;		/* Last time dependent protocols were reloaded */
 };
 
 struct roa_item_config {
@@ -195,12 +195,12 @@ rt_prune_sources(void)
  *	Multipath Next Hop
  */
 
-static inline uint
+static inline u32
 mpnh_hash(struct mpnh *x)
 {
-  uint h = 0;
+  u32 h = 0;
   for (; x; x = x->next)
-    h ^= ipa_hash(x->gw);
+    h ^= ipa_hash32(x->gw);
 
   return h;
 }
@@ -666,24 +666,113 @@ ea_merge(ea_list *e, ea_list *t)
     }
 }
 
+/*
+ *	Interned attribute data
+ *
+ *	Non-embedded attribute values (AS paths, community lists, ...) of
+ *	cached &ea_list's are shared between all cached lists carrying the
+ *	same value. They are kept in a global hash table keyed by their
+ *	contents and reference counted, so two interned values are equal
+ *	iff their pointers are equal.
+ */
+
+struct adata_cached {
+  struct adata_cached *next;		/* Hash chain */
+  u32 hash;				/* Hash of the data, see adata_hash() */
+  uint uc;				/* Use count */
+  struct adata ad;			/* Must be last */
+};
+
+#define ADH_KEY(n)		n->hash, &n->ad
+#define ADH_NEXT(n)		n->next
+#define ADH_EQ(h1,a1,h2,a2)	h1 == h2 && adata_same(a1, a2)
+#define ADH_FN(h,a)		h
+
+#define ADH_REHASH		adata_rehash
+#define ADH_PARAMS		/8, *2, 2, 2, 10, 24
+#define ADH_INIT_ORDER		10
+
+static HASH(struct adata_cached) adata_hash_table;
+
+HASH_DEFINE_REHASH_FN(ADH, struct adata_cached)
+
+static u32
+adata_hash(struct adata *d)
+{
+  u32 h = d->length;
+  int size = d->length;
+  byte *z = d->data;
+
+  while (size >= 4)
+    {
+      h = ((h << 7) | (h >> 25)) ^ *(u32 *)z;
+      z += 4;
+      size -= 4;
+    }
+  while (size--)
+    h = (h >> 24) ^ (h << 8) ^ *z++;
+
+  h = u32_hash(h);
+  return h ^ (h >> 16);
+}
+
+static inline struct adata_cached *
+adata_cached(struct adata *d)
+{
+  return SKIP_BACK(struct adata_cached, ad, d);
+}
+
+static struct adata *
+adata_intern(struct adata *d)
+{
+  u32 h = adata_hash(d);
+  struct adata_cached *c = HASH_FIND(adata_hash_table, ADH, h, d);
+
+  if (!c)
+    {
+      c = mb_alloc(rta_pool, sizeof(struct adata_cached) + d->length);
+      c->hash = h;
+      c->uc = 0;
+      memcpy(&c->ad, d, sizeof(struct adata) + d->length);
+      HASH_INSERT2(adata_hash_table, ADH, rta_pool, c);
+    }
+
+  c->uc++;
+  return &c->ad;
+}
+
+static void
+adata_release(struct adata *d)
+{
+  struct adata_cached *c = adata_cached(d);
+
+  if (--c->uc)
+    return;
+
+  HASH_REMOVE2(adata_hash_table, ADH, rta_pool, c);
+  mb_free(c);
+}
+
 /**
  * ea_same - compare two &ea_list's
  * @x: attribute list
  * @y: attribute list
  *
  * ea_same() compares two normalized attribute lists @x and @y and returns
- * 1 if they contain the same attributes, 0 otherwise.
+ * 1 if they contain the same attributes, 0 otherwise. Data of two cached
+ * lists are compared just by pointers, as they are interned.
  */
 int
 ea_same(ea_list *x, ea_list *y)
 {
-  int c;
+  int c, cached;
 
   if (!x || !y)
     return x == y;
   ASSERT(!x->next && !y->next);
   if (x->count != y->count)
     return 0;
+  cached = x->flags & y->flags & EALF_CACHED;
   for(c=0; c<x->count; c++)
     {
       eattr *a = &x->attrs[c];
@@ -691,9 +780,19 @@ ea_same(ea_list *x, ea_list *y)
 
       if (a->id != b->id ||
 	  a->flags != b->flags ||
-	  a->type != b->type ||
-	  ((a->type & EAF_EMBEDDED) ? a->u.data != b->u.data : !adata_same(a->u.ptr, b->u.ptr)))
+	  a->type != b->type)
 	return 0;
+
+      if (a->type & EAF_EMBEDDED)
+	{
+	  if (a->u.data != b->u.data)
+	    return 0;
+	}
+      else if (a->u.ptr != b->u.ptr)
+	{
+	  if (cached || !adata_same(a->u.ptr, b->u.ptr))
+	    return 0;
+	}
     }
   return 1;
 }
@@ -715,12 +814,7 @@ ea_list_copy(ea_list *o)
     {
       eattr *a = &n->attrs[i];
       if (!(a->type & EAF_EMBEDDED))
-	{
-	  unsigned size = sizeof(struct adata) + a->u.ptr->length;
-	  struct adata *d = mb_alloc(rta_pool, size);
-	  memcpy(d, a->u.ptr, size);
-	  a->u.ptr = d;
-	}
+	a->u.ptr = adata_intern(a->u.ptr);
     }
   return n;
 }
@@ -737,7 +831,7 @@ ea_free(ea_list *o)
 	{
 	  eattr *a = &o->attrs[i];
 	  if (!(a->type & EAF_EMBEDDED))
-	    mb_free(a->u.ptr);
+	    adata_release(a->u.ptr);
 	}
       mb_free(o);
     }
@@ -967,7 +1061,10 @@ ea_dump(ea_list *e)
  * @e: attribute list
  *
  * ea_hash() takes an extended attribute list and calculated a hopefully
- * uniformly distributed hash value from its contents.
+ * uniformly distributed 32-bit hash value from its contents. Both its
+ * low-order and high-order bits are mixed, so it can be used with both
+ * masked and shifted hash table indices. Cached lists reuse the hash
+ * values of their interned data.
  */
 inline uint
 ea_hash(ea_list *e)
@@ -980,27 +1077,16 @@ ea_hash(ea_list *e)
       for(i=0; i<e->count; i++)
 	{
 	  struct eattr *a = &e->attrs[i];
-	  h ^= a->id;
+	  h = ((h << 5) | (h >> 27)) ^ a->id;
 	  if (a->type & EAF_EMBEDDED)
 	    h ^= a->u.data;
+	  else if (e->flags & EALF_CACHED)
+	    h ^= adata_cached(a->u.ptr)->hash;
 	  else
-	    {
-	      struct adata *d = a->u.ptr;
-	      int size = d->length;
-	      byte *z = d->data;
-	      while (size >= 4)
-		{
-		  h ^= *(u32 *)z;
-		  z += 4;
-		  size -= 4;
-		}
-	      while (size--)
-		h = (h >> 24) ^ (h << 8) ^ *z++;
-	    }
+	    h ^= adata_hash(a->u.ptr);
 	}
+      h = u32_hash(h);
       h ^= h >> 16;
-      h ^= h >> 6;
-      h &= 0xffff;
     }
   return h;
 }
@@ -1031,28 +1117,46 @@ ea_append(ea_list *to, ea_list *what)
  *	rta's
  */
 
+/*
+ * The rta cache is a chained hash table indexed by the high-order bits of
+ * a 32-bit hash. When it grows, a table twice as large is allocated and
+ * the entries are moved to it incrementally -- a few old buckets with each
+ * rta_lookup(), plus the bucket the looked up key belongs to. Therefore
+ * only the new table has to be searched and a growing cache never stops
+ * the world to rehash millions of entries at once.
+ */
+
+#define RTA_HASH_INIT_ORDER	5
+#define RTA_HASH_MAX_ORDER	28
+#define RTA_REHASH_STEP		4	/* Old buckets moved per lookup */
+
 static uint rta_cache_count;
-static uint rta_cache_size = 32;
+static uint rta_cache_order;
 static uint rta_cache_limit;
-static uint rta_cache_mask;
 static rta **rta_hash_table;
+static uint rta_old_order;		/* Order of the table being rehashed */
+static uint rta_rehash_pos;		/* Next old bucket to be moved */
+static rta **rta_old_table;		/* Table being rehashed, NULL if none */
+
+#define RTA_HASH_SIZE(order)	(1U << (order))
+#define RTA_HASH_INDEX(h,order)	((h) >> (32 - (order)))
 
 static void
-rta_alloc_hash(void)
+rta_alloc_hash(uint order)
 {
-  rta_hash_table = mb_allocz(rta_pool, sizeof(rta *) * rta_cache_size);
-  if (rta_cache_size < 32768)
-    rta_cache_limit = rta_cache_size * 2;
+  rta_cache_order = order;
+  rta_hash_table = mb_allocz(rta_pool, sizeof(rta *) * RTA_HASH_SIZE(order));
+  if (order < RTA_HASH_MAX_ORDER)
+    rta_cache_limit = RTA_HASH_SIZE(order) * 2;
   else
     rta_cache_limit = ~0;
-  rta_cache_mask = rta_cache_size - 1;
 }
 
-static inline uint
+static inline u32
 rta_hash(rta *a)
 {
-  return (((uint) (uintptr_t) a->src) ^ ipa_hash(a->gw) ^
-	  mpnh_hash(a->nexthops) ^ ea_hash(a->eattrs)) & 0xffff;
+  return u32_hash(((u32) (uintptr_t) a->src) ^ ipa_hash32(a->gw) ^
+		  mpnh_hash(a->nexthops) ^ ea_hash(a->eattrs));
 }
 
 static inline int
@@ -1088,32 +1192,56 @@ rta_copy(rta *o)
 static inline void
 rta_insert(rta *r)
 {
-  uint h = r->hash_key & rta_cache_mask;
-  r->next = rta_hash_table[h];
+  rta **hp = &rta_hash_table[RTA_HASH_INDEX(r->hash_key, rta_cache_order)];
+  r->next = *hp;
   if (r->next)
     r->next->pprev = &r->next;
-  r->pprev = &rta_hash_table[h];
-  rta_hash_table[h] = r;
+  r->pprev = hp;
+  *hp = r;
 }
 
-static void
-rta_rehash(void)
+static inline void
+rta_rehash_bucket(uint h)
 {
-  uint ohs = rta_cache_size;
-  uint h;
   rta *r, *n;
-  rta **oht = rta_hash_table;
 
-  rta_cache_size = 2*rta_cache_size;
-  DBG("Rehashing rta cache from %d to %d entries.\n", ohs, rta_cache_size);
-  rta_alloc_hash();
-  for(h=0; h<ohs; h++)
-    for(r=oht[h]; r; r=n)
-      {
-	n = r->next;
-	rta_insert(r);
-      }
-  mb_free(oht);
+  for (r = rta_old_table[h]; r; r = n)
+    {
+      n = r->next;
+      rta_insert(r);
+    }
+  rta_old_table[h] = NULL;
+}
+
+static void
+rta_rehash_step(uint steps)
+{
+  uint ohs = RTA_HASH_SIZE(rta_old_order);
+
+  for (; steps && (rta_rehash_pos < ohs); steps--)
+    rta_rehash_bucket(rta_rehash_pos++);
+
+  if (rta_rehash_pos == ohs)
+    {
+      DBG("Rehashing of rta cache to %d entries done.\n", RTA_HASH_SIZE(rta_cache_order));
+      mb_free(rta_old_table);
+      rta_old_table = NULL;
+    }
+}
+
+static void
+rta_rehash(void)
+{
+  /* Should not happen, the previous rehash proceeds faster than the cache grows */
+  if (rta_old_table)
+    rta_rehash_step(~0);
+
+  DBG("Rehashing rta cache from %d to %d entries.\n",
+      RTA_HASH_SIZE(rta_cache_order), RTA_HASH_SIZE(rta_cache_order + 1));
+  rta_old_table = rta_hash_table;
+  rta_old_order = rta_cache_order;
+  rta_rehash_pos = 0;
+  rta_alloc_hash(rta_cache_order + 1);
 }
 
 /**
@@ -1148,7 +1276,13 @@ rta_lookup(rta *o)
     }
 
   h = rta_hash(o);
-  for(r=rta_hash_table[h & rta_cache_mask]; r; r=r->next)
+  if (rta_old_table)
+    {
+      rta_rehash_bucket(RTA_HASH_INDEX(h, rta_old_order));
+      rta_rehash_step(RTA_REHASH_STEP);
+    }
+
+  for(r=rta_hash_table[RTA_HASH_INDEX(h, rta_cache_order)]; r; r=r->next)
     if (r->hash_key == h && rta_same(r, o))
       return rta_clone(r);
 
@@ -1207,7 +1341,7 @@ rta_dump(rta *a)
   static char *rtc[] = { "", " BC", " MC", " AC" };
   static char *rtd[] = { "", " DEV", " HOLE", " UNREACH", " PROHIBIT" };
 
-  debug("p=%s uc=%d %s %s%s%s h=%04x",
+  debug("p=%s uc=%d %s %s%s%s h=%08x",
 	a->src->proto->name, a->uc, rts[a->source], ip_scope_text(a->scope), rtc[a->cast],
 	rtd[a->dest], a->hash_key);
   if (!(a->aflags & RTAF_CACHED))
@@ -1237,13 +1371,21 @@ rta_dump_all(void)
   uint h;
 
   debug("Route attribute cache (%d entries, rehash at %d):\n", rta_cache_count, rta_cache_limit);
-  for(h=0; h<rta_cache_size; h++)
+  for(h=0; h<RTA_HASH_SIZE(rta_cache_order); h++)
     for(a=rta_hash_table[h]; a; a=a->next)
       {
 	debug("%p ", a);
 	rta_dump(a);
 	debug("\n");
       }
+  if (rta_old_table)
+    for(h=rta_rehash_pos; h<RTA_HASH_SIZE(rta_old_order); h++)
+      for(a=rta_old_table[h]; a; a=a->next)
+	{
+	  debug("%p ", a);
+	  rta_dump(a);
+	  debug("\n");
+	}
   debug("\n");
 }
 
@@ -1275,7 +1417,8 @@ rta_init(void)
   rta_pool = rp_new(&root_pool, "Attributes");
   rta_slab = sl_new(rta_pool, sizeof(rta));
   mpnh_slab = sl_new(rta_pool, sizeof(struct mpnh));
-  rta_alloc_hash();
+  rta_alloc_hash(RTA_HASH_INIT_ORDER);
+  HASH_INIT(adata_hash_table, rta_pool, ADH_INIT_ORDER);
   rte_src_init();
 }
 
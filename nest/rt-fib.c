@@ -32,6 +32,17 @@
  * Basic FIB operations are performed by functions defined by this module,
  * enumerating of FIB contents is accomplished by using the FIB_WALK() macro
  * or FIB_ITERATE_START() if you want to do it asynchronously.
+ *
+ * Optionally, a FIB may keep a radix trie index (see fib_init_trie()) next to
+ * the hash table. The trie is a path-compressed binary trie of &fib_trie_node
+ * structures, each representing one prefix and possibly pointing to the FIB
+ * node of that prefix. Nodes without an attached FIB node are just branching
+ * points and there is always a root node for the zero-length prefix. The trie
+ * is used for longest-prefix matching in fib_route() and for ordered walks of
+ * a subtree in fib_walk_subtree(), both of which take time proportional to the
+ * prefix length instead of the number of prefix lengths times a hash lookup.
+ * Exact-match searches and asynchronous reading still use the hash table, so
+ * the semantics of &fib_iterator is not affected by the trie.
  */
 
 #undef LOCAL_DEBUG
@@ -194,6 +205,265 @@ fib_histogram(struct fib *f)
 }
 */
 
+/*
+ *	Radix trie index
+ */
+
+static struct fib_trie_node *
+fib_trie_new_node(struct fib *f, ip_addr a, int plen, struct fib_node *n)
+{
+  struct fib_trie_node *t = sl_alloc(f->trie_slab);
+  t->c[0] = t->c[1] = NULL;
+  t->node = n;
+  t->addr = ipa_and(a, ipa_mkmask(plen));
+  t->plen = plen;
+  return t;
+}
+
+static inline struct fib_trie_node **
+fib_trie_slot(struct fib_trie_node *t, ip_addr a)
+{
+  return &t->c[ipa_getbit(a, t->plen) ? 1 : 0];
+}
+
+static void
+fib_trie_add(struct fib *f, struct fib_node *e)
+{
+  struct fib_trie_node *t = f->trie, *c, *x, *b, **pp;
+  int plen = e->pxlen;
+
+  /* Invariant: prefix of node t is a prefix of e->prefix/plen */
+  while (t->plen < plen)
+    {
+      pp = fib_trie_slot(t, e->prefix);
+      c = *pp;
+
+      if (!c)
+	{
+	  /* Append a new leaf */
+	  *pp = fib_trie_new_node(f, e->prefix, plen, e);
+	  return;
+	}
+
+      if (!ipa_in_net(e->prefix, c->addr, MIN(c->plen, plen)))
+	{
+	  /* Out of path - add a branching node for the common part */
+	  int blen = ipa_pxlen(e->prefix, c->addr);
+	  x = fib_trie_new_node(f, e->prefix, plen, e);
+	  b = fib_trie_new_node(f, e->prefix, blen, NULL);
+	  *fib_trie_slot(b, c->addr) = c;
+	  *fib_trie_slot(b, x->addr) = x;
+	  *pp = b;
+	  return;
+	}
+
+      if (plen < c->plen)
+	{
+	  /* Insert a new node between t and c */
+	  x = fib_trie_new_node(f, e->prefix, plen, e);
+	  *fib_trie_slot(x, c->addr) = c;
+	  *pp = x;
+	  return;
+	}
+
+      t = c;
+    }
+
+  /* Node for this prefix already exists as a branching node */
+  t->node = e;
+}
+
+static void
+fib_trie_remove(struct fib *f, struct fib_node *e)
+{
+  struct fib_trie_node *t = f->trie, *c;
+  struct fib_trie_node **pp = NULL, **ppp = NULL;
+
+  while (t->plen < e->pxlen)
+    {
+      ppp = pp;
+      pp = fib_trie_slot(t, e->prefix);
+      t = *pp;
+      ASSERT(t);
+    }
+
+  ASSERT(t->node == e);
+  t->node = NULL;
+
+  /* The root node is never removed */
+  if (!pp)
+    return;
+
+  /* Branching node with two children stays */
+  if (t->c[0] && t->c[1])
+    return;
+
+  *pp = t->c[0] ? : t->c[1];
+  sl_free(f->trie_slab, t);
+
+  if (*pp || !ppp)
+    return;
+
+  /* The parent may have become a branching node with just one child */
+  t = *ppp;
+  if (!t->node)
+    {
+      c = t->c[0] ? : t->c[1];
+      *ppp = c;
+      sl_free(f->trie_slab, t);
+    }
+}
+
+/**
+ * fib_route_all - find all FIB nodes matching an address
+ * @f: FIB with a trie index
+ * @a: IP address of the prefix
+ * @len: prefix length
+ * @nodes: buffer for at least MAX_PREFIX_LENGTH+1 matching nodes
+ *
+ * Store all FIB nodes whose prefix covers @a/@len (including the prefix
+ * itself) to @nodes, ordered from the shortest prefix to the longest one.
+ * This is useful for longest-prefix matching with additional conditions
+ * on the matched node. Works only for FIBs with trie index. Returns the
+ * number of nodes stored.
+ */
+int
+fib_route_all(struct fib *f, ip_addr a, int len, struct fib_node **nodes)
+{
+  struct fib_trie_node *t = f->trie;
+  int i = 0;
+
+  ASSERT(t);
+  while (t && (t->plen <= len) && ipa_in_net(a, t->addr, t->plen))
+    {
+      if (t->node)
+	nodes[i++] = t->node;
+
+      if (t->plen == len)
+	break;
+
+      t = *fib_trie_slot(t, a);
+    }
+
+  return i;
+}
+
+static void *
+fib_trie_route(struct fib *f, ip_addr a, int len)
+{
+  struct fib_trie_node *t = f->trie;
+  struct fib_node *n = NULL;
+
+  while (t && (t->plen <= len) && ipa_in_net(a, t->addr, t->plen))
+    {
+      if (t->node)
+	n = t->node;
+
+      if (t->plen == len)
+	break;
+
+      t = *fib_trie_slot(t, a);
+    }
+
+  return n;
+}
+
+static void
+fib_trie_walk(struct fib_trie_node *t, fib_walk_func hook, void *data)
+{
+  /* Depth is bounded by MAX_PREFIX_LENGTH, recursion is fine */
+  if (t->node)
+    hook(t->node, data);
+  if (t->c[0])
+    fib_trie_walk(t->c[0], hook, data);
+  if (t->c[1])
+    fib_trie_walk(t->c[1], hook, data);
+}
+
+/**
+ * fib_walk_subtree - walk all FIB nodes inside a prefix
+ * @f: FIB to walk
+ * @a: IP address of the prefix
+ * @len: prefix length
+ * @hook: function called for each node
+ * @data: user data passed to @hook
+ *
+ * Call @hook for each FIB node whose prefix is inside of @a/@len
+ * (including the prefix itself). With trie index, only relevant part of
+ * the FIB is visited and the nodes are visited in the prefix order (a prefix
+ * before its subprefixes, lower addresses first). Without trie index, the
+ * whole FIB is scanned and the order is unspecified. The @hook must not
+ * add or remove nodes of the FIB.
+ */
+void
+fib_walk_subtree(struct fib *f, ip_addr a, int len, fib_walk_func hook, void *data)
+{
+  struct fib_trie_node *t = f->trie;
+
+  if (!t)
+    {
+      FIB_WALK(f, n)
+	{
+	  if (net_in_net(n->prefix, n->pxlen, a, len))
+	    hook(n, data);
+	}
+      FIB_WALK_END;
+      return;
+    }
+
+  while (t->plen < len)
+    {
+      t = *fib_trie_slot(t, a);
+      if (!t)
+	return;
+    }
+
+  if (ipa_in_net(t->addr, a, len))
+    fib_trie_walk(t, hook, data);
+}
+
+/**
+ * fib_init_trie - enable radix trie index of a FIB
+ * @f: FIB
+ *
+ * This function allocates a radix trie index for FIB @f, fills it with
+ * all existing nodes and keeps it updated by following fib_get() and
+ * fib_delete() calls. With the index, fib_route() and fib_walk_subtree()
+ * are much faster, at the cost of extra memory and slower updates.
+ */
+void
+fib_init_trie(struct fib *f)
+{
+  if (f->trie)
+    return;
+
+  f->trie_slab = sl_new(f->fib_pool, sizeof(struct fib_trie_node));
+  f->trie = fib_trie_new_node(f, IPA_NONE, 0, NULL);
+
+  FIB_WALK(f, n)
+    {
+      fib_trie_add(f, n);
+    }
+  FIB_WALK_END;
+}
+
+/**
+ * fib_free_trie - disable radix trie index of a FIB
+ * @f: FIB
+ *
+ * This function frees the radix trie index of FIB @f, if there is one.
+ */
+void
+fib_free_trie(struct fib *f)
+{
+  if (!f->trie)
+    return;
+
+  rfree(f->trie_slab);
+  f->trie_slab = NULL;
+  f->trie = NULL;
+}
+
 /**
  * fib_get - find or create a FIB node
  * @f: FIB to work with
@@ -240,6 +510,8 @@ fib_get(struct fib *f, ip_addr *a, int len)
   e->uid = uid;
   *ee = e;
   e->readers = NULL;
+  if (f->trie)
+    fib_trie_add(f, e);
   f->init(e);
   if (f->entries++ > f->entries_max)
     fib_rehash(f, HASH_HI_STEP);
@@ -263,6 +535,9 @@ fib_route(struct fib *f, ip_addr a, int len)
   ip_addr a0;
   void *t;
 
+  if (f->trie)
+    return fib_trie_route(f, a, len);
+
   while (len >= 0)
     {
       a0 = ipa_and(a, ipa_mkmask(len));
@@ -343,6 +618,8 @@ fib_delete(struct fib *f, void *E)
 		}
 	      fib_merge_readers(it, l);
 	    }
+	  if (f->trie)
+	    fib_trie_remove(f, e);
 	  sl_free(f->fib_slab, e);
 	  if (f->entries-- < f->entries_min)
 	    fib_rehash(f, -HASH_LO_STEP);
@@ -365,6 +642,7 @@ fib_free(struct fib *f)
 {
   fib_ht_free(f->hash_table);
   rfree(f->fib_slab);
+  fib_free_trie(f);
 }
 
 void
@@ -451,6 +729,21 @@ found:
 
 #ifdef DEBUGGING
 
+struct fib_check_trie {
+  struct fib *fib;
+  uint count;
+};
+
+static void
+fib_check_trie_node(struct fib_node *n, void *data)
+{
+  struct fib_check_trie *ct = data;
+
+  if (fib_find(ct->fib, &n->prefix, n->pxlen) != n)
+    bug("fib_check: trie node %I/%d not in hash", n->prefix, n->pxlen);
+  ct->count++;
+}
+
 /**
  * fib_check - audit a FIB
  * @f: FIB to be checked
@@ -496,6 +789,14 @@ fib_check(struct fib *f)
     }
   if (ec != f->entries)
     bug("fib_check: invalid entry count (%d != %d)", ec, f->entries);
+
+  if (f->trie)
+    {
+      struct fib_check_trie ct = { .fib = f };
+      fib_walk_subtree(f, IPA_NONE, 0, fib_check_trie_node, &ct);
+      if (ct.count != f->entries)
+	bug("fib_check: invalid trie entry count (%d != %d)", ct.count, f->entries);
+    }
 }
 
 #endif
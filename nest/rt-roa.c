@@ -10,6 +10,8 @@
 #include "nest/bird.h"
 #include "nest/route.h"
 #include "nest/cli.h"
+#include "nest/protocol.h"
+#include "filter/filter.h"
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/event.h"
@@ -18,14 +20,160 @@
 
 
 pool *roa_pool;
-static slab *roa_slab;			/* Slab of struct roa_item */
 static list roa_table_list;		/* List of struct roa_table */
 struct roa_table *roa_table_default;	/* The first ROA table in the config */
 
+/*
+ * ROA tables keep ROA entries in a FIB with a radix trie index, so all ROAs
+ * covering a prefix are found by one trie descent (see fib_route_all()).
+ * Entries of one node are kept in an array sorted by ASN and then by maxlen
+ * in descending order, therefore the best candidate for a given ASN is found
+ * by bisection. Nodes without entries are removed from the FIB.
+ */
+
 static inline int
 src_match(struct roa_item *it, byte src)
 { return !src || it->src == src; }
 
+/* Position of the first item not ordered before (asn, maxlen) */
+static inline uint
+roa_node_bisect(struct roa_node *n, u32 asn, byte maxlen)
+{
+  uint lo = 0, hi = n->items.used;
+
+  while (lo < hi)
+    {
+      uint m = (lo + hi) / 2;
+      struct roa_item *it = &n->items.data[m];
+
+      if ((it->asn < asn) || ((it->asn == asn) && (it->maxlen > maxlen)))
+	lo = m + 1;
+      else
+	hi = m;
+    }
+
+  return lo;
+}
+
+/*
+ * Changes of ROA tables are recorded as a list of affected ROA prefixes and
+ * after a short delay, protocols with the 'roa reload' option whose import
+ * filter uses the changed ROA table are examined. A protocol is reloaded if
+ * it has a route in the subtree of any changed ROA prefix, as only such
+ * routes could get a different result from roa_check(). Routes rejected by
+ * the import filter are visible only with 'import keep filtered', so other
+ * protocols are reloaded after any change of the ROA table. To keep ROA churn
+ * from causing repeated full reloads, revalidations of one ROA table are at
+ * least %ROA_RELOAD_INTERVAL apart and changes are collected in the meantime.
+ */
+
+#define ROA_CHANGE_DELAY	1	/* Seconds to collect changes before revalidation */
+#define ROA_RELOAD_INTERVAL	30	/* Minimal seconds between revalidations of one table */
+#define ROA_CHANGES_MAX		1024	/* Changes recorded before switching to changes_all */
+
+static void
+roa_notify_change(struct roa_table *t, ip_addr prefix, byte pxlen)
+{
+  if (!t->changes_all)
+    {
+      if (t->changes.used < ROA_CHANGES_MAX)
+	BUFFER_PUSH(t->changes) = (struct roa_change) { .prefix = prefix, .pxlen = pxlen };
+      else
+	t->changes_all = 1;
+    }
+
+  if (!tm_active(t->change_timer))
+  {
+    bird_clock_t delay = ROA_CHANGE_DELAY;
+
+    if (t->last_reload)
+      delay = MAX(delay, t->last_reload + ROA_RELOAD_INTERVAL - now);
+
+    tm_start(t->change_timer, delay);
+  }
+}
+
+struct roa_hook_walk {
+  struct announce_hook *ah;
+  int found;
+};
+
+static void
+roa_find_route(struct fib_node *fn, void *data)
+{
+  struct roa_hook_walk *w = data;
+  rte *e;
+
+  for (e = ((net *) fn)->routes; e; e = e->next)
+    if (e->sender == w->ah)
+      w->found = 1;
+}
+
+static int
+roa_hook_affected(struct roa_table *t, struct announce_hook *ah)
+{
+  struct roa_hook_walk w = { .ah = ah };
+  uint i;
+
+  if (!ah->in_keep_filtered)
+    return 1;
+
+  if (t->changes_all)
+    fib_walk_subtree(&ah->table->fib, IPA_NONE, 0, roa_find_route, &w);
+
+  for (i = 0; (i < t->changes.used) && !w.found; i++)
+    fib_walk_subtree(&ah->table->fib, t->changes.data[i].prefix,
+		     t->changes.data[i].pxlen, roa_find_route, &w);
+
+  return w.found;
+}
+
+static void
+roa_change_timer(timer *tm)
+{
+  struct roa_table *t = tm->data;
+  struct announce_hook *ah;
+  struct proto *p;
+  int reloaded = 0;
+
+  WALK_LIST(p, active_proto_list)
+    {
+      if (!p->cf->roa_reload || (p->proto_state != PS_UP) || !p->reload_routes)
+	continue;
+
+      /* Import filter of pipes is not attached to their announce hooks */
+      if (!filter_uses_roa(p->cf->in_filter, t->cf))
+	continue;
+
+      for (ah = p->ahooks; ah; ah = ah->next)
+	if (roa_hook_affected(t, ah))
+	  break;
+
+      if (!ah)
+	continue;
+
+      log(L_INFO "Reloading protocol %s due to change of ROA table %s", p->name, t->name);
+      if (!p->reload_routes(p))
+	log(L_WARN "%s: reload failed", p->name);
+
+      reloaded = 1;
+    }
+
+  /* Only reloads count for the rate limit, cheap subtree checks do not */
+  if (reloaded)
+    t->last_reload = now;
+
+  BUFFER_FLUSH(t->changes);
+  t->changes_all = 0;
+}
+
+static void
+roa_node_free(struct roa_table *t, struct roa_node *n)
+{
+  mb_free(n->items.data);
+  fib_delete(&t->fib, n);
+}
+
 /**
  * roa_add_item - add a ROA entry
  * @t: ROA table
@@ -43,21 +191,23 @@ void
 roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src)
 {
   struct roa_node *n = fib_get(&t->fib, &prefix, pxlen);
+  uint i, pos = roa_node_bisect(n, asn, maxlen);
 
-  // if ((n->items == NULL) && (n->n.x0 != ROA_INVALID))
-  // t->cached_items--;
+  for (i = pos; i < n->items.used; i++)
+    {
+      struct roa_item *it = &n->items.data[i];
+      if ((it->asn != asn) || (it->maxlen != maxlen))
+	break;
+      if (src_match(it, src))
+	return;
+    }
 
-  struct roa_item *it;
-  for (it = n->items; it; it = it->next)
-    if ((it->maxlen == maxlen) && (it->asn == asn) && src_match(it, src))
-      return;
+  BUFFER_INC(n->items, 1);
+  memmove(n->items.data + pos + 1, n->items.data + pos,
+	  (n->items.used - pos - 1) * sizeof(struct roa_item));
+  n->items.data[pos] = (struct roa_item) { .asn = asn, .maxlen = maxlen, .src = src };
 
-  it = sl_alloc(roa_slab);
-  it->asn = asn;
-  it->maxlen = maxlen;
-  it->src = src;
-  it->next = n->items;
-  n->items = it;
+  roa_notify_change(t, prefix, pxlen);
 }
 
 /**
@@ -77,23 +227,31 @@ void
 roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src)
 {
   struct roa_node *n = fib_find(&t->fib, &prefix, pxlen);
+  uint i;
 
   if (!n)
     return;
 
-  struct roa_item *it, **itp;
-  for (itp = &n->items; it = *itp; itp = &it->next)
-    if ((it->maxlen == maxlen) && (it->asn == asn) && src_match(it, src))
-      break;
+  for (i = roa_node_bisect(n, asn, maxlen); i < n->items.used; i++)
+    {
+      struct roa_item *it = &n->items.data[i];
+      if ((it->asn != asn) || (it->maxlen != maxlen))
+	return;
+      if (src_match(it, src))
+	break;
+    }
 
-  if (!it)
+  if (i == n->items.used)
     return;
 
-  *itp = it->next;
-  sl_free(roa_slab, it);
+  memmove(n->items.data + i, n->items.data + i + 1,
+	  (n->items.used - i - 1) * sizeof(struct roa_item));
+  BUFFER_POP(n->items);
+
+  if (!n->items.used)
+    roa_node_free(t, n);
 
-  // if ((n->items == NULL) && (n->n.x0 != ROA_INVALID))
-  // t->cached_items++;
+  roa_notify_change(t, prefix, pxlen);
 }
 
 
@@ -109,60 +267,36 @@ roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u3
 void
 roa_flush(struct roa_table *t, byte src)
 {
-  struct roa_item *it, **itp;
+  struct fib_iterator fit;
   struct roa_node *n;
+  uint i, j;
 
-  FIB_WALK(&t->fib, fn)
+  FIB_ITERATE_INIT(&fit, &t->fib);
+again:
+  FIB_ITERATE_START(&t->fib, &fit, fn)
     {
       n = (struct roa_node *) fn;
 
-      itp = &n->items;
-      while (it = *itp)
-	if (src_match(it, src))
-	  {
-	    *itp = it->next;
-	    sl_free(roa_slab, it);
-	  }
-	else
-	  itp = &it->next;
-    }
-  FIB_WALK_END;
-
-  // TODO add cleanup of roa_nodes
-}
-
-
-
-/*
-byte
-roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
-{
-  struct roa_node *n = fib_find(&t->fib, &prefix, pxlen);
-
-  if (n && n->n.x0 == ROA_UNKNOWN)
-    return ROA_UNKNOWN;
+      for (i = j = 0; i < n->items.used; i++)
+	if (!src_match(&n->items.data[i], src))
+	  n->items.data[j++] = n->items.data[i];
 
-  if (n && n->n.x0 == ROA_VALID && asn == n->cached_asn)
-    return ROA_VALID;
+      if (j == n->items.used)
+	continue;
 
-  byte rv = roa_match(t, n, prefix, pxlen, asn);
+      n->items.used = j;
+      roa_notify_change(t, n->n.prefix, n->n.pxlen);
 
-  if (rv != ROA_INVALID)
-    {
-      if (!n)
+      if (!n->items.used)
 	{
-	  if (t->cached_items >= t->cached_items_max)
-	  n = fib_get(&t->fib, &prefix, pxlen);
-	  t->cached_items++;
+	  FIB_ITERATE_PUT(&fit, fn);
+	  roa_node_free(t, n);
+	  goto again;
 	}
-
-      n->cached_asn = asn;
-      n->n.x0 = rv;
     }
-
-  return rv;
+  FIB_ITERATE_END(fn);
 }
-*/
+
 
 /**
  * roa_check - check validity of route origination in a ROA table 
@@ -183,36 +317,34 @@ roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
 byte
 roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
 {
-  struct roa_node *n;
-  ip_addr px;
-  byte anything = 0;
+  struct fib_node *nodes[MAX_PREFIX_LENGTH + 1];
+  int i = fib_route_all(&t->fib, prefix, pxlen, nodes);
 
-  int len;
-  for (len = pxlen; len >= 0; len--)
-    {
-      px = ipa_and(prefix, ipa_mkmask(len));
-      n = fib_find(&t->fib, &px, len);
+  if (!i)
+    return ROA_UNKNOWN;
 
-      if (!n)
-	continue;
+  if (!asn)
+    return ROA_INVALID;
 
-      struct roa_item *it;
-      for (it = n->items; it; it = it->next)
-	{
-	  anything = 1;
-	  if ((it->maxlen >= pxlen) && (it->asn == asn) && asn)
-	    return ROA_VALID;
-	}
+  while (i--)
+    {
+      struct roa_node *n = (struct roa_node *) nodes[i];
+      uint pos = roa_node_bisect(n, asn, 255);
+
+      /* The first item with matching ASN has the largest maxlen */
+      if ((pos < n->items.used) && (n->items.data[pos].asn == asn) &&
+	  (n->items.data[pos].maxlen >= pxlen))
+	return ROA_VALID;
     }
 
-  return anything ? ROA_INVALID : ROA_UNKNOWN;
+  return ROA_INVALID;
 }
 
 static void
 roa_node_init(struct fib_node *fn)
 {
   struct roa_node *n = (struct roa_node *) fn;
-  n->items = NULL;
+  BUFFER_INIT(n->items, roa_pool, 1);
 }
 
 static inline void
@@ -223,6 +355,17 @@ roa_populate(struct roa_table *t)
     roa_add_item(t, ric->prefix, ric->pxlen, ric->maxlen, ric->asn, ROA_SRC_CONFIG);
 }
 
+static int
+roa_items_same(struct roa_item_config *a, struct roa_item_config *b)
+{
+  for (; a && b; a = a->next, b = b->next)
+    if (!ipa_equal(a->prefix, b->prefix) || (a->pxlen != b->pxlen) ||
+	(a->maxlen != b->maxlen) || (a->asn != b->asn))
+      return 0;
+
+  return !a && !b;
+}
+
 static void
 roa_new_table(struct roa_table_config *cf)
 {
@@ -230,8 +373,11 @@ roa_new_table(struct roa_table_config *cf)
 
   t = mb_allocz(roa_pool, sizeof(struct roa_table));
   fib_init(&t->fib, roa_pool, sizeof(struct roa_node), 0, roa_node_init);
+  fib_init_trie(&t->fib);
   t->name = cf->name;
   t->cf = cf;
+  BUFFER_INIT(t->changes, roa_pool, 16);
+  t->change_timer = tm_new_set(roa_pool, roa_change_timer, t, 0, 0);
 
   cf->table = t;
   add_tail(&roa_table_list, &t->n);
@@ -279,7 +425,6 @@ void
 roa_init(void)
 {
   roa_pool = rp_new(&root_pool, "ROA tables");
-  roa_slab = sl_new(roa_pool, sizeof(struct roa_item));
   init_list(&roa_table_list);
 }
 
@@ -318,11 +463,15 @@ roa_commit(struct config *new, struct config *old)
 	    cf = sym->def;
 	    cf->table = t;
 	    t->name = cf->name;
+	    int same = roa_items_same(cf->roa_items, t->cf->roa_items);
 	    t->cf = cf;
 
-	    /* Reconfigure it */
-	    roa_flush(t, ROA_SRC_CONFIG);
-	    roa_populate(t);
+	    /* Reconfigure it, unless static entries are the same */
+	    if (!same)
+	      {
+		roa_flush(t, ROA_SRC_CONFIG);
+		roa_populate(t);
+	      }
 	  }
 	else
 	  {
@@ -332,6 +481,8 @@ roa_commit(struct config *new, struct config *old)
 	    roa_flush(t, ROA_SRC_ANY);
 	    rem_node(&t->n);
 	    fib_free(&t->fib);
+	    mb_free(t->changes.data);
+	    rfree(t->change_timer);
 	    mb_free(t);
 	  }
       }
@@ -352,7 +503,7 @@ roa_show_node(struct cli *c, struct roa_node *rn, int len, u32 asn)
 {
   struct roa_item *ri;
 
-  for (ri = rn->items; ri; ri = ri->next)
+  for (ri = rn->items.data; ri < rn->items.data + rn->items.used; ri++)
     if ((ri->maxlen >= len) && (!asn || (ri->asn == asn)))
       cli_printf(c, -1019, "%I/%d max %d as %u", rn->n.prefix, rn->n.pxlen, ri->maxlen, ri->asn);
 }
@@ -398,8 +549,8 @@ roa_show_cleanup(struct cli *c)
 void
 roa_show(struct roa_show_data *d)
 {
+  struct fib_node *nodes[MAX_PREFIX_LENGTH + 1];
   struct roa_node *rn;
-  ip_addr px;
   int len;
 
   switch (d->mode)
@@ -424,16 +575,9 @@ roa_show(struct roa_show_data *d)
       break;
 
     case ROA_SHOW_FOR:
-      for (len = d->pxlen; len >= 0; len--)
-	{
-	  px = ipa_and(d->prefix, ipa_mkmask(len));
-	  rn = fib_find(&d->table->fib, &px, len);
-
-	  if (!rn)
-	    continue;
-
-	  roa_show_node(this_cli, rn, 0, d->asn);
-	}
+      len = fib_route_all(&d->table->fib, d->prefix, d->pxlen, nodes);
+      while (len--)
+	roa_show_node(this_cli, (struct roa_node *) nodes[len], 0, d->asn);
       cli_msg(0, "");
       break;
     }
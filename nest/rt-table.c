@@ -45,8 +45,17 @@
 
 pool *rt_table_pool;
 
-static slab *rte_slab;
+/*
+ * Routes carry only the protocol-dependent data of their source protocol
+ * (see protocol->rte_size), so they are allocated from slabs of several
+ * sizes. The slab is chosen by the source protocol of the route attributes,
+ * which never changes during the life of the route.
+ */
+#define RTE_SLABS	(sizeof(rte) / 8 + 1)
+
+static slab *rte_slabs[RTE_SLABS];	/* Indexed by size of rte in 8-byte units */
 static linpool *rte_update_pool;
+static slab *hostdep_slab;		/* Entries of hostentry->deps */
 
 static list routing_tables;
 
@@ -55,6 +64,8 @@ static void rt_free_hostcache(rtable *tab);
 static void rt_notify_hostcache(rtable *tab, net *net);
 static void rt_update_hostcache(rtable *tab);
 static void rt_next_hop_update(rtable *tab);
+static void rt_add_hostdep(struct hostentry *he, net *n);
+static void rt_remove_hostdep(struct hostentry *he, net *n);
 static inline int rt_prune_table(rtable *tab);
 static inline void rt_schedule_gc(rtable *tab);
 static inline void rt_schedule_prune(rtable *tab);
@@ -75,6 +86,18 @@ net_route(rtable *tab, ip_addr a, int len)
   ip_addr a0;
   net *n;
 
+  if (tab->fib.trie)
+    {
+      struct fib_node *nodes[MAX_PREFIX_LENGTH + 1];
+      int i = fib_route_all(&tab->fib, a, len, nodes);
+
+      while (i--)
+	if (rte_is_valid(((net *) nodes[i])->routes))
+	  return (net *) nodes[i];
+
+      return NULL;
+    }
+
   while (len >= 0)
     {
       a0 = ipa_and(a, ipa_mkmask(len));
@@ -122,10 +145,27 @@ rte_find(net *net, struct rte_src *src)
  * Also set route preference to the default preference set for
  * the protocol.
  */
+static inline uint
+rte_size(rta *a)
+{
+  return OFFSETOF(rte, u) + a->src->proto->proto->rte_size;
+}
+
+static inline slab *
+rte_slab(rta *a)
+{
+  uint i = (rte_size(a) + 7) / 8;
+
+  if (!rte_slabs[i])
+    rte_slabs[i] = sl_new(rt_table_pool, 8 * i);
+
+  return rte_slabs[i];
+}
+
 rte *
 rte_get_temp(rta *a)
 {
-  rte *e = sl_alloc(rte_slab);
+  rte *e = sl_alloc(rte_slab(a));
 
   e->attrs = a;
   e->flags = 0;
@@ -136,9 +176,9 @@ rte_get_temp(rta *a)
 rte *
 rte_do_cow(rte *r)
 {
-  rte *e = sl_alloc(rte_slab);
+  rte *e = sl_alloc(rte_slab(r->attrs));
 
-  memcpy(e, r, sizeof(rte));
+  memcpy(e, r, rte_size(r->attrs));
   e->attrs = rta_clone(r->attrs);
   e->flags = 0;
   return e;
@@ -244,6 +284,141 @@ rte_trace_out(uint flag, struct proto *p, rte *e, char *msg)
     rte_trace(p, e, '<', msg);
 }
 
+/*
+ * Export filter cache
+ *
+ * A route change is often announced to many protocols with the same export
+ * filter (e.g. BGP peers of a route server sharing a policy). For the same
+ * route and the same temporary attributes, the filter gives the same result
+ * to all of them. Therefore, results of export filters are remembered during
+ * rte_announce() and reused. Equal anonymous filters are shared during
+ * parsing (see filter_share()), so filters are compared just by pointers.
+ * Routes modified by cached filter runs are owned by the cache and freed at
+ * the end of rte_announce(). As protocols may announce routes to other tables
+ * from their rt_notify() hooks, cache entries are kept on a stack. Filters
+ * with side effects (like print) are not cached, see filter_shareable().
+ */
+
+struct rte_export_result {
+  struct filter *filter;
+  rte *rt;				/* Route passed to the filter */
+  ea_list *tmpa;			/* Temporary attributes passed to the filter */
+  u32 hash;				/* Hash of tmpa */
+  int verdict;
+  rte *res_rt;				/* Route returned by the filter */
+  ea_list *res_tmpa;			/* Temporary attributes returned by the filter */
+};
+
+static BUFFER(struct rte_export_result) rte_export_cache;
+static uint rte_export_cache_start;	/* First entry of the current rte_announce() */
+static int rte_export_caching;		/* Inside of rte_announce() */
+
+/*
+ * Every rte_announce() gets a new ID, so protocols can recognize exports
+ * belonging to the same route change (e.g. BGP update groups). Routes and
+ * temporary attributes returned from the export filter cache are shared
+ * by all hooks of one announcement, but their memory may be reused by the
+ * next one, so pointer equality means something only together with the ID.
+ */
+u32 rte_announce_id;			/* ID of the current rte_announce(), 0 outside */
+static u32 rte_announce_seq;
+
+static u32
+rte_tmpa_hash(ea_list *l)
+{
+  u32 h = 0;
+  int i;
+
+  for (; l; l = l->next)
+    for (i = 0; i < l->count; i++)
+      {
+	eattr *a = &l->attrs[i];
+	h = (h * 0x9e3779b1) ^ (a->id << 16) ^ (a->flags << 8) ^ a->type;
+	h = (h * 0x9e3779b1) ^ ((a->type & EAF_EMBEDDED) ? a->u.data : a->u.ptr->length);
+      }
+
+  return h;
+}
+
+/* Like ea_same(), but for lists of several parts, which must match exactly */
+int
+rte_tmpa_same(ea_list *x, ea_list *y)
+{
+  int i;
+
+  for (; x && y; x = x->next, y = y->next)
+    {
+      if (x == y)
+	return 1;
+
+      if (x->count != y->count)
+	return 0;
+
+      for (i = 0; i < x->count; i++)
+	{
+	  eattr *a = &x->attrs[i];
+	  eattr *b = &y->attrs[i];
+
+	  if (a->id != b->id ||
+	      a->flags != b->flags ||
+	      a->type != b->type ||
+	      ((a->type & EAF_EMBEDDED) ? a->u.data != b->u.data : !adata_same(a->u.ptr, b->u.ptr)))
+	    return 0;
+	}
+    }
+
+  return !x && !y;
+}
+
+static int
+rte_export_run(struct filter *filter, rte **rt, ea_list **tmpa, linpool *pool)
+{
+  struct rte_export_result *r;
+  u32 hash = rte_tmpa_hash(*tmpa);
+  uint i;
+
+  for (i = rte_export_cache_start; i < rte_export_cache.used; i++)
+    {
+      r = &rte_export_cache.data[i];
+      if ((r->filter == filter) && (r->rt == *rt) && (r->hash == hash) &&
+	  rte_tmpa_same(r->tmpa, *tmpa))
+	{
+	  *rt = r->res_rt;
+	  *tmpa = r->res_tmpa;
+	  return r->verdict;
+	}
+    }
+
+  rte *rt0 = *rt;
+  ea_list *tmpa0 = *tmpa;
+  int v = f_run(filter, rt, tmpa, pool, FF_FORCE_TMPATTR);
+
+  r = &BUFFER_PUSH(rte_export_cache);
+  r->filter = filter;
+  r->rt = rt0;
+  r->tmpa = tmpa0;
+  r->hash = hash;
+  r->verdict = v;
+  r->res_rt = *rt;
+  r->res_tmpa = *tmpa;
+  return v;
+}
+
+static void
+rte_export_cache_flush(uint start)
+{
+  uint i;
+
+  for (i = start; i < rte_export_cache.used; i++)
+    {
+      struct rte_export_result *r = &rte_export_cache.data[i];
+      if (r->res_rt != r->rt)
+	rte_free(r->res_rt);
+    }
+
+  rte_export_cache.used = start;
+}
+
 static rte *
 export_filter_(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa, linpool *pool, int silent)
 {
@@ -252,7 +427,7 @@ export_filter_(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa
   struct proto_stats *stats = ah->stats;
   ea_list *tmpb = NULL;
   rte *rt;
-  int v;
+  int v, cached = 0;
 
   rt = rt0;
   *rt_free = NULL;
@@ -280,8 +455,14 @@ export_filter_(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa
       goto accept;
     }
 
-  v = filter && ((filter == FILTER_REJECT) ||
-		 (f_run(filter, &rt, tmpa, pool, FF_FORCE_TMPATTR) > F_ACCEPT));
+  /* Routes modified by import_control() cannot be shared */
+  cached = rte_export_caching && ah->out_shared && (rt == rt0);
+
+  if (cached)
+    v = (rte_export_run(filter, &rt, tmpa, pool) > F_ACCEPT);
+  else
+    v = filter && ((filter == FILTER_REJECT) ||
+		   (f_run(filter, &rt, tmpa, pool, FF_FORCE_TMPATTR) > F_ACCEPT));
   if (v)
     {
       if (silent)
@@ -293,13 +474,13 @@ export_filter_(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa
     }
 
  accept:
-  if (rt != rt0)
+  if ((rt != rt0) && !cached)
     *rt_free = rt;
   return rt;
 
  reject:
   /* Discard temporary rte */
-  if (rt != rt0)
+  if ((rt != rt0) && !cached)
     rte_free(rt);
   return NULL;
 }
@@ -775,6 +956,19 @@ rte_announce(rtable *tab, unsigned type, net *net, rte *new, rte *old,
 	rt_notify_hostcache(tab, net);
     }
 
+  /*
+   * Start a new frame of the export filter cache. Merged routes are modified
+   * after filtering in rt_export_merged(), so they are not cached.
+   */
+  uint cache_start = rte_export_cache_start;
+  int caching = rte_export_caching;
+  u32 announce_id = rte_announce_id;
+  rte_export_cache_start = rte_export_cache.used;
+  rte_export_caching = (type != RA_MERGED);
+  if (!++rte_announce_seq)
+    rte_announce_seq++;
+  rte_announce_id = rte_announce_seq;
+
   struct announce_hook *a;
   WALK_LIST(a, tab->hooks)
     {
@@ -787,6 +981,11 @@ rte_announce(rtable *tab, unsigned type, net *net, rte *new, rte *old,
 	else
 	  rt_notify_basic(a, net, new, old, 0);
     }
+
+  rte_export_cache_flush(rte_export_cache_start);
+  rte_export_cache_start = cache_start;
+  rte_export_caching = caching;
+  rte_announce_id = announce_id;
 }
 
 static inline int
@@ -829,16 +1028,20 @@ rte_validate(rte *e)
 void
 rte_free(rte *e)
 {
+  slab *s = rte_slab(e->attrs);
+
   if (rta_is_cached(e->attrs))
     rta_free(e->attrs);
-  sl_free(rte_slab, e);
+  sl_free(s, e);
 }
 
 static inline void
 rte_free_quick(rte *e)
 {
+  slab *s = rte_slab(e->attrs);
+
   rta_free(e->attrs);
-  sl_free(rte_slab, e);
+  sl_free(s, e);
 }
 
 static int
@@ -1073,6 +1276,16 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
   if (new)
     new->lastmod = now;
 
+  /* Keep route counts up to date, so 'show route count' does not need to walk the table */
+  table->rt_count += rte_is_valid(new) - rte_is_valid(old);
+  table->net_count += rte_is_valid(net->routes) - rte_is_valid(old_best);
+
+  /* Keep track of networks depending on hostentries, see rt_schedule_nhu() */
+  if (new && new->attrs->hostentry && (new->attrs->hostentry->tab == table))
+    rt_add_hostdep(new->attrs->hostentry, net);
+  if (old && old->attrs->hostentry && (old->attrs->hostentry->tab == table))
+    rt_remove_hostdep(old->attrs->hostentry, net);
+
   /* Log the route change */
   if (p->debug & D_ROUTES)
     {
@@ -1146,71 +1359,67 @@ rte_unhide_dummy_routes(net *net, rte **dummy)
   }
 }
 
-/**
- * rte_update - enter a new update to a routing table
- * @table: table to be updated
- * @ah: pointer to table announce hook
- * @net: network node
- * @p: protocol submitting the update
- * @src: protocol originating the update
- * @new: a &rte representing the new route or %NULL for route removal.
- *
- * This function is called by the routing protocols whenever they discover
- * a new route or wish to update/remove an existing route. The right announcement
- * sequence is to build route attributes first (either un-cached with @aflags set
- * to zero or a cached one using rta_lookup(); in this case please note that
- * you need to increase the use count of the attributes yourself by calling
- * rta_clone()), call rte_get_temp() to obtain a temporary &rte, fill in all
- * the appropriate data and finally submit the new &rte by calling rte_update().
- *
- * @src specifies the protocol that originally created the route and the meaning
- * of protocol-dependent data of @new. If @new is not %NULL, @src have to be the
- * same value as @new->attrs->proto. @p specifies the protocol that called
- * rte_update(). In most cases it is the same protocol as @src. rte_update()
- * stores @p in @new->sender;
- *
- * When rte_update() gets any route, it automatically validates it (checks,
- * whether the network and next hop address are valid IP addresses and also
- * whether a normal routing protocol doesn't try to smuggle a host or link
- * scope route to the table), converts all protocol dependent attributes stored
- * in the &rte to temporary extended attributes, consults import filters of the
- * protocol to see if the route should be accepted and/or its attributes modified,
- * stores the temporary attributes back to the &rte.
- *
- * Now, having a "public" version of the route, we
- * automatically find any old route defined by the protocol @src
- * for network @n, replace it by the new one (or removing it if @new is %NULL),
- * recalculate the optimal route for this destination and finally broadcast
- * the change (if any) to all routing protocols by calling rte_announce().
- *
- * All memory used for attribute lists and other temporary allocations is taken
- * from a special linear pool @rte_update_pool and freed when rte_update()
- * finishes.
+#define RIV_ACCEPT	0		/* Import verdicts, see rte_import_filter() */
+#define RIV_FILTERED	1
+#define RIV_INVALID	2
+
+/*
+ * Validates the route and runs the import filter, returns RIV_* verdict.
+ * With non-NULL @old_rta, the filter is run by f_run_mt(), so this may be
+ * called from import workers.
  */
+static int
+rte_import_filter(struct announce_hook *ah, rte **new, struct rte_src *src, linpool *pool, struct rta **old_rta)
+{
+  struct filter *filter = ah->in_filter;
+  ea_list *tmpa, *old_tmpa;
+  int fr;
 
-void
-rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
+  (*new)->sender = ah;
+
+  if (!rte_validate(*new))
+    return RIV_INVALID;
+
+  if (filter == FILTER_REJECT)
+    return RIV_FILTERED;
+
+  if (!filter)
+    return RIV_ACCEPT;
+
+  tmpa = old_tmpa = make_tmp_attrs(*new, pool);
+  fr = old_rta ?
+    f_run_mt(filter, new, &tmpa, pool, old_rta) :
+    f_run(filter, new, &tmpa, pool, 0);
+
+  if (tmpa != old_tmpa && src->proto->store_tmp_attrs)
+    src->proto->store_tmp_attrs(*new, tmpa);
+
+  return (fr > F_ACCEPT) ? RIV_FILTERED : RIV_ACCEPT;
+}
+
+/*
+ * Finishes the update according to the verdict, @old_rta is the cached rta
+ * returned by f_run_mt() (if any).
+ */
+static void
+rte_import(struct announce_hook *ah, net *net, rte *new, struct rte_src *src, int verdict, struct rta *old_rta)
 {
   struct proto *p = ah->proto;
   struct proto_stats *stats = ah->stats;
-  struct filter *filter = ah->in_filter;
-  ea_list *tmpa = NULL;
   rte *dummy = NULL;
 
-  rte_update_lock();
   if (new)
     {
-      new->sender = ah;
-
       stats->imp_updates_received++;
-      if (!rte_validate(new))
+
+      if (verdict == RIV_INVALID)
 	{
 	  rte_trace_in(D_FILTERS, p, new, "invalid");
 	  stats->imp_updates_invalid++;
 	  goto drop;
 	}
 
-      if (filter == FILTER_REJECT)
+      if (verdict == RIV_FILTERED)
 	{
 	  stats->imp_updates_filtered++;
 	  rte_trace_in(D_FILTERS, p, new, "filtered out");
@@ -1221,27 +1430,7 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 	  /* new is a private copy, i could modify it */
 	  new->flags |= REF_FILTERED;
 	}
-      else
-	{
-	  tmpa = make_tmp_attrs(new, rte_update_pool);
-	  if (filter && (filter != FILTER_REJECT))
-	    {
-	      ea_list *old_tmpa = tmpa;
-	      int fr = f_run(filter, &new, &tmpa, rte_update_pool, 0);
-	      if (fr > F_ACCEPT)
-		{
-		  stats->imp_updates_filtered++;
-		  rte_trace_in(D_FILTERS, p, new, "filtered out");
 
-		  if (! ah->in_keep_filtered)
-		    goto drop;
-
-		  new->flags |= REF_FILTERED;
-		}
-	      if (tmpa != old_tmpa && src->proto->store_tmp_attrs)
-		src->proto->store_tmp_attrs(new, tmpa);
-	    }
-	}
       if (!rta_is_cached(new->attrs)) /* Need to copy attributes */
 	new->attrs = rta_lookup(new->attrs);
       new->flags |= REF_COW;
@@ -1253,16 +1442,18 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
       if (!net || !src)
 	{
 	  stats->imp_withdraws_ignored++;
-	  rte_update_unlock();
 	  return;
 	}
     }
 
  recalc:
+  /* The private rta in new may share data with old_rta */
+  if (old_rta)
+    rta_free(old_rta);
+
   rte_hide_dummy_routes(net, &dummy);
   rte_recalculate(ah, net, new, src);
   rte_unhide_dummy_routes(net, &dummy);
-  rte_update_unlock();
   return;
 
  drop:
@@ -1271,6 +1462,465 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
   goto recalc;
 }
 
+/*
+ *	Import filter memo
+ *
+ * Routes received together (e.g. all prefixes of one BGP UPDATE) usually share
+ * one cached rta. If the import filter of the hook depends just on route
+ * attributes (see filter_attrs_only()), it gives the same result for all of
+ * them. Therefore we keep the verdict and the resulting cached rta of the last
+ * filtered route and reuse them while the next routes come through the same
+ * hook with the same rta and preference. Validation is still done per route.
+ */
+
+static struct rte_import_memo {
+  struct announce_hook *ah;		/* NULL if the memo is empty */
+  struct filter *filter;
+  struct rta *in, *out;			/* Input and resulting rta, both cached and locked */
+  word pref;
+  int verdict;
+} rte_import_memo;
+
+static void
+rte_import_memo_flush(void)
+{
+  struct rte_import_memo *m = &rte_import_memo;
+
+  if (!m->ah)
+    return;
+
+  rta_free(m->in);
+  rta_free(m->out);
+  m->ah = NULL;
+}
+
+static inline int
+rte_import_memo_usable(struct announce_hook *ah, rte *new)
+{
+  /* Temporary attributes are generated from protocol specific parts of rte */
+  return ah->in_memo && rta_is_cached(new->attrs) && !new->attrs->src->proto->make_tmp_attrs;
+}
+
+/* Returns RIV_* verdict, or -1 if there is no matching memo */
+static int
+rte_import_memo_find(struct announce_hook *ah, rte *new)
+{
+  struct rte_import_memo *m = &rte_import_memo;
+
+  if ((m->ah != ah) || (m->filter != ah->in_filter) ||
+      (m->in != new->attrs) || (m->pref != new->pref))
+    return -1;
+
+  new->sender = ah;
+
+  if (!rte_validate(new))
+    return RIV_INVALID;
+
+  rta_free(new->attrs);
+  new->attrs = rta_clone(m->out);
+  return m->verdict;
+}
+
+static void
+rte_import_memo_store(struct announce_hook *ah, rta *in, rte *new, int verdict)
+{
+  struct rte_import_memo *m = &rte_import_memo;
+
+  /* Invalid routes are rejected before the filter is run */
+  if (verdict == RIV_INVALID)
+    return;
+
+  rte_import_memo_flush();
+
+  if (!rta_is_cached(new->attrs))
+    new->attrs = rta_lookup(new->attrs);
+
+  m->ah = ah;
+  m->filter = ah->in_filter;
+  m->in = rta_clone(in);
+  m->out = rta_clone(new->attrs);
+  m->pref = new->pref;
+  m->verdict = verdict;
+}
+
+/* Like rte_import_filter(), but on the main thread and using the memo */
+static int
+rte_import_filter_memo(struct announce_hook *ah, rte **new, struct rte_src *src)
+{
+  if (!rte_import_memo_usable(ah, *new))
+    return rte_import_filter(ah, new, src, rte_update_pool, NULL);
+
+  int verdict = rte_import_memo_find(ah, *new);
+  if (verdict >= 0)
+    return verdict;
+
+  /* The filter may free its input rta */
+  rta *in = rta_clone((*new)->attrs);
+  verdict = rte_import_filter(ah, new, src, rte_update_pool, NULL);
+  rte_import_memo_store(ah, in, *new, verdict);
+  rta_free(in);
+
+  return verdict;
+}
+
+/*
+ *	Parallel import
+ *
+ * Updates from protocols with parallel_import flag are not processed by
+ * rte_update2() immediately, but collected in the import batch. The batch is
+ * processed by rte_update_flush(), which runs validation and import filters of
+ * all collected routes on the main thread together with import workers, and
+ * then finishes the updates by rte_import() in the original order on the main
+ * thread. Workers touch just the route, their own linpools and data which are
+ * read-only while the main thread waits for them (see filter_thread_safe()).
+ *
+ * The batch is flushed from an event, when it is full, and before anything
+ * what could invalidate queued nets or announce hooks, i.e. before table
+ * pruning, refresh cycles and reconfiguration.
+ */
+
+struct rte_import_job {
+  struct announce_hook *ah;
+  net *net;
+  rte *new;
+  struct rte_src *src;
+  struct rta *old_rta;			/* Cached rta to be freed after rta_lookup() */
+  int verdict;
+  int memo;				/* Role in the import filter memo, see RIM_* */
+};
+
+#define RIM_NONE	0
+#define RIM_STORE	1		/* Filtered by workers, result goes to the memo */
+#define RIM_REUSE	2		/* Not filtered by workers, result comes from the memo */
+
+#define RTE_IMPORT_BATCH_MAX	4096	/* Flush a batch immediately when it is this long */
+#define RTE_IMPORT_BATCH_MIN	16	/* Shorter batches are filtered just by the main thread */
+
+static BUFFER(struct rte_import_job) rte_import_batch;
+static event *rte_import_event;
+static uint rte_import_workers;		/* Number of import workers, 0 = parallel import disabled */
+static int rte_import_flushing;
+
+static void
+rte_import_run(uint part, uint parts, linpool *pool)
+{
+  uint n = rte_import_batch.used;
+  uint i, end = (u64) n * (part + 1) / parts;
+
+  for (i = (u64) n * part / parts; i < end; i++)
+    {
+      struct rte_import_job *j = &rte_import_batch.data[i];
+
+      if (j->new && j->ah->in_parallel && (j->memo != RIM_REUSE))
+	j->verdict = rte_import_filter(j->ah, &j->new, j->src, pool, &j->old_rta);
+    }
+}
+
+#ifdef USE_PTHREADS
+
+#include <pthread.h>
+
+struct rte_import_worker {
+  pthread_t thread;
+  linpool *pool;			/* Temporary allocations of the worker */
+  uint id;
+  uint round;				/* Last processed batch */
+};
+
+static struct rte_import_worker *rte_import_worker_list;
+static pthread_mutex_t rte_import_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rte_import_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t rte_import_done = PTHREAD_COND_INITIALIZER;
+static uint rte_import_round;		/* Incremented for each batch given to workers */
+static uint rte_import_busy;		/* Workers still processing the current batch */
+static int rte_import_stop;
+
+static void *
+rte_import_worker_main(void *arg)
+{
+  struct rte_import_worker *w = arg;
+
+  pthread_mutex_lock(&rte_import_mutex);
+  for (;;)
+    {
+      while ((w->round == rte_import_round) && !rte_import_stop)
+	pthread_cond_wait(&rte_import_wakeup, &rte_import_mutex);
+
+      if (rte_import_stop)
+	break;
+
+      w->round = rte_import_round;
+      pthread_mutex_unlock(&rte_import_mutex);
+
+      rte_import_run(w->id, rte_import_workers + 1, w->pool);
+
+      pthread_mutex_lock(&rte_import_mutex);
+      if (!--rte_import_busy)
+	pthread_cond_signal(&rte_import_done);
+    }
+  pthread_mutex_unlock(&rte_import_mutex);
+
+  return NULL;
+}
+
+static void
+rte_import_start_workers(uint num)
+{
+  uint i;
+  int rv;
+
+  rte_import_worker_list = mb_allocz(rt_table_pool, num * sizeof(struct rte_import_worker));
+  rte_import_workers = num;
+
+  for (i = 0; i < num; i++)
+    {
+      struct rte_import_worker *w = &rte_import_worker_list[i];
+      w->pool = lp_new(rt_table_pool, 4080);
+      w->id = i + 1;
+      w->round = rte_import_round;
+
+      rv = pthread_create(&w->thread, NULL, rte_import_worker_main, w);
+      if (rv)
+	die("pthread_create(): %M", rv);
+    }
+}
+
+static void
+rte_import_stop_workers(void)
+{
+  uint i;
+  int rv;
+
+  if (!rte_import_workers)
+    return;
+
+  pthread_mutex_lock(&rte_import_mutex);
+  rte_import_stop = 1;
+  pthread_cond_broadcast(&rte_import_wakeup);
+  pthread_mutex_unlock(&rte_import_mutex);
+
+  for (i = 0; i < rte_import_workers; i++)
+    {
+      rv = pthread_join(rte_import_worker_list[i].thread, NULL);
+      if (rv)
+	die("pthread_join(): %M", rv);
+
+      rfree(rte_import_worker_list[i].pool);
+    }
+
+  mb_free(rte_import_worker_list);
+  rte_import_worker_list = NULL;
+  rte_import_workers = 0;
+  rte_import_stop = 0;
+}
+
+static void
+rte_import_filter_batch(void)
+{
+  if (rte_import_batch.used < RTE_IMPORT_BATCH_MIN)
+    {
+      rte_import_run(0, 1, rte_update_pool);
+      return;
+    }
+
+  pthread_mutex_lock(&rte_import_mutex);
+  rte_import_round++;
+  rte_import_busy = rte_import_workers;
+  pthread_cond_broadcast(&rte_import_wakeup);
+  pthread_mutex_unlock(&rte_import_mutex);
+
+  rte_import_run(0, rte_import_workers + 1, rte_update_pool);
+
+  pthread_mutex_lock(&rte_import_mutex);
+  while (rte_import_busy)
+    pthread_cond_wait(&rte_import_done, &rte_import_mutex);
+  pthread_mutex_unlock(&rte_import_mutex);
+}
+
+static void
+rte_import_flush_pools(void)
+{
+  uint i;
+
+  for (i = 0; i < rte_import_workers; i++)
+    lp_flush(rte_import_worker_list[i].pool);
+}
+
+#else
+
+static inline void rte_import_start_workers(uint num UNUSED) { }
+static inline void rte_import_stop_workers(void) { }
+static inline void rte_import_filter_batch(void) { rte_import_run(0, 1, rte_update_pool); }
+static inline void rte_import_flush_pools(void) { }
+
+#endif
+
+/*
+ * Finds runs of jobs which may share the import filter result. The first job
+ * of a run is filtered as usual and its result is stored to the memo, the rest
+ * is skipped by workers and takes the result from the memo.
+ */
+static void
+rte_import_memo_mark(void)
+{
+  struct rte_import_job *j, *first = NULL;
+  uint i;
+
+  for (i = 0; i < rte_import_batch.used; i++)
+    {
+      j = &rte_import_batch.data[i];
+
+      if (!j->new || !j->ah->in_parallel || !rte_import_memo_usable(j->ah, j->new))
+	continue;
+
+      if (first && (first->ah == j->ah) &&
+	  (first->new->attrs == j->new->attrs) && (first->new->pref == j->new->pref))
+	j->memo = RIM_REUSE;
+      else
+	(first = j)->memo = RIM_STORE;
+    }
+}
+
+/**
+ * rte_update_flush - process queued route updates
+ *
+ * This function finishes all updates collected in the import batch, see
+ * rte_update2(). It must be called before any action which may free nets
+ * or announce hooks referenced from the batch.
+ */
+void
+rte_update_flush(void)
+{
+  struct rte_import_job *j;
+  uint i;
+
+  if (rte_import_flushing)
+    return;
+
+  /* Queued nets, hooks or filters may be freed after the flush */
+  rte_import_memo_flush();
+
+  if (!rte_import_batch.used)
+    return;
+
+  rte_import_flushing = 1;
+  rte_update_lock();
+
+  rte_import_memo_mark();
+  rte_import_filter_batch();
+
+  for (i = 0; i < rte_import_batch.used; i++)
+    {
+      j = &rte_import_batch.data[i];
+
+      /* Hooks which cannot use workers anymore (after reconfiguration) */
+      if (j->new && !j->ah->in_parallel)
+	j->verdict = rte_import_filter_memo(j->ah, &j->new, j->src);
+
+      else if (j->memo == RIM_STORE)
+	rte_import_memo_store(j->ah, j->old_rta ? j->old_rta : j->new->attrs, j->new, j->verdict);
+
+      else if ((j->memo == RIM_REUSE) && ((j->verdict = rte_import_memo_find(j->ah, j->new)) < 0))
+	j->verdict = rte_import_filter_memo(j->ah, &j->new, j->src);
+
+      rte_import(j->ah, j->net, j->new, j->src, j->verdict, j->old_rta);
+    }
+
+  rte_update_unlock();
+  rte_import_flush_pools();
+  BUFFER_FLUSH(rte_import_batch);
+  rte_import_flushing = 0;
+}
+
+static void
+rte_import_event_hook(void *data UNUSED)
+{
+  rte_update_flush();
+}
+
+static void
+rte_import_queue(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
+{
+  if (!rte_import_batch.used)
+    ev_schedule(rte_import_event);
+
+  BUFFER_PUSH(rte_import_batch) = (struct rte_import_job) {
+    .ah = ah, .net = net, .new = new, .src = src
+  };
+
+  if (rte_import_batch.used >= RTE_IMPORT_BATCH_MAX)
+    rte_update_flush();
+}
+
+static void
+rte_import_setup(uint num)
+{
+  if (num == rte_import_workers)
+    return;
+
+  rte_import_stop_workers();
+  rte_import_start_workers(num);
+}
+
+/**
+ * rte_update - enter a new update to a routing table
+ * @table: table to be updated
+ * @ah: pointer to table announce hook
+ * @net: network node
+ * @p: protocol submitting the update
+ * @src: protocol originating the update
+ * @new: a &rte representing the new route or %NULL for route removal.
+ *
+ * This function is called by the routing protocols whenever they discover
+ * a new route or wish to update/remove an existing route. The right announcement
+ * sequence is to build route attributes first (either un-cached with @aflags set
+ * to zero or a cached one using rta_lookup(); in this case please note that
+ * you need to increase the use count of the attributes yourself by calling
+ * rta_clone()), call rte_get_temp() to obtain a temporary &rte, fill in all
+ * the appropriate data and finally submit the new &rte by calling rte_update().
+ *
+ * @src specifies the protocol that originally created the route and the meaning
+ * of protocol-dependent data of @new. If @new is not %NULL, @src have to be the
+ * same value as @new->attrs->proto. @p specifies the protocol that called
+ * rte_update(). In most cases it is the same protocol as @src. rte_update()
+ * stores @p in @new->sender;
+ *
+ * When rte_update() gets any route, it automatically validates it (checks,
+ * whether the network and next hop address are valid IP addresses and also
+ * whether a normal routing protocol doesn't try to smuggle a host or link
+ * scope route to the table), converts all protocol dependent attributes stored
+ * in the &rte to temporary extended attributes, consults import filters of the
+ * protocol to see if the route should be accepted and/or its attributes modified,
+ * stores the temporary attributes back to the &rte.
+ *
+ * Now, having a "public" version of the route, we
+ * automatically find any old route defined by the protocol @src
+ * for network @n, replace it by the new one (or removing it if @new is %NULL),
+ * recalculate the optimal route for this destination and finally broadcast
+ * the change (if any) to all routing protocols by calling rte_announce().
+ *
+ * All memory used for attribute lists and other temporary allocations is taken
+ * from a special linear pool @rte_update_pool and freed when rte_update()
+ * finishes.
+ *
+ * If import workers are enabled and the announce hook allows it, the update is
+ * just queued and processed later by rte_update_flush(), see below.
+ */
+
+void
+rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
+{
+  if (ah->in_parallel && rte_import_workers && !rte_import_flushing)
+    {
+      rte_import_queue(ah, net, new, src);
+      return;
+    }
+
+  rte_update_lock();
+  rte_import(ah, net, new, src, new ? rte_import_filter_memo(ah, &new, src) : 0, NULL);
+  rte_update_unlock();
+}
+
 /* Independent call to rte_announce(), used from next hop
    recalculation, outside of rte_update(). new must be non-NULL */
 static inline void 
@@ -1338,6 +1988,8 @@ rt_refresh_begin(rtable *t, struct announce_hook *ah)
   net *n;
   rte *e;
 
+  rte_update_flush();
+
   FIB_WALK(&t->fib, fn)
     {
       n = (net *) fn;
@@ -1363,6 +2015,8 @@ rt_refresh_end(rtable *t, struct announce_hook *ah)
   net *n;
   rte *e;
 
+  rte_update_flush();
+
   FIB_WALK(&t->fib, fn)
     {
       n = (net *) fn;
@@ -1468,14 +2122,28 @@ rt_schedule_hcu(rtable *tab)
   ev_schedule(tab->rt_event);
 }
 
-static inline void
-rt_schedule_nhu(rtable *tab)
+/*
+ * Next hop update is scheduled when a hostentry changes. Just networks with
+ * routes using that hostentry (as recorded in its deps hash) are queued to be
+ * checked, instead of walking the whole table.
+ */
+static void
+rt_schedule_nhu(rtable *tab, struct hostentry *he)
 {
-  if (tab->nhu_state == 0)
+  if (!he->deps.count)
+    return;
+
+  if (!tab->nhu_queue.data)
+    BUFFER_INIT(tab->nhu_queue, rt_table_pool, 64);
+
+  HASH_WALK(he->deps, next, d)
+    BUFFER_PUSH(tab->nhu_queue) = (struct rt_nhu_net) { d->net->n.prefix, d->net->n.pxlen };
+  HASH_WALK_END;
+
+  if (!tab->nhu_state)
     ev_schedule(tab->rt_event);
 
-  /* state change 0->1, 2->3 */
-  tab->nhu_state |= 1;
+  tab->nhu_state = 1;
 }
 
 
@@ -1516,6 +2184,8 @@ rt_event(void *ptr)
 {
   rtable *tab = ptr;
 
+  rte_update_flush();
+
   if (tab->hcu_scheduled)
     rt_update_hostcache(tab);
 
@@ -1542,6 +2212,8 @@ rt_setup(pool *p, rtable *t, char *name, struct rtable_config *cf)
 {
   bzero(t, sizeof(*t));
   fib_init(&t->fib, p, sizeof(net), 0, rte_init);
+  if (cf && cf->trie)
+    fib_init_trie(&t->fib);
   t->name = name;
   t->config = cf;
   init_list(&t->hooks);
@@ -1566,8 +2238,13 @@ rt_init(void)
   rta_init();
   rt_table_pool = rp_new(&root_pool, "Routing tables");
   rte_update_pool = lp_new(rt_table_pool, 4080);
-  rte_slab = sl_new(rt_table_pool, sizeof(rte));
   init_list(&routing_tables);
+
+  BUFFER_INIT(rte_import_batch, rt_table_pool, 64);
+  BUFFER_INIT(rte_export_cache, rt_table_pool, 16);
+  hostdep_slab = sl_new(rt_table_pool, sizeof(struct hostdep));
+  rte_import_event = ev_new(rt_table_pool);
+  rte_import_event->hook = rte_import_event_hook;
 }
 
 
@@ -1662,6 +2339,8 @@ rt_prune_loop(void)
   int limit = 512;
   rtable *t;
 
+  rte_update_flush();
+
   WALK_LIST(t, routing_tables)
     if (! rt_prune_step(t, &limit))
       return 0;
@@ -1719,8 +2398,8 @@ rt_next_hop_update_rte(rtable *tab UNUSED, rte *old)
   rta_apply_hostentry(&a, old->attrs->hostentry);
   a.aflags = 0;
 
-  rte *e = sl_alloc(rte_slab);
-  memcpy(e, old, sizeof(rte));
+  rte *e = sl_alloc(rte_slab(old->attrs));
+  memcpy(e, old, rte_size(old->attrs));
   e->attrs = rta_lookup(&a);
 
   return e;
@@ -1799,35 +2478,36 @@ rt_next_hop_update_net(rtable *tab, net *n)
 static void
 rt_next_hop_update(rtable *tab)
 {
-  struct fib_iterator *fit = &tab->nhu_fit;
   int max_feed = 32;
 
   if (tab->nhu_state == 0)
     return;
 
-  if (tab->nhu_state == 1)
-    {
-      FIB_ITERATE_INIT(fit, &tab->fib);
-      tab->nhu_state = 2;
-    }
-
-  FIB_ITERATE_START(&tab->fib, fit, fn)
+  while (tab->nhu_pos < tab->nhu_queue.used)
     {
       if (max_feed <= 0)
 	{
-	  FIB_ITERATE_PUT(fit, fn);
 	  ev_schedule(tab->rt_event);
 	  return;
 	}
-      max_feed -= rt_next_hop_update_net(tab, (net *) fn);
+
+      /* Networks are queued by prefix, they may have been pruned meanwhile */
+      struct rt_nhu_net q = tab->nhu_queue.data[tab->nhu_pos++];
+      net *n = net_find(tab, q.prefix, q.pxlen);
+      if (n)
+	max_feed -= rt_next_hop_update_net(tab, n);
     }
-  FIB_ITERATE_END(fn);
 
-  /* state change 2->0, 3->1 */
-  tab->nhu_state &= 1;
+  /* Do not keep a large queue after a big update */
+  if (tab->nhu_queue.size > 1024)
+    {
+      mb_free(tab->nhu_queue.data);
+      tab->nhu_queue = (typeof(tab->nhu_queue)) { };
+    }
 
-  if (tab->nhu_state > 0)
-    ev_schedule(tab->rt_event);
+  BUFFER_FLUSH(tab->nhu_queue);
+  tab->nhu_pos = 0;
+  tab->nhu_state = 0;
 }
 
 
@@ -1880,6 +2560,8 @@ rt_unlock_table(rtable *r)
       r->config->table = NULL;
       if (r->hostcache)
 	rt_free_hostcache(r);
+      if (r->nhu_queue.data)
+	mb_free(r->nhu_queue.data);
       rem_node(&r->n);
       fib_free(&r->fib);
       rfree(r->rt_event);
@@ -1906,6 +2588,9 @@ rt_commit(struct config *new, struct config *old)
   struct rtable_config *o, *r;
 
   DBG("rt_commit:\n");
+  rte_update_flush();
+  rte_import_setup(new->shutdown ? 0 : new->import_workers);
+
   if (old)
     {
       WALK_LIST(o, old->tables)
@@ -1923,6 +2608,10 @@ rt_commit(struct config *new, struct config *old)
 		  ot->config = r;
 		  if (o->sorted != r->sorted)
 		    log(L_WARN "Reconfiguration of rtable sorted flag not implemented");
+		  if (r->trie)
+		    fib_init_trie(&ot->fib);
+		  else
+		    fib_free_trie(&ot->fib);
 		}
 	      else
 		{
@@ -2069,6 +2758,51 @@ ptr_hash(void *ptr)
   return p ^ (p << 8) ^ (p >> 16);
 }
 
+/*
+ * Each hostentry keeps a hash of networks in its dependent table with routes
+ * using it (with the number of such routes). This reverse index is maintained
+ * by rte_recalculate() and used by rt_schedule_nhu().
+ */
+
+#define HD_KEY(n)		n->net
+#define HD_NEXT(n)		n->next
+#define HD_EQ(a,b)		a == b
+#define HD_FN(n)		ptr_hash(n)
+#define HD_ORDER		2
+
+#define HD_REHASH		hd_rehash
+#define HD_PARAMS		/8, *2, 2, 2, HD_ORDER, 20
+
+HASH_DEFINE_REHASH_FN(HD, struct hostdep)
+
+static void
+rt_add_hostdep(struct hostentry *he, net *n)
+{
+  struct hostdep *d = HASH_FIND(he->deps, HD, n);
+
+  if (!d)
+    {
+      d = sl_alloc(hostdep_slab);
+      d->net = n;
+      d->uc = 0;
+      HASH_INSERT2(he->deps, HD, rt_table_pool, d);
+    }
+
+  d->uc++;
+}
+
+static void
+rt_remove_hostdep(struct hostentry *he, net *n)
+{
+  struct hostdep *d = HASH_FIND(he->deps, HD, n);
+
+  if (!d || --d->uc)
+    return;
+
+  HASH_REMOVE2(he->deps, HD, rt_table_pool, d);
+  sl_free(hostdep_slab, d);
+}
+
 static inline unsigned
 hc_hash(ip_addr a, rtable *dep)
 {
@@ -2142,6 +2876,7 @@ hc_new_hostentry(struct hostcache *hc, ip_addr a, ip_addr ll, rtable *dep, unsig
   he->hash_key = k;
   he->uc = 0;
   he->src = NULL;
+  HASH_INIT(he->deps, rt_table_pool, HD_ORDER);
 
   add_tail(&hc->hostentries, &he->ln);
   hc_insert(hc, he);
@@ -2157,6 +2892,7 @@ static void
 hc_delete_hostentry(struct hostcache *hc, struct hostentry *he)
 {
   rta_free(he->src);
+  HASH_FREE(he->deps);
 
   rem_node(&he->ln);
   hc_remove(hc, he);
@@ -2193,6 +2929,7 @@ rt_free_hostcache(rtable *tab)
     {
       struct hostentry *he = SKIP_BACK(struct hostentry, ln, n);
       rta_free(he->src);
+      HASH_FREE(he->deps);
 
       if (he->uc)
 	log(L_ERR "Hostcache is not empty in table %s", tab->name);
@@ -2338,7 +3075,7 @@ rt_update_hostcache(rtable *tab)
 	}
 
       if (rt_update_hostentry(tab, he))
-	rt_schedule_nhu(he->tab);
+	rt_schedule_nhu(he->tab, he);
     }
 
   tab->hcu_scheduled = 0;
@@ -2599,6 +3336,15 @@ rt_show(struct rt_show_data *d)
   if (d->filtered && (d->export_mode || d->primary_only))
     cli_msg(0, "");
 
+  /* Plain route count is maintained by the table, no need to walk it */
+  if ((d->pxlen == 256) && (d->stats == 2) && (d->filter == FILTER_ACCEPT) &&
+      !d->show_protocol && !d->export_mode && !d->primary_only && !d->filtered)
+    {
+      rtable *t = d->table;
+      cli_msg(14, "%u of %u routes for %u networks", t->rt_count, t->rt_count, t->net_count);
+      return;
+    }
+
   if (d->pxlen == 256)
     {
       FIB_ITERATE_INIT(&d->fit, &d->table->fib);
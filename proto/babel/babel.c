@@ -1354,7 +1354,7 @@ babel_iface_timer(timer *t)
 static inline void
 babel_iface_kick_timer(struct babel_iface *ifa)
 {
-  if (ifa->timer->expires > (now + 1))
+  if (tm_remains(ifa->timer) > 1)
     tm_start(ifa->timer, 1);
 }
 
@@ -1904,7 +1904,7 @@ babel_timer(timer *t)
 static inline void
 babel_kick_timer(struct babel_proto *p)
 {
-  if (p->timer->expires > (now + 1))
+  if (tm_remains(p->timer) > 1)
     tm_start(p->timer, 1);
 }
 
@@ -2134,6 +2134,7 @@ struct protocol proto_babel = {
   .attr_class =		EAP_BABEL,
   .preference =		DEF_PREF_BABEL,
   .config_size =	sizeof(struct babel_config),
+  .rte_size =		RTE_DATA_SIZE(babel),
   .init =		babel_init,
   .dump =		babel_dump,
   .start =		babel_start,
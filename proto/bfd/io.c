@@ -18,7 +18,6 @@
 #include "proto/bfd/io.h"
 
 #include "lib/buffer.h"
-#include "lib/heap.h"
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/event.h"
@@ -31,7 +30,7 @@ struct birdloop
   pthread_t thread;
   pthread_mutex_t mutex;
 
-  btime last_time;
+  struct timeloop time;
   btime real_time;
   u8 use_monotonic_clock;
 
@@ -40,7 +39,6 @@ struct birdloop
   u8 wakeup_masked;
   int wakeup_fds[2];
 
-  BUFFER(timer2 *) timers;
   list event_list;
   list sock_list;
   uint sock_num;
@@ -68,6 +66,7 @@ static inline void
 birdloop_set_current(struct birdloop *loop)
 {
   pthread_setspecific(current_loop_key, loop);
+  timeloop_set_current(loop ? &loop->time : NULL);
 }
 
 static inline void
@@ -95,7 +94,7 @@ times_init(struct birdloop *loop)
     log(L_WARN "Monotonic clock is missing");
 
     loop->use_monotonic_clock = 0;
-    loop->last_time = 0;
+    loop->time.last_time = 0;
     loop->real_time = 0;
     times_update_alt(loop);
     return;
@@ -105,7 +104,7 @@ times_init(struct birdloop *loop)
     log(L_WARN "Monotonic clock is crazy");
 
   loop->use_monotonic_clock = 1;
-  loop->last_time = ((s64) ts.tv_sec S) + (ts.tv_nsec / 1000);
+  loop->time.last_time = ((s64) ts.tv_sec S) + (ts.tv_nsec / 1000);
   loop->real_time = 0;
 }
 
@@ -121,10 +120,10 @@ times_update_pri(struct birdloop *loop)
 
   btime new_time = ((s64) ts.tv_sec S) + (ts.tv_nsec / 1000);
 
-  if (new_time < loop->last_time)
+  if (new_time < loop->time.last_time)
     log(L_ERR "Monotonic clock is broken");
 
-  loop->last_time = new_time;
+  loop->time.last_time = new_time;
   loop->real_time = 0;
 }
 
@@ -149,7 +148,7 @@ times_update_alt(struct birdloop *loop)
     delta = 100 MS;
   }
 
-  loop->last_time += delta;
+  loop->time.last_time += delta;
   loop->real_time = new_time;
 }
 
@@ -162,12 +161,6 @@ times_update(struct birdloop *loop)
     times_update_alt(loop);
 }
 
-btime
-current_time(void)
-{
-  return birdloop_current()->last_time;
-}
-
 
 /*
  *	Wakeup code for birdloop
@@ -295,147 +288,20 @@ ev2_schedule(event *e)
  *	Timers
  */
 
-#define TIMER_LESS(a,b)		((a)->expires < (b)->expires)
-#define TIMER_SWAP(heap,a,b,t)	(t = heap[a], heap[a] = heap[b], heap[b] = t, \
-				   heap[a]->index = (a), heap[b]->index = (b))
-
-static inline uint timers_count(struct birdloop *loop)
-{ return loop->timers.used - 1; }
-
-static inline timer2 *timers_first(struct birdloop *loop)
-{ return (loop->timers.used > 1) ? loop->timers.data[1] : NULL; }
-
-
 static void
-tm2_free(resource *r)
+timers_kick(struct timeloop *tl)
 {
-  timer2 *t = (timer2 *) r;
-
-  tm2_stop(t);
-}
+  struct birdloop *loop = SKIP_BACK(struct birdloop, time, tl);
 
-static void
-tm2_dump(resource *r)
-{
-  timer2 *t = (timer2 *) r;
-
-  debug("(code %p, data %p, ", t->hook, t->data);
-  if (t->randomize)
-    debug("rand %d, ", t->randomize);
-  if (t->recurrent)
-    debug("recur %d, ", t->recurrent);
-  if (t->expires)
-    debug("expires in %d ms)\n", (t->expires - current_time()) TO_MS);
-  else
-    debug("inactive)\n");
-}
-
-
-static struct resclass tm2_class = {
-  "Timer",
-  sizeof(timer2),
-  tm2_free,
-  tm2_dump,
-  NULL,
-  NULL
-};
-
-timer2 *
-tm2_new(pool *p)
-{
-  timer2 *t = ralloc(p, &tm2_class);
-  t->index = -1;
-  return t;
-}
-
-void
-tm2_set(timer2 *t, btime when)
-{
-  struct birdloop *loop = birdloop_current();
-  uint tc = timers_count(loop);
-
-  if (!t->expires)
-  {
-    t->index = ++tc;
-    t->expires = when;
-    BUFFER_PUSH(loop->timers) = t;
-    HEAP_INSERT(loop->timers.data, tc, timer2 *, TIMER_LESS, TIMER_SWAP);
-  }
-  else if (t->expires < when)
-  {
-    t->expires = when;
-    HEAP_INCREASE(loop->timers.data, tc, timer2 *, TIMER_LESS, TIMER_SWAP, t->index);
-  }
-  else if (t->expires > when)
-  {
-    t->expires = when;
-    HEAP_DECREASE(loop->timers.data, tc, timer2 *, TIMER_LESS, TIMER_SWAP, t->index);
-  }
-
-  if (loop->poll_active && (t->index == 1))
+  if (loop->poll_active)
     wakeup_kick(loop);
 }
 
-void
-tm2_start(timer2 *t, btime after)
-{
-  tm2_set(t, current_time() + MAX(after, 0));
-}
-
-void
-tm2_stop(timer2 *t)
-{
-  if (!t->expires)
-    return;
-
-  struct birdloop *loop = birdloop_current();
-  uint tc = timers_count(loop);
-
-  HEAP_DELETE(loop->timers.data, tc, timer2 *, TIMER_LESS, TIMER_SWAP, t->index);
-  BUFFER_POP(loop->timers);
-
-  t->index = -1;
-  t->expires = 0;
-}
-
-static void
-timers_init(struct birdloop *loop)
-{
-  BUFFER_INIT(loop->timers, loop->pool, 4);
-  BUFFER_PUSH(loop->timers) = NULL;
-}
-
 static void
-timers_fire(struct birdloop *loop)
+timers_init_loop(struct birdloop *loop)
 {
-  btime base_time;
-  timer2 *t;
-
-  times_update(loop);
-  base_time = loop->last_time;
-
-  while (t = timers_first(loop))
-  {
-    if (t->expires > base_time)
-      return;
-
-    if (t->recurrent)
-    {
-      btime when = t->expires + t->recurrent;
-      
-      if (when <= loop->last_time)
-	when = loop->last_time + t->recurrent;
-
-      if (t->randomize)
-	when += random() % (t->randomize + 1);
-
-      tm2_set(t, when);
-    }
-    else
-      tm2_stop(t);
-
-    t->hook(t);
-  }
+  timers_init(&loop->time);
+  loop->time.kick = timers_kick;
 }
 
 
@@ -634,11 +500,11 @@ birdloop_new(void)
   loop->pool = p;
   pthread_mutex_init(&loop->mutex, NULL);
 
+  timers_init_loop(loop);
   times_init(loop);
   wakeup_init(loop);
 
   events_init(loop);
-  timers_init(loop);
   sockets_init(loop);
 
   return loop;
@@ -710,7 +576,7 @@ static void *
 birdloop_main(void *arg)
 {
   struct birdloop *loop = arg;
-  timer2 *t;
+  btime t;
   int rv, timeout;
 
   birdloop_set_current(loop);
@@ -719,13 +585,14 @@ birdloop_main(void *arg)
   while (1)
   {
     events_fire(loop);
-    timers_fire(loop);
+    times_update(loop);
+    timers_fire(&loop->time);
 
     times_update(loop);
     if (events_waiting(loop))
       timeout = 0;
-    else if (t = timers_first(loop))
-      timeout = (tm2_remains(t) TO_MS) + 1;
+    else if (t = timers_first(&loop->time))
+      timeout = (MAX(t - loop->time.last_time, 0) + (1 MS) - 1) TO_MS;
     else
       timeout = -1;
 
@@ -756,7 +623,8 @@ birdloop_main(void *arg)
     if (rv)
       sockets_fire(loop);
 
-    timers_fire(loop);
+    times_update(loop);
+    timers_fire(&loop->time);
   }
 
   loop->stop_called = 0;
@@ -741,52 +741,233 @@ bgp_rehash_buckets(struct bgp_proto *p)
   mb_free(old);
 }
 
-static struct bgp_bucket *
-bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
+/*
+ *	Update groups
+ *
+ *	Sessions with the same export filter and the same parameters affecting
+ *	bgp_import_control(), attribute normalization and encoding (see struct
+ *	bgp_group_key) form an update group. Such sessions export the same
+ *	attributes for each route, so the update is generated once per group:
+ *
+ *	Within one rte_announce(), members get the same route and equal
+ *	temporary attributes from bgp_import_control() and the export filter
+ *	(which is run once per group by the nest export cache if possible).
+ *	The first member merges, normalizes and hashes them into a shared
+ *	attribute set, the other members recognize the same route change by
+ *	rte_announce_id, net, route and temporary attributes and take the set
+ *	without merging, normalizing and hashing it again. Initial feeds and
+ *	refeeds are done for each session separately, so they are not shared
+ *	this way. Shared sets are kept in a per-group hash table together with
+ *	their encoded form, so they are stored and encoded only once, too.
+ *
+ *	Each session still keeps its own buckets and prefix queues referencing
+ *	the shared sets. Peers drain their queues at different speeds and
+ *	updates of the same prefix are coalesced while waiting in a queue, so
+ *	queued prefixes and the NLRI part of UPDATE messages stay per session.
+ *
+ *	The key is taken when the session is established. If the export filter
+ *	is changed by reconfiguration, the session stays in its group until it
+ *	is restarted; that only prevents sharing, because the shared set is
+ *	reused only for the same export result, not based on the key.
+ */
+
+#define BAH_KEY(n)		n->hash, n->eattrs
+#define BAH_NEXT(n)		n->next
+#define BAH_EQ(h1,e1,h2,e2)	h1 == h2 && ea_same(e1, e2)
+#define BAH_FN(h,e)		h
+
+#define BAH_REHASH		bgp_bah_rehash
+#define BAH_PARAMS		/8, *2, 2, 2, 8, 20
+
+HASH_DEFINE_REHASH_FN(BAH, struct bgp_attrs)
+
+static list bgp_groups;			/* List of update groups */
+static pool *bgp_group_pool;		/* Pool for groups and shared attribute sets */
+
+static void
+bgp_group_key(struct bgp_proto *p, struct bgp_group_key *k)
+{
+  /* Zeroed padding allows comparing keys by memcmp() */
+  memset(k, 0, sizeof(struct bgp_group_key));
+  k->out_filter = p->p.cf->out_filter;
+  k->table = p->p.table;
+  k->source_addr = p->source_addr;
+  k->iface = p->neigh ? p->neigh->iface : NULL;
+  k->local_as = p->local_as;
+  k->rr_cluster_id = p->rr_cluster_id;
+  k->default_local_pref = p->cf->default_local_pref;
+  k->as4_session = p->as4_session;
+  k->is_internal = p->is_internal;
+  k->rs_client = p->rs_client;
+  k->rr_client = p->rr_client;
+  k->next_hop_self = p->cf->next_hop_self;
+  k->next_hop_keep = p->cf->next_hop_keep;
+  k->interpret_communities = p->cf->interpret_communities;
+  k->allow_local_pref = p->cf->allow_local_pref;
+  k->add_path_tx = p->add_path_tx;
+}
+
+static void
+bgp_join_group(struct bgp_proto *p)
 {
-  struct bgp_bucket *b;
+  struct bgp_group_key key;
+  struct bgp_group *g;
+
+  if (!bgp_group_pool)
+    {
+      bgp_group_pool = rp_new(&root_pool, "BGP update groups");
+      init_list(&bgp_groups);
+    }
+
+  bgp_group_key(p, &key);
+  WALK_LIST(g, bgp_groups)
+    if (!memcmp(&g->key, &key, sizeof(key)))
+      goto found;
+
+  g = mb_allocz(bgp_group_pool, sizeof(struct bgp_group));
+  g->key = key;
+  HASH_INIT(g->attrs_hash, bgp_group_pool, 8);
+  add_tail(&bgp_groups, &g->n);
+
+ found:
+  g->uc++;
+  p->group = g;
+}
+
+static void
+bgp_leave_group(struct bgp_proto *p)
+{
+  struct bgp_group *g = p->group;
+
+  p->group = NULL;
+  if (--g->uc)
+    return;
+
+  ASSERT(!g->attrs_hash.count);
+  rem_node(&g->n);
+  HASH_FREE(g->attrs_hash);
+  mb_free(g);
+}
+
+static struct bgp_attrs *
+bgp_get_attrs(struct bgp_group *g, ea_list *new, unsigned hash)
+{
+  struct bgp_attrs *a = HASH_FIND(g->attrs_hash, BAH, hash, new);
+  if (a)
+    return a;
+
   unsigned ea_size = sizeof(ea_list) + new->count * sizeof(eattr);
   unsigned ea_size_aligned = BIRD_ALIGN(ea_size, CPU_STRUCT_ALIGN);
-  unsigned size = sizeof(struct bgp_bucket) + ea_size_aligned;
+  unsigned size = sizeof(struct bgp_attrs) + ea_size_aligned;
   unsigned i;
   byte *dest;
-  unsigned index = hash & (p->hash_size - 1);
 
   /* Gather total size of non-inline attributes */
   for (i=0; i<new->count; i++)
     {
-      eattr *a = &new->attrs[i];
-      if (!(a->type & EAF_EMBEDDED))
-	size += BIRD_ALIGN(sizeof(struct adata) + a->u.ptr->length, CPU_STRUCT_ALIGN);
+      eattr *e = &new->attrs[i];
+      if (!(e->type & EAF_EMBEDDED))
+	size += BIRD_ALIGN(sizeof(struct adata) + e->u.ptr->length, CPU_STRUCT_ALIGN);
     }
 
-  /* Create the bucket and hash it */
-  b = mb_alloc(p->p.pool, size);
-  b->hash_next = p->bucket_hash[index];
-  if (b->hash_next)
-    b->hash_next->hash_prev = b;
-  p->bucket_hash[index] = b;
-  b->hash_prev = NULL;
-  b->hash = hash;
-  add_tail(&p->bucket_queue, &b->send_node);
-  init_list(&b->prefixes);
-  memcpy(b->eattrs, new, ea_size);
-  dest = ((byte *)b->eattrs) + ea_size_aligned;
+  a = mb_alloc(bgp_group_pool, size);
+  a->hash = hash;
+  a->uc = 0;
+  a->length = BAL_UNKNOWN;
+  a->data = NULL;
+  memcpy(a->eattrs, new, ea_size);
+  dest = ((byte *)a->eattrs) + ea_size_aligned;
 
   /* Copy values of non-inline attributes */
   for (i=0; i<new->count; i++)
     {
-      eattr *a = &b->eattrs->attrs[i];
-      if (!(a->type & EAF_EMBEDDED))
+      eattr *e = &a->eattrs->attrs[i];
+      if (!(e->type & EAF_EMBEDDED))
 	{
-	  struct adata *oa = a->u.ptr;
+	  struct adata *oa = e->u.ptr;
 	  struct adata *na = (struct adata *) dest;
 	  memcpy(na, oa, sizeof(struct adata) + oa->length);
-	  a->u.ptr = na;
+	  e->u.ptr = na;
 	  dest += BIRD_ALIGN(sizeof(struct adata) + na->length, CPU_STRUCT_ALIGN);
 	}
     }
 
+  HASH_INSERT2(g->attrs_hash, BAH, bgp_group_pool, a);
+  return a;
+}
+
+static void
+bgp_put_attrs(struct bgp_group *g, struct bgp_attrs *a)
+{
+  if (--a->uc)
+    return;
+
+  if (g->last_set == a)
+    g->last_set = NULL;
+
+  HASH_REMOVE2(g->attrs_hash, BAH, bgp_group_pool, a);
+  mb_free(a->data);
+  mb_free(a);
+}
+
+/**
+ * bgp_encode_bucket_attrs - encode attributes of a bucket
+ * @p: BGP instance
+ * @w: output buffer
+ * @buck: bucket
+ * @remains: space available in @w
+ *
+ * The function copies the encoded attributes of a bucket to @w. The
+ * encoding is done only once per update group and kept in the shared
+ * attribute set for all other members of the group.
+ *
+ * Result: Length of the attribute block or -1 if not enough space.
+ */
+int
+bgp_encode_bucket_attrs(struct bgp_proto *p, byte *w, struct bgp_bucket *buck, int remains)
+{
+  static byte buf[BGP_MAX_EXT_MSG_LENGTH];
+  struct bgp_attrs *a = buck->attrs;
+
+  if (a->length == BAL_UNKNOWN)
+    {
+      int len = bgp_encode_attrs(p, buf, a->eattrs, sizeof(buf));
+      if (len >= 0)
+	{
+	  a->data = mb_alloc(bgp_group_pool, len);
+	  memcpy(a->data, buf, len);
+	  a->length = len;
+	}
+      else
+	a->length = BAL_TOO_LONG;
+    }
+
+  if ((a->length < 0) || (a->length > remains))
+    return -1;
+
+  memcpy(w, a->data, a->length);
+  return a->length;
+}
+
+static struct bgp_bucket *
+bgp_new_bucket(struct bgp_proto *p, struct bgp_attrs *attrs)
+{
+  struct bgp_bucket *b;
+  unsigned index = attrs->hash & (p->hash_size - 1);
+
+  /* Create the bucket and hash it */
+  b = mb_alloc(p->p.pool, sizeof(struct bgp_bucket));
+  b->hash_next = p->bucket_hash[index];
+  if (b->hash_next)
+    b->hash_next->hash_prev = b;
+  p->bucket_hash[index] = b;
+  b->hash_prev = NULL;
+  b->hash = attrs->hash;
+  add_tail(&p->bucket_queue, &b->send_node);
+  init_list(&b->prefixes);
+  b->attrs = attrs;
+  attrs->uc++;
+
   /* If needed, rehash */
   p->hash_count++;
   if (p->hash_count > p->hash_limit)
@@ -795,14 +976,13 @@ bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
   return b;
 }
 
-static struct bgp_bucket *
-bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
+static struct bgp_attrs *
+bgp_generate_attrs(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
 {
   ea_list *new;
-  unsigned i, cnt, hash, code;
+  unsigned i, cnt, code;
   eattr *a, *d;
   u32 seen = 0;
-  struct bgp_bucket *b;
 
   /* Merge the attribute list */
   new = alloca(ea_scan(attrs));
@@ -874,15 +1054,6 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
       new->count++;
     }
 
-  /* Hash */
-  hash = ea_hash(new);
-  for(b=p->bucket_hash[hash & (p->hash_size - 1)]; b; b=b->hash_next)
-    if (b->hash == hash && ea_same(b->eattrs, new))
-      {
-	DBG("Found bucket.\n");
-	return b;
-      }
-
   /* Ensure that there are all mandatory attributes */
   for(i=0; i<ARRAY_SIZE(bgp_mandatory_attrs); i++)
     if (!(seen & (1 << bgp_mandatory_attrs[i])))
@@ -891,17 +1062,63 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
 	return NULL;
       }
 
-  /* Check if next hop is valid */
-  a = ea_find(new, EA_CODE(EAP_BGP, BA_NEXT_HOP));
+  return bgp_get_attrs(p->group, new, ea_hash(new));
+}
+
+static struct bgp_bucket *
+bgp_get_bucket(struct bgp_proto *p, net *n, rte *rt, ea_list *attrs, int originate)
+{
+  struct bgp_group *g = p->group;
+  struct bgp_attrs *set;
+  struct bgp_bucket *b;
+  eattr *a;
+
+  /*
+   * Another member of the group may have generated the update already. Its
+   * temporary attributes are still valid during the same rte_announce().
+   */
+  if (rte_announce_id && (g->last_announce == rte_announce_id) && g->last_set &&
+      (g->last_net == n) && (g->last_rte == rt) && rte_tmpa_same(g->last_attrs, attrs))
+    set = g->last_set;
+  else
+    {
+      set = bgp_generate_attrs(p, n, attrs, originate);
+      if (!set)
+	return NULL;
+
+      g->last_announce = rte_announce_id;
+      g->last_net = n;
+      g->last_rte = rt;
+      g->last_attrs = attrs;
+      g->last_set = set;
+    }
+
+  for(b=p->bucket_hash[set->hash & (p->hash_size - 1)]; b; b=b->hash_next)
+    if (b->attrs == set)
+      {
+	DBG("Found bucket.\n");
+	return b;
+      }
+
+  /* Check if next hop is valid, it must not point back to the peer */
+  a = ea_find(set->eattrs, EA_CODE(EAP_BGP, BA_NEXT_HOP));
   if (!a || ipa_equal(p->cf->remote_ip, *(ip_addr *)a->u.ptr->data))
     {
       log(L_ERR "%s: Invalid NEXT_HOP attribute in route %I/%d", p->p.name, n->n.prefix, n->n.pxlen);
-      return NULL;
+      goto invalid;
     }
 
   /* Create new bucket */
   DBG("Creating bucket.\n");
-  return bgp_new_bucket(p, new, hash);
+  return bgp_new_bucket(p, set);
+
+ invalid:
+  if (!set->uc)
+    {
+      set->uc++;
+      bgp_put_attrs(g, set);
+    }
+  return NULL;
 }
 
 void
@@ -913,6 +1130,7 @@ bgp_free_bucket(struct bgp_proto *p, struct bgp_bucket *buck)
     buck->hash_prev->hash_next = buck->hash_next;
   else
     p->bucket_hash[buck->hash & (p->hash_size-1)] = buck->hash_next;
+  bgp_put_attrs(p->group, buck->attrs);
   mb_free(buck);
 }
 
@@ -988,7 +1206,7 @@ bgp_rt_notify(struct proto *P, rtable *tbl UNUSED, net *n, rte *new, rte *old UN
   if (new)
     {
       key = new;
-      buck = bgp_get_bucket(p, n, attrs, new->attrs->source != RTS_BGP);
+      buck = bgp_get_bucket(p, n, new, attrs, new->attrs->source != RTS_BGP);
       if (!buck)			/* Inconsistent attribute list */
 	return;
     }
@@ -997,7 +1215,7 @@ bgp_rt_notify(struct proto *P, rtable *tbl UNUSED, net *n, rte *new, rte *old UN
       key = old;
       if (!(buck = p->withdraw_bucket))
 	{
-	  buck = p->withdraw_bucket = mb_alloc(P->pool, sizeof(struct bgp_bucket));
+	  buck = p->withdraw_bucket = mb_allocz(P->pool, sizeof(struct bgp_bucket));
 	  init_list(&buck->prefixes);
 	}
     }
@@ -1955,6 +2173,7 @@ bgp_init_bucket_table(struct bgp_proto *p)
   p->bucket_hash = mb_allocz(p->p.pool, p->hash_size * sizeof(struct bgp_bucket *));
   init_list(&p->bucket_queue);
   p->withdraw_bucket = NULL;
+  bgp_join_group(p);
   // fib_init(&p->prefix_fib, p->p.pool, sizeof(struct bgp_prefix), 0, bgp_init_prefix);
 }
 
@@ -1968,11 +2187,13 @@ bgp_free_bucket_table(struct bgp_proto *p)
   WALK_LIST_FIRST(b, p->bucket_queue)
   {
     rem_node(&b->send_node);
+    bgp_put_attrs(p->group, b->attrs);
     mb_free(b);
   }
 
   mb_free(p->withdraw_bucket);
   p->withdraw_bucket = NULL;
+  bgp_leave_group(p);
 }
 
 void
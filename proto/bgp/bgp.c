@@ -38,7 +38,10 @@
  * the same destination queued for sending, so that we can replace it with the new one
  * immediately instead of sending both updates). There also exists a special bucket holding
  * all the route withdrawals which cannot be queued anywhere else as they don't have any
- * attributes. If we have any packet to send (due to either new routes or the connection
+ * attributes. The attribute sets themselves are shared between all sessions of
+ * the same update group (&bgp_group, sessions encoding attributes the same way),
+ * so each distinct set is stored and encoded to its wire form only once.
+ * If we have any packet to send (due to either new routes or the connection
  * tracking code wanting to send a Open, Keepalive or Notification message), we call
  * bgp_schedule_packet() which sets the corresponding bit in a @packet_to_send
  * bit field in &bgp_conn and as soon as the transmit socket buffer becomes empty,
@@ -1535,15 +1538,15 @@ bgp_show_proto_info(struct proto *P)
       if ((p->start_state < BSS_CONNECT) &&
 	  (p->startup_timer->expires))
 	cli_msg(-1006, "    Error wait:       %d/%d",
-		p->startup_timer->expires - now, p->startup_delay);
+		tm_remains(p->startup_timer), p->startup_delay);
 
       if ((oc->state == BS_ACTIVE) &&
 	  (oc->connect_retry_timer->expires))
 	cli_msg(-1006, "    Connect delay:    %d/%d",
-		oc->connect_retry_timer->expires - now, p->cf->connect_delay_time);
+		tm_remains(oc->connect_retry_timer), p->cf->connect_delay_time);
 
       if (p->gr_active && p->gr_timer->expires)
-	cli_msg(-1006, "    Restart timer:    %d/-", p->gr_timer->expires - now);
+	cli_msg(-1006, "    Restart timer:    %d/-", tm_remains(p->gr_timer));
     }
   else if (P->proto_state == PS_UP)
     {
@@ -1588,8 +1591,10 @@ struct protocol proto_bgp = {
   .name = 		"BGP",
   .template = 		"bgp%d",
   .attr_class = 	EAP_BGP,
+  .parallel_import =	1,
   .preference = 	DEF_PREF_BGP,
   .config_size =	sizeof(struct bgp_config),
+  .rte_size =		RTE_DATA_SIZE(bgp),
   .init = 		bgp_init,
   .start = 		bgp_start,
   .shutdown = 		bgp_shutdown,
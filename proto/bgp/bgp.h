@@ -146,6 +146,7 @@ struct bgp_proto {
   struct event *event;			/* Event for respawning and shutting process */
   struct timer *startup_timer;		/* Timer used to delay protocol startup due to previous errors (startup_delay) */
   struct timer *gr_timer;		/* Timer waiting for reestablishment after graceful restart */
+  struct bgp_group *group;		/* Update group, shares generated updates */
   struct bgp_bucket **bucket_hash;	/* Hash table of attribute buckets */
   uint hash_size, hash_count, hash_limit;
   HASH(struct bgp_prefix) prefix_hash;	/* Prefixes to be sent */
@@ -179,9 +180,52 @@ struct bgp_bucket {
   struct bgp_bucket *hash_next, *hash_prev;	/* Node in bucket hash table */
   unsigned hash;			/* Hash over extended attributes */
   list prefixes;			/* Prefixes in this buckets */
-  ea_list eattrs[0];			/* Per-bucket extended attributes */
+  struct bgp_attrs *attrs;		/* Shared attribute set, NULL for withdraws */
 };
 
+struct bgp_group_key {
+  struct filter *out_filter;		/* Export filter */
+  rtable *table;				/* Table we export from */
+  ip_addr source_addr;			/* Used for NEXT_HOP by bgp_import_control() */
+  struct iface *iface;			/* Neighbor interface, NULL for multihop */
+  u32 local_as;
+  u32 rr_cluster_id;
+  u32 default_local_pref;
+  u8 as4_session;			/* The only parameter bgp_encode_attrs() depends on */
+  u8 is_internal;
+  u8 rs_client;
+  u8 rr_client;
+  u8 next_hop_self;
+  u8 next_hop_keep;
+  u8 interpret_communities;
+  u8 allow_local_pref;
+  u8 add_path_tx;
+};
+
+struct bgp_group {
+  node n;				/* Node in global list of update groups */
+  uint uc;				/* Number of sessions in the group */
+  struct bgp_group_key key;		/* Session parameters shared by all members */
+  HASH(struct bgp_attrs) attrs_hash;	/* Shared attribute sets */
+  u32 last_announce;			/* rte_announce_id of the last generated update */
+  net *last_net;			/* Its network, route and temporary attributes */
+  rte *last_rte;
+  ea_list *last_attrs;
+  struct bgp_attrs *last_set;		/* Attribute set generated for it */
+};
+
+struct bgp_attrs {
+  struct bgp_attrs *next;		/* Node in group hash table */
+  unsigned hash;			/* Hash over extended attributes */
+  uint uc;				/* Number of buckets using this set */
+  int length;				/* Length of encoded attributes, see BAL_* */
+  byte *data;				/* Encoded attributes, shared by all group members */
+  ea_list eattrs[0];			/* Normalized extended attributes */
+};
+
+#define BAL_UNKNOWN	-1		/* Attributes not yet encoded */
+#define BAL_TOO_LONG	-2		/* Attributes do not fit in any message */
+
 #define BGP_PORT		179
 #define BGP_VERSION		4
 #define BGP_HEADER_LENGTH	19
@@ -256,6 +300,7 @@ int bgp_import_control(struct proto *, struct rte **, struct ea_list **, struct
 void bgp_init_bucket_table(struct bgp_proto *);
 void bgp_free_bucket_table(struct bgp_proto *p);
 void bgp_free_bucket(struct bgp_proto *p, struct bgp_bucket *buck);
+int bgp_encode_bucket_attrs(struct bgp_proto *p, byte *w, struct bgp_bucket *buck, int remains);
 void bgp_init_prefix_table(struct bgp_proto *p, u32 order);
 void bgp_free_prefix_table(struct bgp_proto *p);
 void bgp_free_prefix(struct bgp_proto *p, struct bgp_prefix *bp);
@@ -382,7 +382,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	    }
 
 	  DBG("Processing bucket %p\n", buck);
-	  a_size = bgp_encode_attrs(p, w+2, buck->eattrs, remains - 1024);
+	  a_size = bgp_encode_bucket_attrs(p, w+2, buck, remains - 1024);
 
 	  if (a_size < 0)
 	    {
@@ -477,7 +477,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	  rem_stored = remains;
 	  w_stored = w;
 
-	  size = bgp_encode_attrs(p, w, buck->eattrs, remains - 1024);
+	  size = bgp_encode_bucket_attrs(p, w, buck, remains - 1024);
 	  if (size < 0)
 	    {
 	      log(L_ERR "%s: Attribute list too long, skipping corresponding routes", p->p.name);
@@ -491,7 +491,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 
 	  /* We have two addresses here in NEXT_HOP eattr. Really.
 	     Unless NEXT_HOP was modified by filter */
-	  nh = ea_find(buck->eattrs, EA_CODE(EAP_BGP, BA_NEXT_HOP));
+	  nh = ea_find(buck->attrs->eattrs, EA_CODE(EAP_BGP, BA_NEXT_HOP));
 	  ASSERT(nh);
 	  second = (nh->u.ptr->length == NEXT_HOP_LENGTH);
 	  ipp = (ip_addr *) nh->u.ptr->data;
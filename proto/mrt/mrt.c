@@ -0,0 +1,555 @@
+/*
+ *	BIRD -- Multi-Threaded Routing Toolkit (MRT) Table Dumps
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: MRT
+ *
+ * The MRT protocol periodically dumps the contents of a routing table to
+ * a file in the MRT TABLE_DUMP_V2 format (RFC 6396), which is understood
+ * by common route analysis tools.
+ *
+ * A dump starts by writing a PEER_INDEX_TABLE record listing the BGP
+ * peers, followed by one RIB_IPV4_UNICAST or RIB_IPV6_UNICAST record for
+ * each network with at least one exported route. The table is walked in
+ * the background by a &fib_iterator, just %MRT_DUMP_STEP networks in one
+ * event, so a dump of a large table does not block other processing.
+ * Route attributes are encoded by bgp_encode_attrs() and records are
+ * written to a buffered MRT stream (see mrt_stream_open()).
+ *
+ * The protocol does not connect to the table by an announce hook, it
+ * just keeps the table locked while it is running.
+ */
+
+#undef LOCAL_DEBUG
+
+#include "nest/bird.h"
+#include "nest/iface.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "nest/cli.h"
+#include "conf/conf.h"
+#include "filter/filter.h"
+#include "lib/string.h"
+#include "proto/bgp/bgp.h"
+
+#include "mrt.h"
+
+#define PEER_KEY(n)		n->proto
+#define PEER_NEXT(n)		n->next
+#define PEER_EQ(p1,p2)		p1 == p2
+#define PEER_FN(p)		p->hash_key
+
+#define MRT_PEER_AS4		0x02	/* Peer type flags in PEER_INDEX_TABLE */
+#define MRT_PEER_IPV6		0x01
+
+#ifdef IPV6
+#define MRT_PEER_TYPE		(MRT_PEER_AS4 | MRT_PEER_IPV6)
+#define MRT_RIB_SUBTYPE		RIB_IPV6_UNICAST
+#else
+#define MRT_PEER_TYPE		MRT_PEER_AS4
+#define MRT_RIB_SUBTYPE		RIB_IPV4_UNICAST
+#endif
+
+/*
+ * bgp_encode_attrs() depends just on as4_session and TABLE_DUMP_V2
+ * requires AS_PATH with 4-byte AS numbers.
+ */
+static struct bgp_proto mrt_bgp_as4 = { .as4_session = 1 };
+
+
+static inline void
+mrt_buf_reset(struct mrt_proto *p)
+{
+  p->bpos = p->buf + MRTDUMP_HDR_LENGTH;
+}
+
+static void
+mrt_buf_need(struct mrt_proto *p, uint len)
+{
+  uint pos = p->bpos - p->buf;
+  uint size = p->bend - p->buf;
+
+  if (pos + len <= size)
+    return;
+
+  while (pos + len > size)
+    size *= 2;
+
+  p->buf = mb_realloc(p->buf, size);
+  p->bpos = p->buf + pos;
+  p->bend = p->buf + size;
+}
+
+static inline void
+mrt_put_u8(struct mrt_proto *p, uint v)
+{
+  mrt_buf_need(p, 1);
+  *p->bpos++ = v;
+}
+
+static inline void
+mrt_put_u16(struct mrt_proto *p, uint v)
+{
+  mrt_buf_need(p, 2);
+  put_u16(p->bpos, v);
+  p->bpos += 2;
+}
+
+static inline void
+mrt_put_u32(struct mrt_proto *p, u32 v)
+{
+  mrt_buf_need(p, 4);
+  put_u32(p->bpos, v);
+  p->bpos += 4;
+}
+
+static inline void
+mrt_put_ipa(struct mrt_proto *p, ip_addr a)
+{
+  mrt_buf_need(p, sizeof(ip_addr));
+  p->bpos = put_ipa(p->bpos, a);
+}
+
+static void
+mrt_put_peer(struct mrt_proto *p, u32 id, ip_addr addr, u32 as)
+{
+  mrt_put_u8(p, MRT_PEER_TYPE);
+  mrt_put_u32(p, id);
+  mrt_put_ipa(p, addr);
+  mrt_put_u32(p, as);
+}
+
+static inline uint
+mrt_buf_pos(struct mrt_proto *p)
+{
+  return p->bpos - p->buf;
+}
+
+static inline void
+mrt_write(struct mrt_proto *p, uint subtype)
+{
+  mrt_stream_write(p->stream, TABLE_DUMP_V2, subtype, p->buf, p->bpos - p->buf);
+}
+
+
+/*
+ *	Peer Index Table
+ */
+
+static void
+mrt_peer_table_dump(struct mrt_proto *p)
+{
+  struct proto *P;
+  uint count = 1;
+  uint name_len = strlen(p->p.table->name);
+  uint cnt;
+
+  WALK_LIST(P, active_proto_list)
+    if (P->proto == &proto_bgp)
+      count++;
+
+  count = MIN(count, 0xffff);
+  p->peer_array = mb_alloc(p->p.pool, count * sizeof(struct mrt_peer));
+  HASH_INIT(p->peer_hash, p->p.pool, MAX(u32_log2(count), 2));
+
+  mrt_buf_reset(p);
+  mrt_put_u32(p, proto_get_router_id(p->p.cf));
+  mrt_put_u16(p, name_len);
+  mrt_buf_need(p, name_len);
+  memcpy(p->bpos, p->p.table->name, name_len);
+  p->bpos += name_len;
+
+  cnt = mrt_buf_pos(p);
+  mrt_put_u16(p, 0);
+
+  /* Index 0 is used for routes not originated by a BGP peer */
+  mrt_put_peer(p, proto_get_router_id(p->p.cf), IPA_NONE, 0);
+  p->peers = 1;
+
+  WALK_LIST(P, active_proto_list)
+    if ((P->proto == &proto_bgp) && (p->peers < count))
+      {
+	struct bgp_proto *bgp = (struct bgp_proto *) P;
+	struct mrt_peer *n = &p->peer_array[p->peers];
+
+	n->proto = P;
+	n->index = p->peers++;
+	HASH_INSERT(p->peer_hash, PEER, n);
+
+	mrt_put_peer(p, bgp->remote_id, bgp->cf->remote_ip, bgp->remote_as);
+      }
+
+  put_u16(p->buf + cnt, p->peers);
+  mrt_write(p, PEER_INDEX_TABLE);
+}
+
+static inline uint
+mrt_peer_index(struct mrt_proto *p, struct proto *P)
+{
+  struct mrt_peer *n = HASH_FIND(p->peer_hash, PEER, P);
+  return n ? n->index : 0;
+}
+
+
+/*
+ *	RIB Records
+ */
+
+#ifdef IPV6
+static void
+mrt_put_mp_reach(struct mrt_proto *p, ea_list *ea)
+{
+  eattr *nh = ea_find(ea, EA_CODE(EAP_BGP, BA_NEXT_HOP));
+  if (!nh)
+    return;
+
+  /* Just the next hop part of MP_REACH_NLRI, see RFC 6396 4.3.4 */
+  ip_addr *ipp = (ip_addr *) nh->u.ptr->data;
+  int second = (nh->u.ptr->length == NEXT_HOP_LENGTH) && ipa_nonzero(ipp[1]);
+  uint len = second ? 32 : 16;
+
+  mrt_put_u8(p, BAF_OPTIONAL);
+  mrt_put_u8(p, BA_MP_REACH_NLRI);
+  mrt_put_u8(p, len + 1);
+  mrt_put_u8(p, len);
+  mrt_put_ipa(p, ipp[0]);
+  if (second)
+    mrt_put_ipa(p, ipp[1]);
+}
+#endif
+
+static void
+mrt_rib_entry(struct mrt_proto *p, rte *e)
+{
+  ea_list *ea = lp_alloc(p->lp, ea_scan(e->attrs->eattrs));
+  uint len, i, j;
+  int rv;
+
+  ea_merge(e->attrs->eattrs, ea);
+  ea_sort(ea);
+
+  /* Keep just BGP attributes */
+  for (i = j = 0; i < ea->count; i++)
+    if (EA_PROTO(ea->attrs[i].id) == EAP_BGP)
+      ea->attrs[j++] = ea->attrs[i];
+  ea->count = j;
+
+  mrt_put_u16(p, mrt_peer_index(p, e->attrs->src->proto));
+  mrt_put_u32(p, now_real - (now - (bird_clock_t) e->lastmod));
+  len = mrt_buf_pos(p);
+  mrt_put_u16(p, 0);
+
+#ifdef IPV6
+  mrt_put_mp_reach(p, ea);
+#endif
+
+  mrt_buf_need(p, 1024);
+  while ((rv = bgp_encode_attrs(&mrt_bgp_as4, p->bpos, ea, p->bend - p->bpos)) < 0)
+    mrt_buf_need(p, 2 * (p->bend - p->bpos));
+  p->bpos += rv;
+
+  put_u16(p->buf + len, mrt_buf_pos(p) - len - 2);
+}
+
+static void
+mrt_rib_dump(struct mrt_proto *p, net *n)
+{
+  struct filter *filter = p->filter;
+  uint plen = (n->n.pxlen + 7) / 8;
+  uint entries = 0;
+  uint cnt;
+  rte *e;
+
+  mrt_buf_reset(p);
+  mrt_put_u32(p, p->seqnum);
+  mrt_put_u8(p, n->n.pxlen);
+
+  byte prefix[sizeof(ip_addr)];
+  put_ipa(prefix, n->n.prefix);
+  mrt_buf_need(p, plen);
+  memcpy(p->bpos, prefix, plen);
+  p->bpos += plen;
+
+  cnt = mrt_buf_pos(p);
+  mrt_put_u16(p, 0);
+
+  for (e = n->routes; e; e = e->next)
+    {
+      rte *ee = e;
+      ea_list *tmpa;
+
+      if (rte_is_filtered(e))
+	continue;
+
+      tmpa = e->attrs->src->proto->make_tmp_attrs ?
+	e->attrs->src->proto->make_tmp_attrs(e, p->lp) : NULL;
+
+      if ((filter == FILTER_REJECT) ||
+	  (f_run(filter, &e, &tmpa, p->lp, 0) > F_ACCEPT))
+	goto skip;
+
+      if (entries < 0xffff)
+	{
+	  mrt_rib_entry(p, e);
+	  entries++;
+	}
+
+    skip:
+      if (e != ee)
+	{
+	  rte_free(e);
+	  e = ee;
+	}
+    }
+
+  lp_flush(p->lp);
+
+  if (!entries)
+    return;
+
+  put_u16(p->buf + cnt, entries);
+  mrt_write(p, MRT_RIB_SUBTYPE);
+  p->seqnum++;
+  p->entries += entries;
+}
+
+
+/*
+ *	Dump Control
+ */
+
+static void
+mrt_dump_stop(struct mrt_proto *p)
+{
+  rfree(p->stream);
+  p->stream = NULL;
+
+  HASH_FREE(p->peer_hash);
+  mb_free(p->peer_array);
+  p->peer_array = NULL;
+
+  p->filter = NULL;
+  if (p->filter_config)
+    {
+      config_del_obstacle(p->filter_config);
+      p->filter_config = NULL;
+    }
+}
+
+static void
+mrt_dump_start(struct mrt_proto *p)
+{
+  struct mrt_config *cf = (struct mrt_config *) p->p.cf;
+
+  if (p->stream)
+    {
+      log(L_WARN "%s: Previous dump of table %s not finished, skipping", p->p.name, p->p.table->name);
+      return;
+    }
+
+  p->stream = mrt_stream_open(p->p.pool, cf->filename, 1, 0);
+  if (!p->stream)
+    {
+      log(L_ERR "%s: Unable to open file %s: %m", p->p.name, cf->filename);
+      return;
+    }
+
+  TRACE(D_EVENTS, "Dumping table %s", p->p.table->name);
+
+  p->filter = cf->c.out_filter;
+  p->seqnum = 0;
+  p->entries = 0;
+  mrt_peer_table_dump(p);
+
+  FIB_ITERATE_INIT(&p->fit, &p->p.table->fib);
+  ev_schedule(p->dump_event);
+}
+
+static void
+mrt_dump_step(void *P)
+{
+  struct mrt_proto *p = P;
+  struct fib *fib = &p->p.table->fib;
+  uint max = MRT_DUMP_STEP;
+
+  FIB_ITERATE_START(fib, &p->fit, f)
+    {
+      if (!max--)
+	{
+	  FIB_ITERATE_PUT(&p->fit, f);
+	  ev_schedule(p->dump_event);
+	  return;
+	}
+
+      mrt_rib_dump(p, (net *) f);
+    }
+  FIB_ITERATE_END(f);
+
+  TRACE(D_EVENTS, "Dump of table %s finished, %u routes for %u networks",
+	p->p.table->name, p->entries, p->seqnum);
+
+  mrt_dump_stop(p);
+  p->dumps++;
+  p->last_dump = now;
+  p->last_routes = p->entries;
+  p->last_networks = p->seqnum;
+}
+
+static void
+mrt_dump_abort(struct mrt_proto *p)
+{
+  if (!p->stream)
+    return;
+
+  ev_postpone(p->dump_event);
+  fit_get(&p->p.table->fib, &p->fit);
+  mrt_dump_stop(p);
+}
+
+static void
+mrt_period_hook(timer *t)
+{
+  mrt_dump_start(t->data);
+}
+
+
+/*
+ *	Protocol Glue
+ */
+
+static struct proto *
+mrt_init(struct proto_config *C)
+{
+  return proto_new(C, sizeof(struct mrt_proto));
+}
+
+static int
+mrt_start(struct proto *P)
+{
+  struct mrt_proto *p = (struct mrt_proto *) P;
+  struct mrt_config *cf = (struct mrt_config *) P->cf;
+
+  /* Lock the table, unlock is handled in mrt_cleanup() */
+  rt_lock_table(P->table);
+
+  p->lp = lp_new(P->pool, 4080);
+  p->buf = mb_alloc(P->pool, 4096);
+  p->bend = p->buf + 4096;
+  p->stream = NULL;
+
+  p->dump_event = ev_new(P->pool);
+  p->dump_event->hook = mrt_dump_step;
+  p->dump_event->data = p;
+
+  p->period_timer = tm_new_set(P->pool, mrt_period_hook, p, 0, cf->period);
+  tm_start(p->period_timer, cf->period);
+
+  return PS_UP;
+}
+
+static int
+mrt_shutdown(struct proto *P)
+{
+  struct mrt_proto *p = (struct mrt_proto *) P;
+
+  mrt_dump_abort(p);
+  return PS_DOWN;
+}
+
+static void
+mrt_cleanup(struct proto *P)
+{
+  rt_unlock_table(P->table);
+}
+
+static void
+mrt_postconfig(struct proto_config *C)
+{
+  struct mrt_config *c = (struct mrt_config *) C;
+
+  if (!c->filename)
+    cf_error("File name not specified");
+}
+
+static int
+mrt_reconfigure(struct proto *P, struct proto_config *new)
+{
+  struct mrt_proto *p = (struct mrt_proto *) P;
+  struct mrt_config *oc = (struct mrt_config *) P->cf;
+  struct mrt_config *nc = (struct mrt_config *) new;
+
+  /*
+   * Changes of the file name and the filter apply to the next dump. The
+   * running one keeps using the old filter, so the old config must not be
+   * freed until the dump is finished.
+   */
+  if (p->stream && !p->filter_config)
+    {
+      p->filter_config = oc->c.global;
+      config_add_obstacle(p->filter_config);
+    }
+
+  if ((P->proto_state == PS_UP) && (nc->period != oc->period))
+    {
+      p->period_timer->recurrent = nc->period;
+      tm_start(p->period_timer, nc->period);
+    }
+
+  return 1;
+}
+
+static void
+mrt_copy_config(struct proto_config *dest, struct proto_config *src)
+{
+  /* Just a shallow copy, not many items here */
+  proto_copy_rest(dest, src, sizeof(struct mrt_config));
+}
+
+static void
+mrt_get_status(struct proto *P, byte *buf)
+{
+  struct mrt_proto *p = (struct mrt_proto *) P;
+
+  if (p->stream)
+    bsprintf(buf, "Dumping");
+}
+
+static void
+mrt_show_proto_info(struct proto *P)
+{
+  struct mrt_proto *p = (struct mrt_proto *) P;
+  struct mrt_config *cf = (struct mrt_config *) P->cf;
+
+  cli_msg(-1006, "  Table:          %s", P->table->name);
+  cli_msg(-1006, "  Output filter:  %s", filter_name(cf->c.out_filter));
+  cli_msg(-1006, "  File name:      %s", cf->filename);
+  cli_msg(-1006, "  Period:         %u s", cf->period);
+
+  if (P->proto_state != PS_DOWN)
+    {
+      cli_msg(-1006, "  Dumps:          %u finished", p->dumps);
+      if (p->dumps)
+	cli_msg(-1006, "  Last dump:      %u routes for %u networks, %d s ago",
+		p->last_routes, p->last_networks, (int) (now - p->last_dump));
+    }
+}
+
+
+struct protocol proto_mrt = {
+  .name =		"MRT",
+  .template =		"mrt%d",
+  .multitable =		1,
+  .config_size =	sizeof(struct mrt_config),
+  .postconfig =		mrt_postconfig,
+  .init =		mrt_init,
+  .start =		mrt_start,
+  .shutdown =		mrt_shutdown,
+  .cleanup =		mrt_cleanup,
+  .reconfigure =	mrt_reconfigure,
+  .copy_config =	mrt_copy_config,
+  .get_status =		mrt_get_status,
+  .show_proto_info =	mrt_show_proto_info
+};
@@ -0,0 +1,51 @@
+/*
+ *	BIRD -- Multi-Threaded Routing Toolkit (MRT) Table Dumps
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_MRT_H_
+#define _BIRD_MRT_H_
+
+#include "nest/bird.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "nest/mrtdump.h"
+#include "lib/hash.h"
+
+#define MRT_DEFAULT_PERIOD	900	/* Default period of table dumps */
+#define MRT_DUMP_STEP		256	/* Networks dumped in one event */
+
+struct mrt_config {
+  struct proto_config c;
+  char *filename;			/* Name of dump files, strftime() pattern */
+  uint period;				/* Period of table dumps [s] */
+};
+
+struct mrt_peer {
+  struct mrt_peer *next;		/* Next in mrt_proto->peer_hash */
+  struct proto *proto;			/* BGP protocol of the peer */
+  uint index;				/* Index in PEER_INDEX_TABLE */
+};
+
+struct mrt_proto {
+  struct proto p;
+  timer *period_timer;			/* Starts table dumps */
+  event *dump_event;			/* Dumps next part of the table */
+  struct mrt_stream *stream;		/* Current dump file, NULL if no dump is running */
+  struct filter *filter;		/* Filter of the current dump */
+  struct config *filter_config;		/* Old config holding it, locked by an obstacle */
+  struct fib_iterator fit;		/* Position in the table */
+  linpool *lp;				/* Peer hash and route filtering */
+  HASH(struct mrt_peer) peer_hash;	/* BGP peers in current dump */
+  struct mrt_peer *peer_array;		/* Storage of peer_hash nodes */
+  byte *buf, *bpos, *bend;		/* Buffer for the current MRT record */
+  u32 seqnum;				/* Sequence number of the next RIB record */
+  uint peers;				/* Number of peers in current dump */
+  uint entries;				/* Number of RIB entries in current dump */
+  uint dumps;				/* Number of finished dumps */
+  uint last_routes, last_networks;	/* Size of the last finished dump */
+  bird_clock_t last_dump;		/* Time the last dump was finished */
+};
+
+#endif
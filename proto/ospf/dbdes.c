@@ -158,6 +158,7 @@ ospf_prepare_dbdes(struct ospf_proto *p, struct ospf_neighbor *n)
       if ((en->lsa.age < LSA_MAXAGE) &&
 	  lsa_flooding_allowed(en->lsa_type, en->domain, ifa))
       {
+	ospf_update_lsa_age(en);
 	lsa_hton_hdr(&(en->lsa), lsas + i);
 	i++;
       }
@@ -265,6 +266,9 @@ ospf_process_dbdes(struct ospf_proto *p, struct ospf_packet *pkt, struct ospf_ne
       DROP1("LSA with invalid scope");
 
     en = ospf_hash_find(p->gr, lsa_domain, lsa.id, lsa.rt, lsa_type);
+    if (en)
+      ospf_update_lsa_age(en);
+
     if (!en || (lsa_comp(&lsa, &(en->lsa)) == CMP_NEWER))
     {
       /* This should be splitted to ospf_lsa_lsrq_up() */
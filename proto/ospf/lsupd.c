@@ -244,6 +244,8 @@ ospf_flood_lsa(struct ospf_proto *p, struct top_hash_entry *en, struct ospf_neig
   struct ospf_iface *ifa;
   struct ospf_neighbor *n;
 
+  ospf_update_lsa_age(en);
+
   /* RFC 2328 13.3 */
 
   int back = 0;
@@ -360,6 +362,7 @@ ospf_prepare_lsupd(struct ospf_proto *p, struct ospf_iface *ifa,
     }
 
     struct ospf_lsa_header *buf = ((void *) pkt) + pos;
+    ospf_update_lsa_age(en);
     lsa_hton_hdr(&en->lsa, buf);
     lsa_hton_body(en->lsa_body, ((void *) buf) + sizeof(struct ospf_lsa_header),
 		  len - sizeof(struct ospf_lsa_header));
@@ -552,6 +555,8 @@ ospf_receive_lsupd(struct ospf_packet *pkt, struct ospf_iface *ifa,
 
     /* Find local copy of LSA in link state database */
     en = ospf_hash_find(p->gr, lsa_domain, lsa.id, lsa.rt, lsa_type);
+    if (en)
+      ospf_update_lsa_age(en);
 
 #ifdef LOCAL_DEBUG
     if (en)
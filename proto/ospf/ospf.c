@@ -66,8 +66,9 @@
  *
  * The heart beat of ospf is ospf_disp(). It is called at regular intervals
  * (&ospf_proto->tick). It is responsible for aging and flushing of LSAs in the
- * database, updating topology information in LSAs and for routing table
- * calculation.
+ * database and updating topology information in LSAs. Routing table
+ * calculation is started by a separate timer with sub-second delay, according
+ * to the SPF delay algorithm from RFC 8405 (see ospf_spf_trigger()).
  *
  * To every &ospf_iface, we connect one or more &ospf_neighbor's -- a structure
  * containing many timers and queues for building adjacency and for exchange of
@@ -106,6 +107,9 @@ static int ospf_reload_routes(struct proto *P);
 static int ospf_rte_better(struct rte *new, struct rte *old);
 static int ospf_rte_same(struct rte *new, struct rte *old);
 static void ospf_disp(timer *timer);
+static void ospf_spf_timer_hook(timer *t);
+static void ospf_spf_hold_timer_hook(timer *t);
+static void ospf_spf_learn_timer_hook(timer *t);
 
 static void
 ospf_area_initfib(struct fib_node *fn)
@@ -191,6 +195,9 @@ ospf_area_remove(struct ospf_area *oa)
   fib_free(&oa->net_fib);
   fib_free(&oa->enet_fib);
 
+  if (oa->cand.data)
+    mb_free(oa->cand.data);
+
   if (oa->translator_timer)
     rfree(oa->translator_timer);
 
@@ -237,16 +244,22 @@ ospf_start(struct proto *P)
   p->tick = c->tick;
   p->disp_timer = tm_new_set(P->pool, ospf_disp, p, 0, p->tick);
   tm_start(p->disp_timer, 1);
+  p->spf_timer = tm_new_set(P->pool, ospf_spf_timer_hook, p, 0, 0);
+  p->spf_hold_timer = tm_new_set(P->pool, ospf_spf_hold_timer_hook, p, 0, 0);
+  p->spf_learn_timer = tm_new_set(P->pool, ospf_spf_learn_timer_hook, p, 0, 0);
   p->lsab_size = 256;
   p->lsab_used = 0;
   p->lsab = mb_alloc(P->pool, p->lsab_size);
   p->nhpool = lp_new(P->pool, 12*sizeof(struct mpnh));
+  p->prcpool = lp_new(P->pool, 12*sizeof(struct mpnh));
   init_list(&(p->iface_list));
   init_list(&(p->area_list));
   fib_init(&p->rtf, P->pool, sizeof(ort), 0, ospf_rt_initort);
   p->areano = 0;
   p->gr = ospf_top_new(p, P->pool);
   s_init_list(&(p->lsal));
+  BUFFER_INIT(p->aging_heap, P->pool, 64);
+  BUFFER_PUSH(p->aging_heap) = NULL;	/* Heap is indexed from 1 */
 
   p->flood_event = ev_new(P->pool);
   p->flood_event->hook = ospf_flood_event;
@@ -381,14 +394,118 @@ ospf_build_attrs(ea_list * next, struct linpool *pool, u32 m1, u32 m2,
 }
 
 
+/*
+ * SPF delay algorithm (RFC 8405). The first change after a quiet period is
+ * handled quickly (spf delay), further ones during the learn time with short
+ * delay and then with long delay, until there is no change for the hold time.
+ */
+
+static const char *ospf_spf_state_names[] = {
+  [OSPF_SPF_QUIET] = "quiet",
+  [OSPF_SPF_SHORT_WAIT] = "short wait",
+  [OSPF_SPF_LONG_WAIT] = "long wait",
+};
+
+static void
+ospf_spf_timer_hook(timer *t)
+{
+  struct ospf_proto *p = t->data;
+
+  if (!p->calcrt)
+    return;
+
+  btime start = current_time_precise();
+
+  ospf_rt_spf(p);
+  p->spf_triggers = 0;
+
+  p->spf_last_duration = current_time_precise() - start;
+  if (p->spf_max_duration < p->spf_last_duration)
+    p->spf_max_duration = p->spf_last_duration;
+}
+
+static void
+ospf_spf_hold_timer_hook(timer *t)
+{
+  struct ospf_proto *p = t->data;
+
+  OSPF_TRACE(D_EVENTS, "SPF delay state changed to quiet");
+  tm_stop(p->spf_learn_timer);
+  p->spf_state = OSPF_SPF_QUIET;
+}
+
+static void
+ospf_spf_learn_timer_hook(timer *t)
+{
+  struct ospf_proto *p = t->data;
+
+  OSPF_TRACE(D_EVENTS, "SPF delay state changed to long wait");
+  p->spf_state = OSPF_SPF_LONG_WAIT;
+}
+
+static void
+ospf_spf_trigger(struct ospf_proto *p)
+{
+  struct ospf_config *cf = (struct ospf_config *) (p->p.cf);
+  btime delay;
+
+  p->spf_triggers++;
+
+  switch (p->spf_state)
+  {
+  case OSPF_SPF_QUIET:
+    tm_start_btime(p->spf_learn_timer, cf->spf_learn_time);
+    p->spf_state = OSPF_SPF_SHORT_WAIT;
+    delay = cf->spf_delay;
+    break;
+
+  case OSPF_SPF_SHORT_WAIT:
+    delay = cf->spf_short_delay;
+    break;
+
+  default:
+    delay = cf->spf_long_delay;
+  }
+
+  tm_start_btime(p->spf_hold_timer, cf->spf_hold_time);
+
+  if (!tm_active(p->spf_timer))
+    tm_start_btime(p->spf_timer, delay);
+}
+
 void
 ospf_schedule_rtcalc(struct ospf_proto *p)
 {
-  if (p->calcrt)
-    return;
+  p->calcrt_prc = 0;
+
+  if (!p->calcrt)
+  {
+    OSPF_TRACE(D_EVENTS, "Scheduling routing table calculation");
+    p->calcrt = 1;
+  }
 
-  OSPF_TRACE(D_EVENTS, "Scheduling routing table calculation");
-  p->calcrt = 1;
+  ospf_spf_trigger(p);
+}
+
+/**
+ * ospf_schedule_prc - schedule partial routing table calculation
+ * @p: OSPF protocol instance
+ *
+ * Used when only summary or external LSAs changed. The shortest path trees
+ * are still valid then, so just inter-area and external routes have to be
+ * recomputed (see ospf_rt_spf()). A pending full calculation is kept.
+ */
+void
+ospf_schedule_prc(struct ospf_proto *p)
+{
+  if (!p->calcrt)
+  {
+    OSPF_TRACE(D_EVENTS, "Scheduling partial routing table calculation");
+    p->calcrt = 1;
+    p->calcrt_prc = 1;
+  }
+
+  ospf_spf_trigger(p);
 }
 
 static int
@@ -400,13 +517,15 @@ ospf_reload_routes(struct proto *P)
     OSPF_TRACE(D_EVENTS, "Scheduling routing table calculation with route reload");
 
   p->calcrt = 2;
+  p->calcrt_prc = 0;
+  ospf_spf_trigger(p);
 
   return 1;
 }
 
 
 /**
- * ospf_disp - invokes routing table calculation, aging and also area_disp()
+ * ospf_disp - invokes aging and origination of topology LSAs
  * @timer: timer usually called every @ospf_proto->tick second, @timer->data
  * point to @ospf_proto
  */
@@ -420,10 +539,6 @@ ospf_disp(timer * timer)
 
   /* Process LSA DB */
   ospf_update_lsadb(p);
-
-  /* Calculate routing table */
-  if (p->calcrt)
-    ospf_rt_spf(p);
 }
 
 
@@ -759,6 +874,13 @@ ospf_sh(struct proto *P)
   cli_msg(-1014, "RFC1583 compatibility: %s", (p->rfc1583 ? "enabled" : "disabled"));
   cli_msg(-1014, "Stub router: %s", (p->stub_router ? "Yes" : "No"));
   cli_msg(-1014, "RT scheduler tick: %d", p->tick);
+  cli_msg(-1014, "SPF delay state: %s", ospf_spf_state_names[p->spf_state]);
+  cli_msg(-1014, "SPF runs: %u full, %u partial", p->spf_runs, p->prc_runs);
+  cli_msg(-1014, "SPF duration: %u ms last, %u ms max",
+	  (uint) (p->spf_last_duration TO_MS), (uint) (p->spf_max_duration TO_MS));
+  if (p->calcrt)
+    cli_msg(-1014, "SPF pending: %u triggers, in %u ms",
+	    p->spf_triggers, (uint) (MAX(p->spf_timer->expires - current_time(), 0) TO_MS));
   cli_msg(-1014, "Number of areas: %u", p->areano);
   cli_msg(-1014, "Number of LSAs in DB:\t%u", p->gr->hash_entries);
 
@@ -1400,7 +1522,10 @@ ospf_sh_lsadb(struct lsadb_show_data *ld)
   j = 0;
   WALK_SLIST(he, p->lsal)
     if (he->lsa_body)
+    {
+      ospf_update_lsa_age(he);
       hea[j++] = he;
+    }
 
   ASSERT(j <= num);
 
@@ -1469,6 +1594,7 @@ struct protocol proto_ospf = {
   .attr_class =		EAP_OSPF,
   .preference =		DEF_PREF_OSPF,
   .config_size =	sizeof(struct ospf_config),
+  .rte_size =		RTE_DATA_SIZE(ospf),
   .init =		ospf_init,
   .dump =		ospf_dump,
   .start =		ospf_start,
@@ -78,6 +78,11 @@
 #define LSINFINITY 0xffffff
 
 #define OSPF_DEFAULT_TICK 1
+#define OSPF_DEFAULT_SPF_DELAY (50 MS_)
+#define OSPF_DEFAULT_SPF_SHORT_DELAY (200 MS_)
+#define OSPF_DEFAULT_SPF_LONG_DELAY (5 S_)
+#define OSPF_DEFAULT_SPF_HOLD_TIME (10 S_)
+#define OSPF_DEFAULT_SPF_LEARN_TIME (500 MS_)
 #define OSPF_DEFAULT_STUB_COST 1000
 #define OSPF_DEFAULT_ECMP_LIMIT 16
 #define OSPF_DEFAULT_TRANSINT 40
@@ -87,11 +92,21 @@
 
 #define OSPF_VLINK_ID_OFFSET 0x80000000
 
+/* SPF delay states (RFC 8405 5.) */
+#define OSPF_SPF_QUIET		0
+#define OSPF_SPF_SHORT_WAIT	1
+#define OSPF_SPF_LONG_WAIT	2
+
 
 struct ospf_config
 {
   struct proto_config c;
   uint tick;
+  u32 spf_delay;		/* SPF delay parameters (RFC 8405), in us */
+  u32 spf_short_delay;
+  u32 spf_long_delay;
+  u32 spf_hold_time;
+  u32 spf_learn_time;
   u8 ospf2;
   u8 rfc1583;
   u8 stub_router;
@@ -213,8 +228,19 @@ struct ospf_proto
   uint tick;
   struct top_graph *gr;		/* LSA graph */
   slist lsal;			/* List of all LSA's */
+  BUFFER(struct top_hash_entry *) aging_heap; /* Heap of LSA entries by next aging event */
   int calcrt;			/* Routing table calculation scheduled?
 				   0=no, 1=normal, 2=forced reload */
+  int calcrt_prc;		/* Is partial route calculation enough? */
+  timer *spf_timer;		/* Starts delayed routing table calculation */
+  timer *spf_hold_timer;	/* Returns SPF delay state to quiet (RFC 8405) */
+  timer *spf_learn_timer;	/* Switches SPF delay state to long wait */
+  u8 spf_state;			/* SPF delay state (OSPF_SPF_*) */
+  u32 spf_runs;			/* Number of full routing table calculations */
+  u32 prc_runs;			/* Number of partial routing table calculations */
+  u32 spf_triggers;		/* Calculation requests since the last calculation */
+  btime spf_last_duration;	/* Duration of the last calculation */
+  btime spf_max_duration;	/* Duration of the longest calculation */
   list iface_list;		/* List of OSPF interfaces (struct ospf_iface) */
   list area_list;		/* List of OSPF areas (struct ospf_area) */
   int areano;			/* Number of area I belong to */
@@ -231,6 +257,7 @@ struct ospf_proto
   void *lsab;			/* LSA buffer used when originating router LSAs */
   int lsab_size, lsab_used;
   linpool *nhpool;		/* Linpool used for next hops computed in SPF */
+  linpool *prcpool;		/* Linpool used for next hops computed in PRC */
   sock *vlink_sk;		/* IP socket used for vlink TX */
   u32 router_id;
   u32 last_vlink_id;		/* Interface IDs for vlinks (starts at 0x80000000) */
@@ -245,7 +272,7 @@ struct ospf_area
   struct ospf_area_config *ac;	/* Related area config */
   struct top_hash_entry *rt;	/* My own router LSA */
   struct top_hash_entry *pxr_lsa; /* Originated prefix LSA */
-  list cand;			/* List of candidates for RT calc. */
+  BUFFER(struct top_hash_entry *) cand; /* Heap of candidates for RT calc. */
   struct fib net_fib;		/* Networks to advertise or not */
   struct fib enet_fib;		/* External networks for NSSAs */
   u32 options;			/* Optional features */
@@ -821,6 +848,7 @@ struct lsadb_show_data {
 
 /* ospf.c */
 void ospf_schedule_rtcalc(struct ospf_proto *p);
+void ospf_schedule_prc(struct ospf_proto *p);
 
 static inline void ospf_notify_rt_lsa(struct ospf_area *oa)
 { oa->update_rt_lsa = 1; }
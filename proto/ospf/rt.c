@@ -9,8 +9,9 @@
  */
 
 #include "ospf.h"
+#include "lib/heap.h"
 
-static void add_cand(list * l, struct top_hash_entry *en,
+static void add_cand(struct top_hash_entry *en,
 		     struct top_hash_entry *par, u32 dist,
 		     struct ospf_area *oa, int i);
 static void rt_sync(struct ospf_proto *p);
@@ -27,6 +28,9 @@ ospf_rt_initort(struct fib_node *fn)
   ort *ri = (ort *) fn;
   reset_ri(ri);
   ri->old_rta = NULL;
+  ri->external_rte = 0;
+  ri->area_net = 0;
+  ri->keep = 0;
   ri->fn.flags = 0;
 }
 
@@ -337,6 +341,11 @@ static inline void
 ri_install_net(struct ospf_proto *p, ip_addr prefix, int pxlen, const orta *new)
 {
   ort *old = (ort *) fib_get(&p->rtf, &prefix, pxlen);
+
+  /* Configured stubnet kept from the last SPF, see rt_sync() */
+  if (old->keep)
+    return;
+
   int cmp = orta_compare(p, new, &old->n);
 
   if (cmp > 0)
@@ -370,6 +379,11 @@ static inline void
 ri_install_ext(struct ospf_proto *p, ip_addr prefix, int pxlen, const orta *new)
 {
   ort *old = (ort *) fib_get(&p->rtf, &prefix, pxlen);
+
+  /* Configured stubnet kept from the last SPF, see rt_sync() */
+  if (old->keep)
+    return;
+
   int cmp = orta_compare_ext(p, new, &old->n);
 
   if (cmp > 0)
@@ -517,7 +531,7 @@ spfa_process_rt(struct ospf_proto *p, struct ospf_area *oa, struct top_hash_entr
       break;
     }
 
-    add_cand(&oa->cand, tmp, act, act->dist + rtl.metric, oa, i);
+    add_cand(tmp, act, act->dist + rtl.metric, oa, i);
   }
 }
 
@@ -540,7 +554,7 @@ spfa_process_net(struct ospf_proto *p, struct ospf_area *oa, struct top_hash_ent
   for (i = 0; i < cnt; i++)
   {
     tmp = ospf_hash_find_rt(p->gr, oa->areaid, ln->routers[i]);
-    add_cand(&oa->cand, tmp, act, act->dist, oa, -1);
+    add_cand(tmp, act, act->dist, oa, -1);
   }
 }
 
@@ -602,13 +616,70 @@ spfa_process_prefixes(struct ospf_proto *p, struct ospf_area *oa)
   }
 }
 
+/*
+ * Candidates of Dijkstra's algorithm are kept in a binary heap (oa->cand, with
+ * unused slot 0) ordered by distance, network vertices before router vertices
+ * of the same distance (RFC 2328 16.1. (3)). Each candidate remembers its
+ * position in the heap (cand_pos), so its distance can be decreased in place.
+ */
+
+#define CAND_LESS(a,b)		(((a)->dist < (b)->dist) || \
+				 (((a)->dist == (b)->dist) && \
+				  ((a)->lsa_type == LSA_T_NET) && ((b)->lsa_type != LSA_T_NET)))
+#define CAND_SWAP(heap,a,b,t)	(t = heap[a], heap[a] = heap[b], heap[b] = t, \
+				 heap[a]->cand_pos = (a), heap[b]->cand_pos = (b))
+
+static inline uint cand_count(struct ospf_area *oa)
+{ return oa->cand.used - 1; }
+
+static void
+cand_init(struct ospf_area *oa)
+{
+  if (!oa->cand.data)
+    BUFFER_INIT(oa->cand, oa->po->p.pool, 16);
+
+  BUFFER_FLUSH(oa->cand);
+  BUFFER_PUSH(oa->cand) = NULL;
+}
+
+static void
+cand_insert(struct ospf_area *oa, struct top_hash_entry *en)
+{
+  uint cc = cand_count(oa);
+
+  en->cand_pos = ++cc;
+  BUFFER_PUSH(oa->cand) = en;
+  HEAP_INSERT(oa->cand.data, cc, struct top_hash_entry *, CAND_LESS, CAND_SWAP);
+}
+
+static inline void
+cand_decrease(struct ospf_area *oa, struct top_hash_entry *en)
+{
+  HEAP_DECREASE(oa->cand.data, cand_count(oa), struct top_hash_entry *, CAND_LESS, CAND_SWAP, en->cand_pos);
+}
+
+static struct top_hash_entry *
+cand_delmin(struct ospf_area *oa)
+{
+  uint cc = cand_count(oa);
+
+  if (!cc)
+    return NULL;
+
+  struct top_hash_entry *en = oa->cand.data[1];
+  HEAP_DELMIN(oa->cand.data, cc, struct top_hash_entry *, CAND_LESS, CAND_SWAP);
+  BUFFER_POP(oa->cand);
+
+  en->cand_pos = 0;
+  return en;
+}
+
 /* RFC 2328 16.1. calculating shortest paths for an area */
 static void
 ospf_rt_spfa(struct ospf_area *oa)
 {
   struct ospf_proto *p = oa->po;
   struct top_hash_entry *act;
-  node *n;
 
   if (oa->rt == NULL)
     return;
@@ -618,23 +689,19 @@ ospf_rt_spfa(struct ospf_area *oa)
   OSPF_TRACE(D_EVENTS, "Starting routing table calculation for area %R", oa->areaid);
 
   /* 16.1. (1) */
-  init_list(&oa->cand);		/* Empty list of candidates */
+  cand_init(oa);		/* Empty heap of candidates */
   oa->trcap = 0;
 
   DBG("LSA db prepared, adding me into candidate list.\n");
 
   oa->rt->dist = 0;
   oa->rt->color = CANDIDATE;
-  add_head(&oa->cand, &oa->rt->cn);
+  cand_insert(oa, oa->rt);
   DBG("RT LSA: rt: %R, id: %R, type: %u\n",
       oa->rt->lsa.rt, oa->rt->lsa.id, oa->rt->lsa_type);
 
-  while (!EMPTY_LIST(oa->cand))
+  while (act = cand_delmin(oa))
   {
-    n = HEAD(oa->cand);
-    act = SKIP_BACK(struct top_hash_entry, cn, n);
-    rem_node(n);
-
     DBG("Working on LSA: rt: %R, id: %R, type: %u\n",
 	act->lsa.rt, act->lsa.id, act->lsa_type);
 
@@ -1609,13 +1676,88 @@ ospf_rt_reset(struct ospf_proto *p)
   }
 }
 
+/* Cleanup of inter-area and external routes, intra-area ones are kept */
+static void
+ospf_rt_prc_reset(struct ospf_proto *p)
+{
+  struct ospf_area *oa;
+  struct top_hash_entry *en;
+  ort *ri;
+
+  FIB_WALK(&p->rtf, nftmp)
+  {
+    ri = (ort *) nftmp;
+    if (ri->n.type != RTS_OSPF)
+      reset_ri(ri);
+  }
+  FIB_WALK_END;
+
+  WALK_SLIST(en, p->lsal)
+    if ((en->lsa_type == LSA_T_EXT) || (en->lsa_type == LSA_T_NSSA))
+      en->color = OUTSPF;
+
+  WALK_LIST(oa, p->area_list)
+  {
+    FIB_WALK(&oa->rtr, nftmp)
+    {
+      ri = (ort *) nftmp;
+      if (ri->n.type == RTS_OSPF_IA)
+	reset_ri(ri);
+    }
+    FIB_WALK_END;
+  }
+}
+
+/*
+ * Partial route calculation (PRC) is used when only summary or external LSAs
+ * changed since the last calculation. Shortest path trees, intra-area routes
+ * and their next hops (kept in nhpool) are still valid, so just 16. (3) and
+ * 16. (5) are redone. That is possible only for a router in one area, as an
+ * ABR originates summary LSAs and translates NSSA LSAs from the whole result.
+ */
+static int
+ospf_rt_prc_possible(struct ospf_proto *p)
+{
+  return p->calcrt_prc && (p->areano == 1) && !ospf_main_area(p)->trcap;
+}
+
+static void
+ospf_rt_prc(struct ospf_proto *p)
+{
+  linpool *nhpool = p->nhpool;
+
+  OSPF_TRACE(D_EVENTS, "Starting partial routing table calculation");
+  p->prc_runs++;
+
+  /* New next hops are allocated from prcpool, so nhpool is not growing */
+  lp_flush(p->prcpool);
+  p->nhpool = p->prcpool;
+
+  ospf_rt_prc_reset(p);
+
+  /* 16. (3) */
+  ospf_rt_sum(ospf_main_area(p));
+
+  /* 16. (5) */
+  ospf_ext_spf(p);
+
+  rt_sync(p);
+
+  p->nhpool = nhpool;
+  p->calcrt = 0;
+  p->calcrt_prc = 0;
+}
+
 /**
  * ospf_rt_spf - calculate internal routes
  * @p: OSPF protocol instance
  *
  * Calculation of internal paths in an area is described in 16.1 of RFC 2328.
  * It's based on Dijkstra's shortest path tree algorithms.
- * This function is invoked from ospf_disp().
+ * This function is invoked from the SPF timer, see ospf_spf_trigger().
+ *
+ * When only summary or external LSAs changed, the shortest path trees from the
+ * last calculation are kept and only a partial route calculation is done.
  */
 void
 ospf_rt_spf(struct ospf_proto *p)
@@ -1625,7 +1767,18 @@ ospf_rt_spf(struct ospf_proto *p)
   if (p->areano == 0)
     return;
 
+  if (ospf_rt_prc_possible(p))
+  {
+    ospf_rt_prc(p);
+    return;
+  }
+
   OSPF_TRACE(D_EVENTS, "Starting routing table calculation");
+  p->spf_runs++;
+
+  /* Next hops are kept until the next calculation, for possible PRC */
+  lp_flush(p->nhpool);
+  lp_flush(p->prcpool);
 
   /* 16. (1) */
   ospf_rt_reset(p);
@@ -1652,9 +1805,9 @@ ospf_rt_spf(struct ospf_proto *p)
     ospf_rt_abr2(p);
 
   rt_sync(p);
-  lp_flush(p->nhpool);
 
   p->calcrt = 0;
+  p->calcrt_prc = 0;
 }
 
 
@@ -1762,15 +1915,12 @@ calc_next_hop(struct ospf_area *oa, struct top_hash_entry *en,
 }
 
 
-/* Add LSA into list of candidates in Dijkstra's algorithm */
+/* Add LSA into heap of candidates in Dijkstra's algorithm */
 static void
-add_cand(list * l, struct top_hash_entry *en, struct top_hash_entry *par,
+add_cand(struct top_hash_entry *en, struct top_hash_entry *par,
 	 u32 dist, struct ospf_area *oa, int pos)
 {
   struct ospf_proto *p = oa->po;
-  node *prev, *n;
-  int added = 0;
-  struct top_hash_entry *act;
 
   /* 16.1. (2b) */
   if (en == NULL)
@@ -1844,44 +1994,17 @@ add_cand(list * l, struct top_hash_entry *en, struct top_hash_entry *par,
   DBG("     Adding candidate: rt: %R, id: %R, type: %u\n",
       en->lsa.rt, en->lsa.id, en->lsa_type);
 
-  if (en->color == CANDIDATE)
-  {				/* We found a shorter path */
-    rem_node(&en->cn);
-  }
+  int shorter = (en->color == CANDIDATE);	/* We found a shorter path */
+
   en->nhs = nhs;
   en->dist = dist;
   en->color = CANDIDATE;
   en->nhs_reuse = (par->nhs != nhs);
 
-  prev = NULL;
-
-  if (EMPTY_LIST(*l))
-  {
-    add_head(l, &en->cn);
-  }
+  if (shorter)
+    cand_decrease(oa, en);
   else
-  {
-    WALK_LIST(n, *l)
-    {
-      act = SKIP_BACK(struct top_hash_entry, cn, n);
-      if ((act->dist > dist) ||
-	  ((act->dist == dist) && (act->lsa_type == LSA_T_RT)))
-      {
-	if (prev == NULL)
-	  add_head(l, &en->cn);
-	else
-	  insert_node(&en->cn, prev);
-	added = 1;
-	break;
-      }
-      prev = n;
-    }
-
-    if (!added)
-    {
-      add_tail(l, &en->cn);
-    }
-  }
+    cand_insert(oa, en);
 }
 
 static inline int
@@ -13,6 +13,7 @@
 #include "lib/string.h"
 
 #include "ospf.h"
+#include "lib/heap.h"
 
 
 #define HASH_DEF_ORDER 6
@@ -25,6 +26,42 @@
 
 static inline void * lsab_flush(struct ospf_proto *p);
 static inline void lsab_reset(struct ospf_proto *p);
+static void ospf_schedule_lsa_aging(struct ospf_proto *p, struct top_hash_entry *en);
+
+/*
+ * LSA entries are not aged by periodic walks through the whole LSA database.
+ * The age of an LSA is computed from inst_time when needed (see
+ * ospf_update_lsa_age()) and each LSA entry is kept in a heap ordered by time
+ * of its next aging event (p->aging_heap, with unused slot 0). That is the
+ * refresh time for locally originated LSAs, the MaxAge time for other ones and
+ * the MinLSInterval end for postponed LSAs. Entries being flushed wait for
+ * acknowledgements from neighbors and are rechecked on each tick.
+ */
+
+#define AGING_LESS(a,b)		((a)->aging_time < (b)->aging_time)
+#define AGING_SWAP(heap,a,b,t)	(t = heap[a], heap[a] = heap[b], heap[b] = t, \
+				 heap[a]->aging_pos = (a), heap[b]->aging_pos = (b))
+
+static inline uint aging_count(struct ospf_proto *p)
+{ return p->aging_heap.used - 1; }
+
+/* Changes of summary and external LSAs do not affect shortest path trees */
+static inline void
+ospf_schedule_lsa_rtcalc(struct ospf_proto *p, struct top_hash_entry *en)
+{
+  switch (en->lsa_type)
+  {
+  case LSA_T_SUM_NET:
+  case LSA_T_SUM_RT:
+  case LSA_T_EXT:
+  case LSA_T_NSSA:
+    ospf_schedule_prc(p);
+    break;
+
+  default:
+    ospf_schedule_rtcalc(p);
+  }
+}
 
 
 /**
@@ -82,8 +119,10 @@ ospf_install_lsa(struct ospf_proto *p, struct ospf_lsa_header *lsa, u32 type, u3
   OSPF_TRACE(D_EVENTS, "Installing LSA: Type: %04x, Id: %R, Rt: %R, Seq: %08x, Age: %u",
 	     en->lsa_type, en->lsa.id, en->lsa.rt, en->lsa.sn, en->lsa.age);
 
+  ospf_schedule_lsa_aging(p, en);
+
   if (change)
-    ospf_schedule_rtcalc(p);
+    ospf_schedule_lsa_rtcalc(p, en);
 
   return en;
 }
@@ -188,6 +227,7 @@ ospf_advance_lsa(struct ospf_proto *p, struct top_hash_entry *en, struct ospf_ls
    * the neighbor we received it from), we cheat a bit here.
    */
 
+  ospf_schedule_lsa_aging(p, en);
   ospf_flood_lsa(p, en, NULL);
 }
 
@@ -209,6 +249,7 @@ ospf_do_originate_lsa(struct ospf_proto *p, struct top_hash_entry *en, void *lsa
 		 en->lsa_type, en->lsa.id, en->lsa.rt, en->lsa.sn);
 
       en->lsa.age = LSA_MAXAGE;
+      ospf_schedule_lsa_aging(p, en);
       ospf_flood_lsa(p, en, NULL);
       return 0;
     }
@@ -243,10 +284,11 @@ ospf_do_originate_lsa(struct ospf_proto *p, struct top_hash_entry *en, void *lsa
   OSPF_TRACE(D_EVENTS, "Originating LSA: Type: %04x, Id: %R, Rt: %R, Seq: %08x",
 	     en->lsa_type, en->lsa.id, en->lsa.rt, en->lsa.sn);
 
+  ospf_schedule_lsa_aging(p, en);
   ospf_flood_lsa(p, en, NULL);
 
   if (en->mode == LSA_M_BASIC)
-    ospf_schedule_rtcalc(p);
+    ospf_schedule_lsa_rtcalc(p, en);
 
   return 1;
 }
@@ -325,6 +367,7 @@ ospf_originate_lsa(struct ospf_proto *p, struct ospf_new_lsa *lsa)
     en->next_lsa_body = lsa_body;
     en->next_lsa_blen = lsa_blen;
     en->next_lsa_opts = lsa->opts;
+    ospf_schedule_lsa_aging(p, en);
   }
 
   return en;
@@ -374,6 +417,7 @@ ospf_refresh_lsa(struct ospf_proto *p, struct top_hash_entry *en)
     en->next_lsa_opts = ospf_is_v2(p) ? lsa_get_options(&en->lsa) : 0;
 
     en->lsa.age = LSA_MAXAGE;
+    ospf_schedule_lsa_aging(p, en);
     ospf_flood_lsa(p, en, NULL);
     return;
   }
@@ -383,6 +427,7 @@ ospf_refresh_lsa(struct ospf_proto *p, struct top_hash_entry *en)
   en->init_age = 0;
   en->inst_time = now;
   lsa_generate_checksum(&en->lsa, en->lsa_body);
+  ospf_schedule_lsa_aging(p, en);
   ospf_flood_lsa(p, en, NULL);
 }
 
@@ -419,10 +464,11 @@ ospf_flush_lsa(struct ospf_proto *p, struct top_hash_entry *en)
 	     en->lsa_type, en->lsa.id, en->lsa.rt, en->lsa.sn);
 
   en->lsa.age = LSA_MAXAGE;
+  ospf_schedule_lsa_aging(p, en);
   ospf_flood_lsa(p, en, NULL);
 
   if (en->mode == LSA_M_BASIC)
-    ospf_schedule_rtcalc(p);
+    ospf_schedule_lsa_rtcalc(p, en);
 
   en->mode = LSA_M_BASIC;
 }
@@ -454,10 +500,112 @@ ospf_remove_lsa(struct ospf_proto *p, struct top_hash_entry *en)
    * Both lsa_body and next_lsa_body are NULL.
    */
 
+  if (en->aging_pos)
+  {
+    uint ac = aging_count(p);
+    HEAP_DELETE(p->aging_heap.data, ac, struct top_hash_entry *,
+		AGING_LESS, AGING_SWAP, en->aging_pos);
+    BUFFER_POP(p->aging_heap);
+    en->aging_pos = 0;
+  }
+
   s_rem_node(SNODE en);
   ospf_hash_delete(p->gr, en);
 }
 
+static bird_clock_t
+ospf_lsa_aging_time(struct ospf_proto *p, struct top_hash_entry *en)
+{
+  bird_clock_t born = en->inst_time - en->init_age;
+  bird_clock_t when;
+
+  /* Flushed LSA entry kept just to remember seqnum, see ospf_update_lsadb() */
+  if ((en->lsa.age == LSA_MAXAGE) && !en->lsa_body && !en->next_lsa_body)
+    return MAX(born + LSA_MAXAGE, now + 1);
+
+  if (en->lsa.age == LSA_MAXAGE)
+    return now + 1;
+
+  if (en->lsa.rt == p->router_id)
+    when = born + LSREFRESHTIME;
+  else
+    when = born + LSA_MAXAGE;
+
+  if (en->next_lsa_body && (en->init_age == 0))
+    when = MIN(when, en->inst_time + MINLSINTERVAL);
+  else if (en->next_lsa_body)
+    when = now;
+
+  /* Handled on the next tick at the earliest */
+  return MAX(when, now + 1);
+}
+
+static void
+ospf_schedule_lsa_aging(struct ospf_proto *p, struct top_hash_entry *en)
+{
+  bird_clock_t when = ospf_lsa_aging_time(p, en);
+
+  if (!en->aging_pos)
+  {
+    uint ac = aging_count(p);
+
+    en->aging_time = when;
+    en->aging_pos = ++ac;
+    BUFFER_PUSH(p->aging_heap) = en;
+    HEAP_INSERT(p->aging_heap.data, ac, struct top_hash_entry *, AGING_LESS, AGING_SWAP);
+  }
+  else if (when < en->aging_time)
+  {
+    en->aging_time = when;
+    HEAP_DECREASE(p->aging_heap.data, aging_count(p), struct top_hash_entry *,
+		  AGING_LESS, AGING_SWAP, en->aging_pos);
+  }
+
+  /* Later aging time is kept, the entry is just rescheduled when due */
+}
+
+/* Returns 0 if the LSA entry was removed */
+static int
+ospf_age_lsa(struct ospf_proto *p, struct top_hash_entry *en)
+{
+  bird_clock_t real_age;
+
+  if (en->next_lsa_body)
+    ospf_originate_next_lsa(p, en);
+
+  real_age = en->init_age + (now - en->inst_time);
+
+  if (en->lsa.age == LSA_MAXAGE)
+  {
+    if (en->lsa_body && (p->padj == 0) && (en->ret_count == 0))
+      ospf_clear_lsa(p, en);
+
+    if ((en->lsa_body == NULL) && (en->next_lsa_body == NULL) &&
+	((en->lsa.rt != p->router_id) || (real_age >= LSA_MAXAGE)))
+    {
+      ospf_remove_lsa(p, en);
+      return 0;
+    }
+
+    return 1;
+  }
+
+  if ((en->lsa.rt == p->router_id) && (real_age >= LSREFRESHTIME))
+  {
+    ospf_refresh_lsa(p, en);
+    return 1;
+  }
+
+  if (real_age >= LSA_MAXAGE)
+  {
+    ospf_flush_lsa(p, en);
+    return 1;
+  }
+
+  en->lsa.age = real_age;
+  return 1;
+}
+
 /**
  * ospf_update_lsadb - update LSA database
  * @p: OSPF protocol instance
@@ -467,7 +615,8 @@ ospf_remove_lsa(struct ospf_proto *p, struct top_hash_entry *en)
  * scheduled by ospf_originate_lsa(), It continues in flushing processes started
  * by ospf_flush_lsa(). It also periodically refreshs locally originated LSAs --
  * when the current instance is older %LSREFRESHTIME, a new instance is originated.
- * Finally, it also ages stored LSAs and flushes ones that reached %LSA_MAXAGE.
+ * Finally, it also flushes LSAs that reached %LSA_MAXAGE. Only LSA entries with
+ * due aging time are examined.
  *
  * The RFC 2328 says that a router should periodically check checksums of all
  * stored LSAs to detect hardware problems. This is not implemented.
@@ -475,41 +624,17 @@ ospf_remove_lsa(struct ospf_proto *p, struct top_hash_entry *en)
 void
 ospf_update_lsadb(struct ospf_proto *p)
 {
-  struct top_hash_entry *en, *nxt;
-  bird_clock_t real_age;
+  struct top_hash_entry *en;
 
-  WALK_SLIST_DELSAFE(en, nxt, p->lsal)
+  while (aging_count(p) && ((en = p->aging_heap.data[1])->aging_time <= now))
   {
-    if (en->next_lsa_body)
-      ospf_originate_next_lsa(p, en);
-
-    real_age = en->init_age + (now - en->inst_time);
-
-    if (en->lsa.age == LSA_MAXAGE)
-    {
-      if (en->lsa_body && (p->padj == 0) && (en->ret_count == 0))
-	ospf_clear_lsa(p, en);
-
-      if ((en->lsa_body == NULL) && (en->next_lsa_body == NULL) &&
-	  ((en->lsa.rt != p->router_id) || (real_age >= LSA_MAXAGE)))
-	ospf_remove_lsa(p, en);
-
-      continue;
-    }
-
-    if ((en->lsa.rt == p->router_id) && (real_age >= LSREFRESHTIME))
-    {
-      ospf_refresh_lsa(p, en);
-      continue;
-    }
-
-    if (real_age >= LSA_MAXAGE)
-    {
-      ospf_flush_lsa(p, en);
-      continue;
-    }
+    uint ac = aging_count(p);
+    HEAP_DELMIN(p->aging_heap.data, ac, struct top_hash_entry *, AGING_LESS, AGING_SWAP);
+    BUFFER_POP(p->aging_heap);
+    en->aging_pos = 0;
 
-    en->lsa.age = real_age;
+    if (ospf_age_lsa(p, en))
+      ospf_schedule_lsa_aging(p, en);
   }
 }
 
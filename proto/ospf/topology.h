@@ -14,8 +14,6 @@
 struct top_hash_entry
 {				/* Index for fast mapping (type,rtrid,LSid)->vertex */
   snode n;
-  node cn;			/* For adding into list of candidates
-				   in intra-area routing table calculation */
   struct top_hash_entry *next;	/* Next in hash chain */
   struct ospf_lsa_header lsa;
   u16 lsa_type;			/* lsa.type processed and converted to common values (LSA_T_*) */
@@ -27,11 +25,15 @@ struct top_hash_entry
   u16 next_lsa_blen;		/* For postponed LSA origination */
   u16 next_lsa_opts;		/* For postponed LSA origination */
   bird_clock_t inst_time;	/* Time of installation into DB */
+  bird_clock_t aging_time;	/* Time of next aging event (see ospf_update_lsadb()) */
+  u32 aging_pos;		/* Position in heap of aging events (p->aging_heap) */
   struct ort *nf;		/* Reference fibnode for sum and ext LSAs, NULL for otherwise */
   struct mpnh *nhs;		/* Computed nexthops - valid only in ospf_rt_spf() */
   ip_addr lb;			/* In OSPFv2, link back address. In OSPFv3, any global address in the area useful for vlinks */
   u32 lb_id;			/* Interface ID of link back iface (for bcast or NBMA networks) */
   u32 dist;			/* Distance from the root */
+  u32 cand_pos;			/* Position in heap of candidates (oa->cand)
+				   in intra-area routing table calculation */
   int ret_count;		/* Number of retransmission lists referencing the entry */
   u8 color;
 #define OUTSPF 0
@@ -181,6 +183,14 @@ void ospf_advance_lsa(struct ospf_proto *p, struct top_hash_entry *en, struct os
 void ospf_flush_lsa(struct ospf_proto *p, struct top_hash_entry *en);
 void ospf_update_lsadb(struct ospf_proto *p);
 
+/* LSA age is not updated periodically, it is computed on demand */
+static inline void
+ospf_update_lsa_age(struct top_hash_entry *en)
+{
+  if (en->lsa.age < LSA_MAXAGE)
+    en->lsa.age = MIN_(en->init_age + (now - en->inst_time), LSA_MAXAGE - 1);
+}
+
 static inline void ospf_flush2_lsa(struct ospf_proto *p, struct top_hash_entry **en)
 { if (*en) { ospf_flush_lsa(p, *en); *en = NULL; } }
 
@@ -86,7 +86,7 @@ pipe_rt_notify(struct proto *P, rtable *src_table, net *n, rte *new, rte *old, e
       if (p->mode == PIPE_TRANSPARENT)
 	{
 	  /* Copy protocol specific embedded attributes. */
-	  memcpy(&(e->u), &(new->u), sizeof(e->u));
+	  memcpy(&(e->u), &(new->u), a.src->proto->proto->rte_size);
 	  e->pref = new->pref;
 	  e->pflags = new->pflags;
 	}
@@ -165,11 +165,13 @@ pipe_start(struct proto *P)
 
   P->main_ahook = proto_add_announce_hook(P, P->table, &P->stats);
   P->main_ahook->out_filter = cf->c.out_filter;
+  P->main_ahook->out_shared = filter_shareable(cf->c.out_filter);
   P->main_ahook->in_limit = cf->c.in_limit;
   proto_reset_limit(P->main_ahook->in_limit);
 
   p->peer_ahook = proto_add_announce_hook(P, p->peer_table, &p->peer_stats);
   p->peer_ahook->out_filter = cf->c.in_filter;
+  p->peer_ahook->out_shared = filter_shareable(cf->c.in_filter);
   p->peer_ahook->in_limit = cf->c.out_limit;
   proto_reset_limit(p->peer_ahook->in_limit);
 
@@ -234,6 +236,7 @@ pipe_reconfigure(struct proto *P, struct proto_config *new)
   if (P->main_ahook)
     {
       P->main_ahook->out_filter = new->out_filter;
+      P->main_ahook->out_shared = filter_shareable(new->out_filter);
       P->main_ahook->in_limit = new->in_limit;
       proto_verify_limits(P->main_ahook);
     }
@@ -241,6 +244,7 @@ pipe_reconfigure(struct proto *P, struct proto_config *new)
   if (p->peer_ahook)
     {
       p->peer_ahook->out_filter = new->in_filter;
+      p->peer_ahook->out_shared = filter_shareable(new->in_filter);
       p->peer_ahook->in_limit = new->out_limit;
       proto_verify_limits(p->peer_ahook);
     }
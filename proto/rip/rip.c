@@ -909,7 +909,7 @@ rip_timer(timer *t)
 static inline void
 rip_kick_timer(struct rip_proto *p)
 {
-  if (p->timer->expires > (now + 1))
+  if (tm_remains(p->timer) > 1)
     tm_start(p->timer, 1);	/* Or 100 ms */
 }
 
@@ -969,7 +969,7 @@ rip_iface_timer(timer *t)
 static inline void
 rip_iface_kick_timer(struct rip_iface *ifa)
 {
-  if (ifa->timer->expires > (now + 1))
+  if (tm_remains(ifa->timer) > 1)
     tm_start(ifa->timer, 1);	/* Or 100 ms */
 }
 
@@ -1275,6 +1275,7 @@ struct protocol proto_rip = {
   .attr_class =		EAP_RIP,
   .preference =		DEF_PREF_RIP,
   .config_size =	sizeof(struct rip_config),
+  .rte_size =		RTE_DATA_SIZE(rip),
   .init =		rip_init,
   .dump =		rip_dump,
   .start =		rip_start,
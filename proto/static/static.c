@@ -631,6 +631,7 @@ struct protocol proto_static = {
   .name =		"Static",
   .template =		"static%d",
   .preference =		DEF_PREF_STATIC,
+  .parallel_import =	1,
   .config_size =	sizeof(struct static_config),
   .init =		static_init,
   .dump =		static_dump,
@@ -319,7 +319,7 @@ krt_replace_rte(struct krt_proto *p, net *n, rte *new, rte *old,
     err = krt_send_route(p, RTM_ADD, new);
 
   if (err < 0)
-    n->n.flags |= KRF_SYNC_ERROR;
+    krt_got_sync_error(p, n);
   else
     n->n.flags &= ~KRF_SYNC_ERROR;
 }
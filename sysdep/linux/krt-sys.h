@@ -90,6 +90,7 @@ static inline struct ifa * kif_get_primary_ip(struct iface *i UNUSED) { return N
 struct krt_params {
   u32 table_id;				/* Kernel table ID we sync with */
   u32 metric;				/* Kernel metric used for all routes */
+  u32 rx_buffer;			/* Receive buffer of async netlink socket */
 };
 
 struct krt_state {
@@ -20,6 +20,7 @@
 #include "nest/protocol.h"
 #include "nest/iface.h"
 #include "lib/timer.h"
+#include "lib/event.h"
 #include "lib/unix.h"
 #include "lib/krt.h"
 #include "lib/socket.h"
@@ -31,6 +32,7 @@
 #include <linux/if.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/filter.h>
 
 
 #ifndef MSG_TRUNC			/* Hack: Several versions of glibc miss this one :( */
@@ -102,11 +104,17 @@ struct nl_sock
   int fd;
   u32 seq;
   byte *rx_buffer;			/* Receive buffer */
+  uint rx_size;				/* Size of rx_buffer */
   struct nlmsghdr *last_hdr;		/* Recently received packet */
   uint last_size;
 };
 
-#define NL_RX_SIZE 8192
+/*
+ * Kernel sizes dump replies according to the receive buffer of recent
+ * recvmsg() calls, up to 32 kB. Smaller buffers just mean more syscalls.
+ */
+#define NL_RX_SIZE 32768
+#define NL_REQ_RCVBUF (1 << 20)
 
 #define NL_OP_DELETE	0
 #define NL_OP_ADD	(NLM_F_CREATE|NLM_F_EXCL)
@@ -117,6 +125,7 @@ static linpool *nl_linpool;
 
 static struct nl_sock nl_scan = {.fd = -1};	/* Netlink socket for synchronous scan */
 static struct nl_sock nl_req  = {.fd = -1};	/* Netlink socket for requests */
+static u32 nl_req_pid;				/* Port ID of nl_req */
 
 static void
 nl_open_sock(struct nl_sock *nl)
@@ -128,6 +137,7 @@ nl_open_sock(struct nl_sock *nl)
 	die("Unable to open rtnetlink socket: %m");
       nl->seq = now;
       nl->rx_buffer = xmalloc(NL_RX_SIZE);
+      nl->rx_size = NL_RX_SIZE;
       nl->last_hdr = NULL;
       nl->last_size = 0;
     }
@@ -137,7 +147,30 @@ static void
 nl_open(void)
 {
   nl_open_sock(&nl_scan);
-  nl_open_sock(&nl_req);
+
+  if (nl_req.fd < 0)
+    {
+      nl_open_sock(&nl_req);
+
+      /* Notifications about our route changes carry our port ID */
+      struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+      socklen_t sa_len = sizeof(sa);
+      if ((bind(nl_req.fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) ||
+	  (getsockname(nl_req.fd, (struct sockaddr *) &sa, &sa_len) < 0))
+	die("Unable to bind rtnetlink socket: %m");
+      nl_req_pid = sa.nl_pid;
+
+      /* Room for error replies to a whole batch of route requests */
+      int rcvbuf = NL_REQ_RCVBUF;
+      if (setsockopt(nl_req.fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+	setsockopt(nl_req.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+#if defined(SOL_NETLINK) && defined(NETLINK_CAP_ACK)
+      /* Do not echo whole requests in error replies */
+      int one = 1;
+      setsockopt(nl_req.fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+#endif
+    }
 }
 
 static void
@@ -176,7 +209,7 @@ nl_get_reply(struct nl_sock *nl)
     {
       if (!nl->last_hdr)
 	{
-	  struct iovec iov = { nl->rx_buffer, NL_RX_SIZE };
+	  struct iovec iov = { nl->rx_buffer, nl->rx_size };
 	  struct sockaddr_nl sa;
 	  struct msghdr m = {
 	    .msg_name = &sa,
@@ -184,7 +217,19 @@ nl_get_reply(struct nl_sock *nl)
 	    .msg_iov = &iov,
 	    .msg_iovlen = 1,
 	  };
-	  int x = recvmsg(nl->fd, &m, 0);
+
+	  /* Peek for the real size (without copying), so the reply always fits */
+	  int x = recv(nl->fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	  if (x < 0)
+	    die("nl_get_reply: %m");
+	  if ((uint) x > nl->rx_size)
+	    {
+	      nl->rx_size = BIRD_ALIGN(x, 4096);
+	      nl->rx_buffer = xrealloc(nl->rx_buffer, nl->rx_size);
+	      iov = (struct iovec) { nl->rx_buffer, nl->rx_size };
+	    }
+
+	  x = recvmsg(nl->fd, &m, 0);
 	  if (x < 0)
 	    die("nl_get_reply: %m");
 	  if (sa.nl_pid)		/* It isn't from the kernel */
@@ -250,20 +295,167 @@ nl_get_scan(void)
   return h;
 }
 
+/*
+ *	Batched route requests
+ *
+ *	Route updates are not sent one by one with a synchronous ACK exchange,
+ *	but queued to a batch that is sent to the kernel in one sendto() call.
+ *	The requests do not ask for ACKs, so the kernel replies just for failed
+ *	ones. As rtnetlink processes the whole batch before sendto() returns,
+ *	all error replies are already waiting in the socket receive queue when
+ *	the batch is flushed. The sequence number of an error reply identifies
+ *	the failed request, whose network is then marked with KRF_SYNC_ERROR.
+ */
+
+#define NL_TX_SIZE	65536		/* Size of the batch buffer */
+#define NL_TX_MAX	1024		/* Max number of requests in one batch */
+
+#define NL_TX_ADD		1	/* Failure means a sync error */
+#define NL_TX_IGNORE_ESRCH	2	/* Missing route is not an error */
+
+struct nl_tx_req
+{
+  struct krt_proto *proto;
+  ip_addr prefix;
+  byte pxlen;
+  byte flags;
+  int error;				/* Error code from the reply, 0 if none */
+};
+
+static byte *nl_tx_buffer;		/* Queued messages */
+static uint nl_tx_len;
+static struct nl_tx_req *nl_tx_reqs;	/* Requests of queued messages */
+static uint nl_tx_count;
+static u32 nl_tx_seq;			/* Sequence number of the first request */
+static event *nl_tx_event;		/* Flushes the batch */
+
+static void
+nl_tx_set_error(struct nl_tx_req *r)
+{
+  if (!(r->flags & NL_TX_ADD))
+    return;
+
+  net *n = net_find(r->proto->p.table, r->prefix, r->pxlen);
+  if (n)
+    krt_got_sync_error(r->proto, n);
+}
+
+static void
+nl_tx_error(struct nlmsghdr *h)
+{
+  uint i = h->nlmsg_seq - nl_tx_seq;
+
+  if (i >= nl_tx_count)
+    {
+      log(L_WARN "nl_tx_flush: Ignoring out of sequence netlink packet (%x)", h->nlmsg_seq);
+      return;
+    }
+
+  struct nl_tx_req *r = &nl_tx_reqs[i];
+  r->error = nl_error(h, r->flags & NL_TX_IGNORE_ESRCH);
+  if (r->error)
+    nl_tx_set_error(r);
+}
+
+/*
+ * Send the batch and process error replies. Returns the error code of the
+ * last request of the batch, 0 if it succeeded (or if the batch is empty).
+ */
 static int
-nl_exchange(struct nlmsghdr *pkt, int ignore_esrch)
+nl_tx_flush(void)
 {
-  struct nlmsghdr *h;
+  struct sockaddr_nl sa;
+  uint i;
+  int err;
+
+  if (!nl_tx_count)
+    return 0;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.nl_family = AF_NETLINK;
+  if (sendto(nl_req.fd, nl_tx_buffer, nl_tx_len, 0, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+    die("rtnetlink sendto: %m");
 
-  nl_send(&nl_req, pkt);
+  /* Collect error replies of the whole batch */
   for(;;)
     {
-      h = nl_get_reply(&nl_req);
-      if (h->nlmsg_type == NLMSG_ERROR)
-	break;
-      log(L_WARN "nl_exchange: Unexpected reply received");
+      struct iovec iov = { nl_req.rx_buffer, nl_req.rx_size };
+      struct msghdr m = {
+	.msg_name = &sa,
+	.msg_namelen = sizeof(sa),
+	.msg_iov = &iov,
+	.msg_iovlen = 1,
+      };
+      int x = recvmsg(nl_req.fd, &m, MSG_DONTWAIT);
+      if (x < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  if (errno == ENOBUFS)
+	    {
+	      /* Some replies were lost, we do not know which routes failed */
+	      log(L_WARN "Netlink: Lost replies to route requests, marking routes for resync");
+	      for (i = 0; i < nl_tx_count; i++)
+		{
+		  nl_tx_reqs[i].error = ENOBUFS;
+		  nl_tx_set_error(&nl_tx_reqs[i]);
+		}
+	      continue;
+	    }
+
+	  if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+	    log(L_ERR "nl_tx_flush: %m");
+	  break;
+	}
+
+      if (sa.nl_pid)		/* It isn't from the kernel */
+	continue;
+
+      struct nlmsghdr *h = (void *) nl_req.rx_buffer;
+      uint len = x;
+      for (; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len))
+	if (h->nlmsg_type == NLMSG_ERROR)
+	  nl_tx_error(h);
+	else
+	  log(L_WARN "nl_tx_flush: Unexpected reply received");
+    }
+
+  err = nl_tx_reqs[nl_tx_count - 1].error;
+  nl_tx_len = 0;
+  nl_tx_count = 0;
+  return err;
+}
+
+static void
+nl_tx_hook(void *data UNUSED)
+{
+  nl_tx_flush();
+}
+
+static void
+nl_tx_queue(struct krt_proto *p, struct nlmsghdr *h, net *n, uint flags)
+{
+  if ((nl_tx_len + NLMSG_ALIGN(h->nlmsg_len) > NL_TX_SIZE) || (nl_tx_count == NL_TX_MAX))
+    nl_tx_flush();
+
+  if (!nl_tx_count)
+    {
+      nl_tx_seq = nl_req.seq + 1;
+      ev_schedule(nl_tx_event);
     }
-  return nl_error(h, ignore_esrch) ? -1 : 0;
+
+  h->nlmsg_pid = 0;
+  h->nlmsg_seq = ++nl_req.seq;
+  memcpy(nl_tx_buffer + nl_tx_len, h, h->nlmsg_len);
+  nl_tx_len += NLMSG_ALIGN(h->nlmsg_len);
+
+  nl_tx_reqs[nl_tx_count++] = (struct nl_tx_req) {
+    .proto = p,
+    .prefix = n->n.prefix,
+    .pxlen = n->n.pxlen,
+    .flags = flags,
+  };
 }
 
 /*
@@ -874,7 +1066,7 @@ nh_bufsize(struct mpnh *nh)
   return rv;
 }
 
-static int
+static void
 nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int op, int dest, ip_addr gw, struct iface *iface)
 {
   eattr *ea;
@@ -894,7 +1086,7 @@ nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int op, int d
   bzero(&r.r, sizeof(r.r));
   r.h.nlmsg_type = op ? RTM_NEWROUTE : RTM_DELROUTE;
   r.h.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
-  r.h.nlmsg_flags = op | NLM_F_REQUEST | NLM_F_ACK;
+  r.h.nlmsg_flags = op | NLM_F_REQUEST;
 
   r.r.rtm_family = BIRD_AF;
   r.r.rtm_dst_len = net->n.pxlen;
@@ -989,50 +1181,58 @@ dest:
     }
 
   /* Ignore missing for DELETE */
-  return nl_exchange(&r.h, (op == NL_OP_DELETE));
+  nl_tx_queue(p, &r.h, net, (op == NL_OP_DELETE) ? NL_TX_IGNORE_ESRCH : NL_TX_ADD);
 }
 
-static inline int
+static inline void
 nl_add_rte(struct krt_proto *p, rte *e, struct ea_list *eattrs)
 {
   rta *a = e->attrs;
-  int err = 0;
 
   if (krt_ecmp6(p) && (a->dest == RTD_MULTIPATH))
   {
     struct mpnh *nh = a->nexthops;
+    net *n = e->net;
 
-    err = nl_send_route(p, e, eattrs, NL_OP_ADD, RTD_ROUTER, nh->gw, nh->iface);
-    if (err < 0)
-      return err;
+    /* Appended next hops must not be added when the first one fails */
+    nl_send_route(p, e, eattrs, NL_OP_ADD, RTD_ROUTER, nh->gw, nh->iface);
+    nl_tx_flush();
+    if (n->n.flags & KRF_SYNC_ERROR)
+      return;
 
     for (nh = nh->next; nh; nh = nh->next)
-      err += nl_send_route(p, e, eattrs, NL_OP_APPEND, RTD_ROUTER, nh->gw, nh->iface);
+      nl_send_route(p, e, eattrs, NL_OP_APPEND, RTD_ROUTER, nh->gw, nh->iface);
 
-    return err;
+    return;
   }
 
-  return nl_send_route(p, e, eattrs, NL_OP_ADD, a->dest, a->gw, a->iface);
+  nl_send_route(p, e, eattrs, NL_OP_ADD, a->dest, a->gw, a->iface);
 }
 
-static inline int
+static inline void
 nl_delete_rte(struct krt_proto *p, rte *e, struct ea_list *eattrs)
 {
-  int err = 0;
+  if (!krt_ecmp6(p))
+  {
+    nl_send_route(p, e, eattrs, NL_OP_DELETE, RTD_NONE, IPA_NONE, NULL);
+    return;
+  }
 
-  /* For IPv6, we just repeatedly request DELETE until we get error */
+  /*
+   * For IPv6, each DELETE removes just one next hop and the kernel may have
+   * more of them than we know, so we repeat DELETE until we get an error
+   * (usually ESRCH). To see the error of each DELETE before sending the next
+   * one, they are sent in separate batches.
+   */
+  nl_tx_flush();
   do
-    err = nl_send_route(p, e, eattrs, NL_OP_DELETE, RTD_NONE, IPA_NONE, NULL);
-  while (krt_ecmp6(p) && !err);
-
-  return err;
+    nl_send_route(p, e, eattrs, NL_OP_DELETE, RTD_NONE, IPA_NONE, NULL);
+  while (!nl_tx_flush());
 }
 
 void
 krt_replace_rte(struct krt_proto *p, net *n, rte *new, rte *old, struct ea_list *eattrs)
 {
-  int err = 0;
-
   /*
    * We could use NL_OP_REPLACE, but route replace on Linux has some problems:
    *
@@ -1042,21 +1242,20 @@ krt_replace_rte(struct krt_proto *p, net *n, rte *new, rte *old, struct ea_list
    *
    * So we use NL_OP_DELETE and then NL_OP_ADD. We also do not trust the old
    * route value, so we do not try to optimize IPv6 ECMP reconfigurations.
+   *
+   * The requests are just queued, a failure is reported later by setting
+   * KRF_SYNC_ERROR when the batch is flushed.
    */
 
   if (old)
     nl_delete_rte(p, old, eattrs);
 
-  if (new)
-    err = nl_add_rte(p, new, eattrs);
+  n->n.flags &= ~KRF_SYNC_ERROR;
 
-  if (err < 0)
-    n->n.flags |= KRF_SYNC_ERROR;
-  else
-    n->n.flags &= ~KRF_SYNC_ERROR;
+  if (new)
+    nl_add_rte(p, new, eattrs);
 }
 
-
 static inline struct mpnh *
 nl_alloc_mpnh(struct nl_parse_state *s, ip_addr gw, struct iface *iface, byte weight)
 {
@@ -1147,6 +1346,20 @@ nl_parse_route(struct nl_parse_state *s, struct nlmsghdr *h)
   if (!(i = nl_checkin(h, sizeof(*i))))
     return;
 
+  /*
+   * Most routes in a dump are skipped, so we first check what is available
+   * in the header. Tables above 255 are reported as RT_TABLE_COMPAT there
+   * and need RTA_TABLE.
+   */
+  if (i->rtm_protocol == RTPROT_KERNEL)
+    SKIP("kernel route\n");
+
+  if ((i->rtm_table != RT_TABLE_COMPAT) && !HASH_FIND(nl_table_map, RTH, i->rtm_table))
+    SKIP("unknown table %d\n", i->rtm_table);
+
+  if (s->scan && !new)
+    SKIP("RTM_DELROUTE in scan\n");
+
   switch (i->rtm_family)
     {
 #ifndef IPV6
@@ -1191,9 +1404,6 @@ nl_parse_route(struct nl_parse_state *s, struct nlmsghdr *h)
     SKIP("TOS %02x\n", i->rtm_tos);
 #endif
 
-  if (s->scan && !new)
-    SKIP("RTM_DELROUTE in scan\n");
-
   if (a[RTA_PRIORITY])
     priority = rta_get_u32(a[RTA_PRIORITY]);
 
@@ -1210,12 +1420,8 @@ nl_parse_route(struct nl_parse_state *s, struct nlmsghdr *h)
       src = KRT_SRC_REDIRECT;
       break;
 
-    case RTPROT_KERNEL:
-      src = KRT_SRC_KERNEL;
-      return;
-
     case RTPROT_BIRD:
-      if (!s->scan)
+      if (!s->scan && (h->nlmsg_pid == nl_req_pid))
 	SKIP("echo\n");
       src = KRT_SRC_BIRD;
       break;
@@ -1422,6 +1628,9 @@ krt_do_scan(struct krt_proto *p UNUSED)	/* CONFIG_ALL_TABLES_AT_ONCE => p is NUL
   struct nlmsghdr *h;
   struct nl_parse_state s;
 
+  /* Scan should see results of all queued requests */
+  nl_tx_flush();
+
   nl_parse_begin(&s, 1, krt_ecmp6(p));
 
   nl_request_dump(BIRD_AF, RTM_GETROUTE);
@@ -1440,6 +1649,9 @@ krt_do_scan(struct krt_proto *p UNUSED)	/* CONFIG_ALL_TABLES_AT_ONCE => p is NUL
 
 static sock *nl_async_sk;		/* BIRD socket for asynchronous notifications */
 static byte *nl_async_rx_buffer;	/* Receive buffer */
+static uint nl_async_rcvbuf;		/* Requested socket receive buffer size */
+
+#define NL_ASYNC_RCVBUF	(1 << 20)	/* Default for netlink rx buffer option */
 
 static void
 nl_async_msg(struct nlmsghdr *h)
@@ -1494,10 +1706,10 @@ nl_async_hook(sock *sk, uint size UNUSED)
 	{
 	  /*
 	   *  Netlink reports some packets have been thrown away.
-	   *  One day we might react to it by asking for route table
-	   *  scan in near future.
+	   *  We cannot tell which ones, so we ask for a full scan.
 	   */
 	  log(L_WARN "Kernel dropped some netlink messages, will resync on next scan.");
+	  krt_async_lost();
 	  return 1;	/* More data are likely to be ready */
 	}
       else if (errno != EWOULDBLOCK)
@@ -1565,6 +1777,21 @@ nl_open_async(void)
       return;
     }
 
+  /* Our own route changes are known, do not let their echoes fill the buffer */
+  if (nl_req_pid)
+    {
+      struct sock_filter f[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, OFFSETOF(struct nlmsghdr, nlmsg_pid)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(nl_req_pid), 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+      };
+      struct sock_fprog fp = { .len = ARRAY_SIZE(f), .filter = f };
+
+      if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fp, sizeof(fp)) < 0)
+	log(L_WARN "Unable to filter asynchronous rtnetlink socket: %m");
+    }
+
   nl_async_rx_buffer = xmalloc(NL_RX_SIZE);
 
   sk = nl_async_sk = sk_new(krt_pool);
@@ -1576,6 +1803,21 @@ nl_open_async(void)
     bug("Netlink: sk_open failed");
 }
 
+static void
+nl_async_set_rcvbuf(uint size)
+{
+  if (!nl_async_sk || (size <= nl_async_rcvbuf))
+    return;
+
+  /* The buffer is shared by all kernel protocols, so it is only enlarged */
+  int val = size;
+  if ((setsockopt(nl_async_sk->fd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)) < 0) &&
+      (setsockopt(nl_async_sk->fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)) < 0))
+    log(L_WARN "Unable to set netlink rx buffer: %m");
+
+  nl_async_rcvbuf = size;
+}
+
 
 /*
  *	Interface to the UNIX krt module
@@ -1585,6 +1827,10 @@ void
 krt_sys_io_init(void)
 {
   nl_linpool = lp_new(krt_pool, 4080);
+  nl_tx_buffer = mb_alloc(krt_pool, NL_TX_SIZE);
+  nl_tx_reqs = mb_alloc(krt_pool, NL_TX_MAX * sizeof(struct nl_tx_req));
+  nl_tx_event = ev_new(krt_pool);
+  nl_tx_event->hook = nl_tx_hook;
   HASH_INIT(nl_table_map, krt_pool, 6);
 }
 
@@ -1604,6 +1850,7 @@ krt_sys_start(struct krt_proto *p)
 
   nl_open();
   nl_open_async();
+  nl_async_set_rcvbuf(KRT_CF->sys.rx_buffer);
 
   return 1;
 }
@@ -1611,12 +1858,15 @@ krt_sys_start(struct krt_proto *p)
 void
 krt_sys_shutdown(struct krt_proto *p)
 {
+  nl_tx_flush();
   HASH_REMOVE2(nl_table_map, RTH, krt_pool, p);
 }
 
 int
 krt_sys_reconfigure(struct krt_proto *p UNUSED, struct krt_config *n, struct krt_config *o)
 {
+  nl_async_set_rcvbuf(n->sys.rx_buffer);
+
   return (n->sys.table_id == o->sys.table_id) && (n->sys.metric == o->sys.metric);
 }
 
@@ -1625,6 +1875,7 @@ krt_sys_init_config(struct krt_config *cf)
 {
   cf->sys.table_id = RT_TABLE_MAIN;
   cf->sys.metric = 0;
+  cf->sys.rx_buffer = NL_ASYNC_RCVBUF;
 }
 
 void
@@ -1632,6 +1883,7 @@ krt_sys_copy_config(struct krt_config *d, struct krt_config *s)
 {
   d->sys.table_id = s->sys.table_id;
   d->sys.metric = s->sys.metric;
+  d->sys.rx_buffer = s->sys.rx_buffer;
 }
 
 static const char *krt_metrics_names[KRT_METRICS_MAX] = {
@@ -0,0 +1,198 @@
+/*
+ *	BIRD Internet Routing Daemon -- Page Arena
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/*
+ * Slab heads and linpool chunks are fixed-size pages. Instead of getting
+ * each of them from malloc(), they are carved from large regions mapped
+ * directly from the system. Regions are aligned to their size, so they may
+ * be backed by transparent huge pages and a page finds its region just by
+ * masking its address. The first page of each region holds its header.
+ * A region which becomes completely free is returned to the system, except
+ * for one kept in standby (%ARENA_STANDBY_REGIONS) to avoid mapping and
+ * unmapping a region repeatedly when usage oscillates around its boundary.
+ *
+ * Pages may be allocated by import workers and the BFD thread, so the
+ * arena is protected by a mutex. It is taken just once per page.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "nest/bird.h"
+#include "lib/lists.h"
+#include "lib/resource.h"
+
+#define ARENA_REGION_SIZE	(2 << 20)
+#define ARENA_REGION_PAGES	(ARENA_REGION_SIZE / ARENA_PAGE_SIZE)
+#define ARENA_STANDBY_REGIONS	1
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct arena_region {
+  node n;				/* In arena_partial or arena_full */
+  uint used;				/* Allocated pages */
+  uint fresh;				/* Pages never allocated, at the end of region */
+  void *free;				/* Free pages, linked by their first word */
+};
+
+static list arena_partial;		/* Regions with some free pages */
+static list arena_full;			/* Regions without free pages */
+static uint arena_regions, arena_empty;
+static u64 arena_pages;			/* Pages allocated */
+static int arena_ready;
+
+#ifdef USE_PTHREADS
+
+#include <pthread.h>
+
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static inline void arena_lock(void) { pthread_mutex_lock(&arena_mutex); }
+static inline void arena_unlock(void) { pthread_mutex_unlock(&arena_mutex); }
+
+#else
+
+static inline void arena_lock(void) { }
+static inline void arena_unlock(void) { }
+
+#endif
+
+static inline struct arena_region *
+arena_region(void *page)
+{
+  return (struct arena_region *) ((uintptr_t) page & ~((uintptr_t) ARENA_REGION_SIZE - 1));
+}
+
+static struct arena_region *
+arena_map_region(void)
+{
+  /* Map twice the size and cut off the ends to get an aligned region */
+  byte *p = mmap(NULL, 2 * ARENA_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    die("Unable to map %d bytes of memory: %m", 2 * ARENA_REGION_SIZE);
+
+  byte *r = (byte *) BIRD_ALIGN((uintptr_t) p, ARENA_REGION_SIZE);
+  if (r > p)
+    munmap(p, r - p);
+  munmap(r + ARENA_REGION_SIZE, p + ARENA_REGION_SIZE - r);
+
+#ifdef MADV_HUGEPAGE
+  madvise(r, ARENA_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+
+  struct arena_region *a = (struct arena_region *) r;
+  a->used = 0;
+  a->fresh = 1;				/* The header page */
+  a->free = NULL;
+  arena_regions++;
+  return a;
+}
+
+/**
+ * alloc_page - allocate a memory page
+ *
+ * alloc_page() returns a block of %ARENA_PAGE_SIZE bytes aligned to its
+ * size. It is meant just for the resource manager (slabs and linpools).
+ */
+void *
+alloc_page(void)
+{
+  struct arena_region *a;
+  void *p;
+
+  arena_lock();
+  if (!arena_ready)
+    {
+      init_list(&arena_partial);
+      init_list(&arena_full);
+      arena_ready = 1;
+    }
+
+  if (EMPTY_LIST(arena_partial))
+    {
+      /* A new region is not counted in arena_empty */
+      a = arena_map_region();
+      add_head(&arena_partial, &a->n);
+    }
+  else
+    {
+      a = HEAD(arena_partial);
+      if (!a->used)
+	arena_empty--;
+    }
+
+  if (p = a->free)
+    a->free = * (void **) p;
+  else
+    p = (byte *) a + ARENA_PAGE_SIZE * a->fresh++;
+
+  if (++a->used == ARENA_REGION_PAGES - 1)
+    {
+      rem_node(&a->n);
+      add_tail(&arena_full, &a->n);
+    }
+
+  arena_pages++;
+  arena_unlock();
+  return p;
+}
+
+/**
+ * free_page - free a memory page
+ * @p: page returned by alloc_page()
+ *
+ * The page is returned to its region. When the region becomes free
+ * and there are enough standby regions, it is unmapped.
+ */
+void
+free_page(void *p)
+{
+  struct arena_region *a = arena_region(p);
+
+  arena_lock();
+  if (a->used == ARENA_REGION_PAGES - 1)
+    {
+      rem_node(&a->n);
+      add_head(&arena_partial, &a->n);
+    }
+
+  * (void **) p = a->free;
+  a->free = p;
+  arena_pages--;
+
+  if (!--a->used)
+    {
+      rem_node(&a->n);
+      if (arena_empty >= ARENA_STANDBY_REGIONS)
+	{
+	  munmap(a, ARENA_REGION_SIZE);
+	  arena_regions--;
+	}
+      else
+	{
+	  /* Prefer regions in use, so that they may become free as well */
+	  add_tail(&arena_partial, &a->n);
+	  arena_empty++;
+	}
+    }
+  arena_unlock();
+}
+
+/**
+ * page_stats - get usage of page memory
+ * @used: pages in use, in bytes
+ * @mapped: memory mapped for pages, in bytes
+ */
+void
+page_stats(size_t *used, size_t *mapped)
+{
+  arena_lock();
+  *used = arena_pages * ARENA_PAGE_SIZE;
+  *mapped = (size_t) arena_regions * ARENA_REGION_SIZE;
+  arena_unlock();
+}
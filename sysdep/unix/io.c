@@ -43,6 +43,10 @@
 #include "lib/unix.h"
 #include "lib/sysio.h"
 
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+
 /* Maximum number of calls of tx handler for one socket in one
  * poll iteration. Should be small enough to not monopolize CPU by
  * one protocol instance.
@@ -114,6 +118,8 @@ tracked_fopen(pool *p, char *name, char *mode)
  * some fixed time point in past. The current time can be read
  * from variable @now with reasonable accuracy and is monotonic. There is also
  * a current 'absolute' time in variable @now_real reported by OS.
+ * Timers themselves run on the same monotonic time in microseconds (&btime),
+ * the current value of which is returned by current_time().
  *
  * Each timer is described by a &timer structure containing a pointer
  * to the handler function (@hook), data private to this function (@data),
@@ -121,26 +127,45 @@ tracked_fopen(pool *p, char *name, char *mode)
  * for the other fields see |timer.h|.
  */
 
-#define NEAR_TIMER_LIMIT 4
+/*
+ * Active timers are kept in a hierarchical timing wheel (&timeloop) of the
+ * event loop which started them. Level 0 has a slot for each of the next
+ * %TW_SIZE ticks of %TW_TICK, each slot of level @l covers %TW_SIZE^@l ticks.
+ * Timers are inserted to the lowest level which covers their expiration time,
+ * so tm_set() and tm_stop() take constant time. When the wheel time enters
+ * a new slot of level @l, timers of that slot are redistributed (cascaded) to
+ * lower levels. Ticks without any timers or cascades are skipped.
+ */
+
+#define TW_TICK (1 MS)
+#define TW_RANGE ((u64) 1 << (TW_BITS * TW_LEVELS))
 
-static list near_timers, far_timers;
-static bird_clock_t first_far_timer = TIME_INFINITY;
+static struct timeloop main_timeloop;
+static _Thread_local struct timeloop *current_timeloop;	/* NULL for the main loop */
 
 /* now must be different from 0, because 0 is a special value in timer->expires */
 bird_clock_t now = 1, now_real, boot_time;
+static btime real_time;			/* Time of day in microseconds, for update_times_plain() */
 
 static void
 update_times_plain(void)
 {
-  bird_clock_t new_time = time(NULL);
-  int delta = new_time - now_real;
+  struct timeval tv;
+
+  if (gettimeofday(&tv, NULL) < 0)
+    die("gettimeofday: %m");
 
-  if ((delta >= 0) && (delta < 60))
-    now += delta;
-  else if (now_real != 0)
-   log(L_WARN "Time jump, delta %d s", delta);
+  btime new_time = ((btime) tv.tv_sec S) + tv.tv_usec;
+  btime delta = new_time - real_time;
 
-  now_real = new_time;
+  if ((delta >= 0) && (delta < (60 S)))
+    main_timeloop.last_time += delta;
+  else if (real_time != 0)
+   log(L_WARN "Time jump, delta %d s", (int) (delta TO_S));
+
+  real_time = new_time;
+  now = main_timeloop.last_time TO_S;
+  now_real = tv.tv_sec;
 }
 
 static void
@@ -160,6 +185,8 @@ update_times_gettime(void)
     now = ts.tv_sec;
     now_real = time(NULL);
   }
+
+  main_timeloop.last_time = ((btime) ts.tv_sec S) + (ts.tv_nsec / 1000);
 }
 
 static int clock_monotonic_available;
@@ -180,6 +207,56 @@ init_times(void)
  clock_monotonic_available = (clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
  if (!clock_monotonic_available)
    log(L_WARN "Monotonic timer is missing");
+ main_timeloop.last_time = (btime) now S;
+}
+
+static inline struct timeloop *
+timeloop_current(void)
+{
+  return current_timeloop ? current_timeloop : &main_timeloop;
+}
+
+/**
+ * timeloop_set_current - switch timers of this thread to another event loop
+ * @loop: timing wheel of the event loop, NULL for the main loop
+ *
+ * Timers started by the calling thread are then added to the wheel of @loop
+ * and current_time() returns its time.
+ */
+void
+timeloop_set_current(struct timeloop *loop)
+{
+  current_timeloop = loop;
+}
+
+/**
+ * current_time - get current time
+ *
+ * This function returns current monotonic time in microseconds, as cached by
+ * the current event loop (see timeloop_set_current()) for its cycle.
+ */
+btime
+current_time(void)
+{
+  return timeloop_current()->last_time;
+}
+
+/**
+ * current_time_precise - get precise current time
+ *
+ * Unlike current_time(), this function reads the clock again, so it may be
+ * used to measure duration of a computation. It uses the clock of the main
+ * loop.
+ */
+btime
+current_time_precise(void)
+{
+  struct timespec ts;
+
+  if (!clock_monotonic_available || (clock_gettime(CLOCK_MONOTONIC, &ts) < 0))
+    return main_timeloop.last_time;
+
+  return ((btime) ts.tv_sec S) + (ts.tv_nsec / 1000);
 }
 
 
@@ -202,7 +279,7 @@ tm_dump(resource *r)
   if (t->recurrent)
     debug("recur %d, ", t->recurrent);
   if (t->expires)
-    debug("expires in %d sec)\n", t->expires - now);
+    debug("expires in %d ms)\n", (int) ((t->expires - current_time()) TO_MS));
   else
     debug("inactive)\n");
 }
@@ -231,14 +308,70 @@ tm_new(pool *p)
   return t;
 }
 
-static inline void
-tm_insert_near(timer *t)
+static void
+tm_insert(struct timeloop *loop, timer *t)
 {
-  node *n = HEAD(near_timers);
+  /* Rounded up, timers must not be run early */
+  u64 when = ((u64) t->expires + TW_TICK - 1) / TW_TICK;
+  u64 delta;
+  uint l;
+
+  /* Already expired timers are run from the current slot */
+  when = MAX(when, loop->tick);
+  delta = when - loop->tick;
 
-  while (n->next && (SKIP_BACK(timer, n, n)->expires < t->expires))
-    n = n->next;
-  insert_node(&t->n, n->prev);
+  /* Too far timers wait in the last level and get cascaded again */
+  if (delta >= TW_RANGE)
+    when = loop->tick + TW_RANGE - 1, delta = TW_RANGE - 1;
+
+  for (l = 0; delta >= ((u64) TW_SIZE << (TW_BITS * l)); l++)
+    ;
+
+  add_tail(&loop->wheel[l][(when >> (TW_BITS * l)) & TW_MASK], &t->n);
+}
+
+/**
+ * tm_set - start a timer at given time
+ * @t: timer
+ * @when: time in microseconds (see current_time()) the timer should be run at
+ *
+ * This function schedules the hook function of the timer to be called at
+ * @when, in the event loop of the calling thread. If the timer has been
+ * already started, its @expires time is replaced by the new value.
+ */
+void
+tm_set(timer *t, btime when)
+{
+  struct timeloop *loop = timeloop_current();
+
+  if ((t->expires == when) && (t->loop == loop))
+    return;
+  if (t->expires)
+    tm_stop(t);
+  if (!loop->count++)
+    loop->tick = loop->last_time / TW_TICK;	/* The wheel is empty, just move it */
+  t->expires = when;
+  t->loop = loop;
+  tm_insert(loop, t);
+
+  if (loop->kick)
+    loop->kick(loop);
+}
+
+/**
+ * tm_start_btime - start a timer with sub-second precision
+ * @t: timer
+ * @after: time in microseconds the timer should be run after
+ *
+ * This function is like tm_start(), but the timeout is given in microseconds.
+ * The @randomize field still adds whole seconds.
+ */
+void
+tm_start_btime(timer *t, btime after)
+{
+  if (t->randomize)
+    after += (random() % (t->randomize + 1)) S;
+  tm_set(t, current_time() + MAX(after, 0));
 }
 
 /**
@@ -261,24 +394,7 @@ tm_insert_near(timer *t)
 void
 tm_start(timer *t, unsigned after)
 {
-  bird_clock_t when;
-
-  if (t->randomize)
-    after += random() % (t->randomize + 1);
-  when = now + after;
-  if (t->expires == when)
-    return;
-  if (t->expires)
-    rem_node(&t->n);
-  t->expires = when;
-  if (after <= NEAR_TIMER_LIMIT)
-    tm_insert_near(t);
-  else
-    {
-      if (!first_far_timer || first_far_timer > when)
-	first_far_timer = when;
-      add_tail(&far_timers, &t->n);
-    }
+  tm_start_btime(t, (btime) after S);
 }
 
 /**
@@ -294,91 +410,173 @@ tm_stop(timer *t)
   if (t->expires)
     {
       rem_node(&t->n);
+      t->loop->count--;
       t->expires = 0;
     }
 }
 
-static void
-tm_dump_them(char *name, list *l)
+/**
+ * tm_remains - get remaining time of a timer
+ * @t: timer
+ *
+ * This function returns the number of seconds remaining until the timer
+ * expires, rounded up, or zero for an inactive timer.
+ */
+bird_clock_t
+tm_remains(timer *t)
+{
+  btime rem = t->expires ? t->expires - current_time() : 0;
+  return (rem > 0) ? (rem + (1 S) - 1) TO_S : 0;
+}
+
+void
+tm_dump_all(void)
 {
   node *n;
   timer *t;
+  uint l, i;
 
-  debug("%s timers:\n", name);
-  WALK_LIST(n, *l)
-    {
-      t = SKIP_BACK(timer, n, n);
-      debug("%p ", t);
-      tm_dump(&t->r);
-    }
+  debug("Timers:\n");
+  for (l = 0; l < TW_LEVELS; l++)
+    for (i = 0; i < TW_SIZE; i++)
+      WALK_LIST(n, main_timeloop.wheel[l][i])
+	{
+	  t = SKIP_BACK(timer, n, n);
+	  debug("%p ", t);
+	  tm_dump(&t->r);
+	}
   debug("\n");
 }
 
+/**
+ * timers_init - initialize a timing wheel
+ * @loop: timing wheel
+ *
+ * The caller is responsible for setting @loop->last_time and
+ * keeping it up to date.
+ */
 void
-tm_dump_all(void)
+timers_init(struct timeloop *loop)
 {
-  tm_dump_them("Near", &near_timers);
-  tm_dump_them("Far", &far_timers);
+  uint l, i;
+
+  for (l = 0; l < TW_LEVELS; l++)
+    for (i = 0; i < TW_SIZE; i++)
+      init_list(&loop->wheel[l][i]);
+
+  loop->tick = 0;
+  loop->count = 0;
+  loop->kick = NULL;
 }
 
-static inline time_t
-tm_first_shot(void)
+/* Next tick with a timer to run or a slot to cascade, the wheel must not be empty */
+static u64
+tm_next_tick(struct timeloop *loop)
 {
-  time_t x = first_far_timer;
+  u64 next = ~(u64) 0;
+  uint l, i;
+
+  if (!EMPTY_LIST(loop->wheel[0][loop->tick & TW_MASK]))
+    return loop->tick;
 
-  if (!EMPTY_LIST(near_timers))
+  for (l = 0; l < TW_LEVELS; l++)
     {
-      timer *t = SKIP_BACK(timer, n, HEAD(near_timers));
-      if (t->expires < x)
-	x = t->expires;
+      u64 base = loop->tick >> (TW_BITS * l);
+
+      /* Nothing of this and higher levels comes before the next slot here */
+      if (((base + 1) << (TW_BITS * l)) >= next)
+	break;
+
+      for (i = 1; i <= TW_SIZE; i++)
+	if (!EMPTY_LIST(loop->wheel[l][(base + i) & TW_MASK]))
+	  {
+	    next = MIN(next, (base + i) << (TW_BITS * l));
+	    break;
+	  }
     }
-  return x;
+
+  return next;
 }
 
-void io_log_event(void *hook, void *data);
+/**
+ * timers_first - get time of the next timer event
+ * @loop: timing wheel
+ *
+ * This function returns the time the event loop should call timers_fire()
+ * at, or zero if there are no active timers.
+ */
+btime
+timers_first(struct timeloop *loop)
+{
+  return loop->count ? (btime) (tm_next_tick(loop) * TW_TICK) : 0;
+}
 
 static void
-tm_shot(void)
+tm_cascade(struct timeloop *loop, uint l)
 {
-  timer *t;
+  list *s = &loop->wheel[l][(loop->tick >> (TW_BITS * l)) & TW_MASK];
   node *n, *m;
 
-  if (first_far_timer <= now)
+  WALK_LIST_DELSAFE(n, m, *s)
     {
-      bird_clock_t limit = now + NEAR_TIMER_LIMIT;
-      first_far_timer = TIME_INFINITY;
-      n = HEAD(far_timers);
-      while (m = n->next)
+      rem_node(n);
+      tm_insert(loop, SKIP_BACK(timer, n, n));
+    }
+}
+
+void io_log_event(void *hook, void *data);
+
+/**
+ * timers_fire - run expired timers
+ * @loop: timing wheel
+ *
+ * This function runs hooks of all timers of @loop expired at its
+ * @last_time. It must be called from the thread of the event loop.
+ */
+void
+timers_fire(struct timeloop *loop)
+{
+  u64 cur = loop->last_time / TW_TICK;
+  u64 next;
+  timer *t;
+  node *n;
+  uint l;
+
+  for (;;)
+    {
+      /* Hooks may restart timers and move an empty wheel, see tm_set() */
+      while ((n = HEAD(loop->wheel[0][loop->tick & TW_MASK]))->next)
 	{
 	  t = SKIP_BACK(timer, n, n);
-	  if (t->expires <= limit)
+	  btime when = t->expires;
+	  tm_stop(t);
+	  if (t->recurrent)
 	    {
-	      rem_node(n);
-	      tm_insert_near(t);
+	      when += (btime) t->recurrent S;
+	      if (when <= loop->last_time)
+		when = loop->last_time + (btime) t->recurrent S;
+	      if (t->randomize)
+		when += (random() % (t->randomize + 1)) S;
+	      tm_set(t, when);
 	    }
-	  else if (t->expires < first_far_timer)
-	    first_far_timer = t->expires;
-	  n = m;
+	  if (loop == &main_timeloop)
+	    io_log_event(t->hook, t->data);
+	  t->hook(t);
 	}
-    }
-  while ((n = HEAD(near_timers)) -> next)
-    {
-      int delay;
-      t = SKIP_BACK(timer, n, n);
-      if (t->expires > now)
+
+      if (loop->tick >= cur)
 	break;
-      rem_node(n);
-      delay = t->expires - now;
-      t->expires = 0;
-      if (t->recurrent)
+
+      next = loop->count ? tm_next_tick(loop) : cur + 1;
+      if (next > cur)
 	{
-	  int i = t->recurrent - delay;
-	  if (i < 0)
-	    i = 0;
-	  tm_start(t, i);
+	  loop->tick = cur;
+	  break;
 	}
-      io_log_event(t->hook, t->data);
-      t->hook(t);
+
+      loop->tick = next;
+      for (l = 1; (l < TW_LEVELS) && !((loop->tick >> (TW_BITS * (l - 1))) & TW_MASK); l++)
+	tm_cascade(loop, l);
     }
 }
 
@@ -1034,17 +1232,249 @@ sk_log_error(sock *s, const char *p)
 
 static list sock_list;
 static struct birdsock *current_sock;
-static struct birdsock *stored_sock;
+static u64 sock_seq;			/* Last assigned sock->seq */
+static u64 stored_seq;			/* Where the next RX round starts */
 
-static inline sock *
-sk_next(sock *s)
+/*
+ * Sockets which reported some events in the last poll round, sorted
+ * by their position in sock_list. The sock->index field points back
+ * to this array and sk_free() clears the entry, so the event loop
+ * notices a socket deleted by a hook.
+ */
+struct sk_ready {
+  sock *s;
+  int revents;
+};
+
+static struct sk_ready *sk_ready;
+static int sk_ready_num, sk_ready_max;
+
+static inline u32
+sk_poll_events(sock *s)
 {
-  if (!s->n.next->next)
-    return NULL;
-  else
-    return SKIP_BACK(sock, n, s->n.next);
+  return (s->rx_hook ? POLLIN : 0) | ((s->tx_hook && (s->ttx != s->tpos)) ? POLLOUT : 0);
+}
+
+static void
+sk_ready_add(sock *s, int revents)
+{
+  if (sk_ready_num >= sk_ready_max)
+  {
+    sk_ready_max = sk_ready_max ? 2 * sk_ready_max : 64;
+    sk_ready = xrealloc(sk_ready, sk_ready_max * sizeof(struct sk_ready));
+  }
+
+  s->index = sk_ready_num;
+  sk_ready[sk_ready_num++] = (struct sk_ready) { .s = s, .revents = revents };
+}
+
+#ifdef CONFIG_EPOLL
+
+/*
+ * The epoll backend keeps the set of watched descriptors in the kernel
+ * instead of passing all of them in each poll() call. The interest mask
+ * depends on socket hooks and the TX buffer, which are changed directly
+ * by their users, so it is recomputed lazily. Sockets are marked dirty
+ * when they are inserted, when they queue data for TX and after they
+ * have been dispatched, which is where protocols set up their hooks.
+ * A socket whose hooks were cleared elsewhere may still get an event,
+ * sk_poll_wait() drops it and fixes the mask.
+ */
+
+static int epoll_fd = -1;
+static struct epoll_event *sk_events;
+static int sk_events_max;
+static sock **sk_dirty;
+static int sk_dirty_num, sk_dirty_max;
+
+static void
+sk_poll_dirty(sock *s)
+{
+  if (s->poll_dirty || (s->flags & SKF_THREAD))
+    return;
+
+  if (sk_dirty_num >= sk_dirty_max)
+  {
+    sk_dirty_max = sk_dirty_max ? 2 * sk_dirty_max : 64;
+    sk_dirty = xrealloc(sk_dirty, sk_dirty_max * sizeof(sock *));
+  }
+
+  s->poll_dirty = 1;
+  sk_dirty[sk_dirty_num++] = s;
 }
 
+static void
+sk_poll_remove(sock *s)
+{
+  int i;
+
+  if (s->poll_events)
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+  s->poll_events = 0;
+
+  if (s->poll_dirty)
+    for (i = 0; i < sk_dirty_num; i++)
+      if (sk_dirty[i] == s)
+	sk_dirty[i] = NULL;
+  s->poll_dirty = 0;
+}
+
+static void
+sk_poll_update(void)
+{
+  int i;
+
+  for (i = 0; i < sk_dirty_num; i++)
+  {
+    sock *s = sk_dirty[i];
+    if (!s)
+      continue;
+
+    s->poll_dirty = 0;
+    u32 events = sk_poll_events(s);
+    if (events == s->poll_events)
+      continue;
+
+    /* EPOLLIN and EPOLLOUT have the same values as POLLIN and POLLOUT */
+    struct epoll_event ev = { .events = events, .data.ptr = s };
+    int op = !s->poll_events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(epoll_fd, op, s->fd, &ev) < 0)
+      die("epoll_ctl: %m");
+
+    s->poll_events = events;
+  }
+
+  sk_dirty_num = 0;
+}
+
+static int
+sk_ready_cmp(const void *a, const void *b)
+{
+  const struct sk_ready *x = a, *y = b;
+  return (x->s->seq > y->s->seq) - (x->s->seq < y->s->seq);
+}
+
+static void
+sk_poll_init(void)
+{
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+    die("epoll_create: %m");
+
+  sk_events_max = 64;
+  sk_events = xmalloc(sk_events_max * sizeof(struct epoll_event));
+}
+
+static int
+sk_poll_wait(int timeout)
+{
+  int i, n;
+
+  /* Sockets dispatched in the last round may have changed their interests */
+  for (i = 0; i < sk_ready_num; i++)
+    if (sk_ready[i].s)
+    {
+      sk_ready[i].s->index = -1;
+      sk_poll_dirty(sk_ready[i].s);
+    }
+  sk_ready_num = 0;
+
+  sk_poll_update();
+
+  n = epoll_wait(epoll_fd, sk_events, sk_events_max, timeout);
+  if (n <= 0)
+    return n;
+
+  if (n == sk_events_max)
+  {
+    sk_events_max *= 2;
+    sk_events = xrealloc(sk_events, sk_events_max * sizeof(struct epoll_event));
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    sock *s = sk_events[i].data.ptr;
+    int revents = sk_events[i].events & (sk_poll_events(s) | POLLHUP | POLLERR);
+
+    /* Stale interest mask, report only what poll() would have reported */
+    if (!sk_poll_events(s) || !revents)
+    {
+      sk_poll_dirty(s);
+      continue;
+    }
+
+    sk_ready_add(s, revents);
+  }
+
+  /* Keep the order of sock_list, the RX round robin depends on it */
+  qsort(sk_ready, sk_ready_num, sizeof(struct sk_ready), sk_ready_cmp);
+  for (i = 0; i < sk_ready_num; i++)
+    sk_ready[i].s->index = i;
+
+  return n;
+}
+
+#else
+
+static struct pollfd *pfd;
+static sock **pfd_sk;
+static int pfd_max;
+
+static inline void sk_poll_dirty(sock *s UNUSED) { }
+static inline void sk_poll_remove(sock *s UNUSED) { }
+
+static void
+sk_poll_init(void)
+{
+  pfd_max = 256;
+  pfd = xmalloc(pfd_max * sizeof(struct pollfd));
+  pfd_sk = xmalloc(pfd_max * sizeof(sock *));
+}
+
+static int
+sk_poll_wait(int timeout)
+{
+  int i, nfds, pout;
+  node *n;
+
+  for (i = 0; i < sk_ready_num; i++)
+    if (sk_ready[i].s)
+      sk_ready[i].s->index = -1;
+  sk_ready_num = 0;
+
+  nfds = 0;
+  WALK_LIST(n, sock_list)
+  {
+    sock *s = SKIP_BACK(sock, n, n);
+    u32 events = sk_poll_events(s);
+    if (!events)
+      continue;
+
+    if (nfds >= pfd_max)
+    {
+      pfd_max *= 2;
+      pfd = xrealloc(pfd, pfd_max * sizeof(struct pollfd));
+      pfd_sk = xrealloc(pfd_sk, pfd_max * sizeof(sock *));
+    }
+
+    pfd[nfds] = (struct pollfd) { .fd = s->fd, .events = events };
+    pfd_sk[nfds] = s;
+    nfds++;
+  }
+
+  pout = poll(pfd, nfds, timeout);
+  if (pout <= 0)
+    return pout;
+
+  for (i = 0; i < nfds; i++)
+    if (pfd[i].revents)
+      sk_ready_add(pfd_sk[i], pfd[i].revents);
+
+  return pout;
+}
+
+#endif
+
 static void
 sk_alloc_bufs(sock *s)
 {
@@ -1079,6 +1509,7 @@ sk_free(resource *r)
   sk_free_bufs(s);
   if (s->fd >= 0)
   {
+    sk_poll_remove(s);
     close(s->fd);
 
     /* FIXME: we should call sk_stop() for SKF_THREAD sockets */
@@ -1086,9 +1517,9 @@ sk_free(resource *r)
       return;
 
     if (s == current_sock)
-      current_sock = sk_next(s);
-    if (s == stored_sock)
-      stored_sock = sk_next(s);
+      current_sock = NULL;
+    if (s->index >= 0)
+      sk_ready[s->index].s = NULL;
     rem_node(&s->n);
   }
 }
@@ -1183,6 +1614,7 @@ sock_new(pool *p)
   // s->saddr = s->daddr = IPA_NONE;
   s->tos = s->priority = s->ttl = -1;
   s->fd = -1;
+  s->index = -1;
   return s;
 }
 
@@ -1286,7 +1718,9 @@ sk_setup(sock *s)
 static void
 sk_insert(sock *s)
 {
+  s->seq = ++sock_seq;
   add_tail(&sock_list, &s->n);
+  sk_poll_dirty(s);
 }
 
 static void
@@ -1652,6 +2086,7 @@ sk_maybe_write(sock *s)
 	  s->err_hook(s, (errno != EPIPE) ? errno : 0);
 	  return -1;
 	}
+	sk_poll_dirty(s);
 	return 0;
       }
       s->ttx += e;
@@ -1678,6 +2113,7 @@ sk_maybe_write(sock *s)
 
 	if (!s->tx_hook)
 	  reset_tx_buffer(s);
+	sk_poll_dirty(s);
 	return 0;
       }
       reset_tx_buffer(s);
@@ -2053,9 +2489,9 @@ volatile int async_shutdown_flag;
 void
 io_init(void)
 {
-  init_list(&near_timers);
-  init_list(&far_timers);
+  timers_init(&main_timeloop);
   init_list(&sock_list);
+  sk_poll_init();
   init_list(&global_event_list);
   krt_io_init();
   init_times();
@@ -2071,12 +2507,8 @@ void
 io_loop(void)
 {
   int poll_tout;
-  time_t tout;
-  int nfds, events, pout;
-  sock *s;
-  node *n;
-  int fdmax = 256;
-  struct pollfd *pfd = xmalloc(fdmax * sizeof(struct pollfd));
+  btime tout;
+  int events, pout, i;
 
   watchdog_start1();
   for(;;)
@@ -2084,46 +2516,17 @@ io_loop(void)
       events = ev_run_list(&global_event_list);
     timers:
       update_times();
-      tout = tm_first_shot();
-      if (tout <= now)
+      tout = timers_first(&main_timeloop);
+      if (tout && (tout <= main_timeloop.last_time))
 	{
-	  tm_shot();
+	  timers_fire(&main_timeloop);
 	  goto timers;
 	}
-      poll_tout = (events ? 0 : MIN(tout - now, 3)) * 1000; /* Time in milliseconds */
+      tout = tout ? MIN(tout - main_timeloop.last_time, 3 S) : 3 S;
+      poll_tout = events ? 0 : (tout + (1 MS) - 1) TO_MS; /* Time in milliseconds */
 
       io_close_event();
 
-      nfds = 0;
-      WALK_LIST(n, sock_list)
-	{
-	  pfd[nfds] = (struct pollfd) { .fd = -1 }; /* everything other set to 0 by this */
-	  s = SKIP_BACK(sock, n, n);
-	  if (s->rx_hook)
-	    {
-	      pfd[nfds].fd = s->fd;
-	      pfd[nfds].events |= POLLIN;
-	    }
-	  if (s->tx_hook && s->ttx != s->tpos)
-	    {
-	      pfd[nfds].fd = s->fd;
-	      pfd[nfds].events |= POLLOUT;
-	    }
-	  if (pfd[nfds].fd != -1)
-	    {
-	      s->index = nfds;
-	      nfds++;
-	    }
-	  else
-	    s->index = -1;
-
-	  if (nfds >= fdmax)
-	    {
-	      fdmax *= 2;
-	      pfd = xrealloc(pfd, fdmax * sizeof(struct pollfd));
-	    }
-	}
-
       /*
        * Yes, this is racy. But even if the signal comes before this test
        * and entering poll(), it gets caught on the next timer tick.
@@ -2153,7 +2556,7 @@ io_loop(void)
 
       /* And finally enter poll() to find active sockets */
       watchdog_stop();
-      pout = poll(pfd, nfds, poll_tout);
+      pout = sk_poll_wait(poll_tout);
       watchdog_start();
 
       if (pout < 0)
@@ -2164,35 +2567,30 @@ io_loop(void)
 	}
       if (pout)
 	{
-	  /* guaranteed to be non-empty */
-	  current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
-
-	  while (current_sock)
+	  for (i = 0; i < sk_ready_num; i++)
 	    {
-	      sock *s = current_sock;
-	      if (s->index == -1)
-		{
-		  current_sock = sk_next(s);
-		  goto next;
-		}
+	      sock *s = current_sock = sk_ready[i].s;
+	      int revents = sk_ready[i].revents;
+	      if (!s)
+		continue;
 
 	      int e;
 	      int steps;
 
 	      steps = MAX_STEPS;
-	      if (s->fast_rx && (pfd[s->index].revents & POLLIN) && s->rx_hook)
+	      if (s->fast_rx && (revents & POLLIN) && s->rx_hook)
 		do
 		  {
 		    steps--;
 		    io_log_event(s->rx_hook, s->data);
-		    e = sk_read(s, pfd[s->index].revents);
+		    e = sk_read(s, revents);
 		    if (s != current_sock)
 		      goto next;
 		  }
 		while (e && s->rx_hook && steps);
 
 	      steps = MAX_STEPS;
-	      if (pfd[s->index].revents & POLLOUT)
+	      if (revents & POLLOUT)
 		do
 		  {
 		    steps--;
@@ -2202,52 +2600,46 @@ io_loop(void)
 		      goto next;
 		  }
 		while (e && steps);
-
-	      current_sock = sk_next(s);
 	    next: ;
 	    }
+	  current_sock = NULL;
 
 	  short_loops++;
 	  if (events && (short_loops < SHORT_LOOP_MAX))
 	    continue;
 	  short_loops = 0;
 
+	  /* Continue the RX round robin after the last socket served */
 	  int count = 0;
-	  current_sock = stored_sock;
-	  if (current_sock == NULL)
-	    current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
+	  for (i = 0; i < sk_ready_num; i++)
+	    if (sk_ready[i].s && (sk_ready[i].s->seq >= stored_seq))
+	      break;
 
-	  while (current_sock && count < MAX_RX_STEPS)
+	  for (; (i < sk_ready_num) && (count < MAX_RX_STEPS); i++)
 	    {
-	      sock *s = current_sock;
-	      if (s->index == -1)
-		{
-		  current_sock = sk_next(s);
-		  goto next2;
-		}
+	      sock *s = current_sock = sk_ready[i].s;
+	      int revents = sk_ready[i].revents;
+	      if (!s)
+		continue;
+
+	      stored_seq = s->seq + 1;
 
-	      if (!s->fast_rx && (pfd[s->index].revents & POLLIN) && s->rx_hook)
+	      if (!s->fast_rx && (revents & POLLIN) && s->rx_hook)
 		{
 		  count++;
 		  io_log_event(s->rx_hook, s->data);
-		  sk_read(s, pfd[s->index].revents);
+		  sk_read(s, revents);
 		  if (s != current_sock)
-		    goto next2;
+		    continue;
 		}
 
-	      if (pfd[s->index].revents & (POLLHUP | POLLERR))
-		{
-		  sk_err(s, pfd[s->index].revents);
-		  if (s != current_sock)
-		    goto next2;
-		}
-
-	      current_sock = sk_next(s);
-	    next2: ;
+	      if (revents & (POLLHUP | POLLERR))
+		sk_err(s, revents);
 	    }
+	  current_sock = NULL;
 
-
-	  stored_sock = current_sock;
+	  if (i >= sk_ready_num)
+	    stored_seq = 0;
 	}
     }
 }
@@ -112,7 +112,7 @@ kif_force_scan(void)
 void
 kif_request_scan(void)
 {
-  if (kif_proto && kif_scan_timer->expires > now)
+  if (kif_proto && (tm_remains(kif_scan_timer) > 1))
     tm_start(kif_scan_timer, 1);
 }
 
@@ -757,12 +757,152 @@ krt_got_route(struct krt_proto *p, rte *e)
     rte_free(e);
 }
 
+/*
+ *  Incremental synchronization
+ *
+ *  Between full scans, nets known to be out of sync (because of an error
+ *  during their update or because of an async notification about our route
+ *  changed by someone else) are queued to resync_list and fixed one by one,
+ *  without dumping the whole kernel table.
+ */
+
+struct krt_resync {
+  node n;
+  ip_addr prefix;
+  int pxlen;
+  rte *old;			/* Unexpected route in kernel table, or NULL */
+};
+
+static void
+krt_resync_add(struct krt_proto *p, net *n, rte *old)
+{
+  struct krt_resync *r = sl_alloc(p->resync_slab);
+
+  r->prefix = n->n.prefix;
+  r->pxlen = n->n.pxlen;
+  r->old = old;
+  add_tail(&p->resync_list, &r->n);
+}
+
+static void
+krt_resync_flush(struct krt_proto *p)
+{
+  struct krt_resync *r, *nxt;
+
+  WALK_LIST_DELSAFE(r, nxt, p->resync_list)
+    {
+      if (r->old)
+	rte_free(r->old);
+      sl_free(p->resync_slab, r);
+    }
+  init_list(&p->resync_list);
+}
+
+/**
+ * krt_got_sync_error - report failed route update
+ * @p: kernel protocol
+ * @n: network whose route could not be installed
+ *
+ * This function is called by the OS-dependent code when it finds out that
+ * the kernel rejected the route for @n. The net is marked with
+ * %KRF_SYNC_ERROR and the update is retried by the next scan.
+ */
+void
+krt_got_sync_error(struct krt_proto *p, net *n)
+{
+  n->n.flags |= KRF_SYNC_ERROR;
+  krt_resync_add(p, n, NULL);
+}
+
+static void
+krt_resync_net(struct krt_proto *p, struct krt_resync *r)
+{
+  net *n = r->old ? net_get(p->p.table, r->prefix, r->pxlen) : net_find(p->p.table, r->prefix, r->pxlen);
+  rte *new = NULL, *rt_free = NULL;
+  ea_list *tmpa = NULL;
+
+  if (!n)
+    return;
+
+  /* The net may have been pruned and reallocated since the notification */
+  if (r->old)
+    r->old->net = n;
+
+  if (n->n.flags & KRF_INSTALLED)
+    new = krt_export_net(p, n, &rt_free, &tmpa);
+
+  if (new)
+    tmpa = ea_append(tmpa, new->attrs->eattrs);
+
+  if (r->old)
+    {
+      if (!new)
+	{
+	  krt_trace_in(p, r->old, "deleting");
+	  krt_replace_rte(p, n, NULL, r->old, NULL);
+	}
+      else if ((n->n.flags & KRF_SYNC_ERROR) || !krt_same_dest(r->old, new))
+	{
+	  krt_trace_in(p, new, "updating");
+	  krt_replace_rte(p, n, new, r->old, tmpa);
+	}
+    }
+  else if (new)
+    {
+      /* We do not know what is left in the kernel, so we remove it first */
+      krt_trace_in(p, new, "reinstalling");
+      krt_replace_rte(p, n, new, new, tmpa);
+    }
+
+  if (rt_free)
+    rte_free(rt_free);
+  lp_flush(krt_filter_lp);
+}
+
+static void
+krt_resync(struct krt_proto *p)
+{
+  struct krt_resync *r, *nxt;
+  list l;
+
+  if (EMPTY_LIST(p->resync_list))
+    return;
+
+  KRT_TRACE(p, D_EVENTS, "Resyncing table %s", p->p.table->name);
+
+  /* Failed updates are queued again to the emptied list */
+  init_list(&l);
+  add_tail_list(&l, &p->resync_list);
+  init_list(&p->resync_list);
+
+  WALK_LIST_DELSAFE(r, nxt, l)
+    {
+      krt_resync_net(p, r);
+      if (r->old)
+	rte_free(r->old);
+      sl_free(p->resync_slab, r);
+    }
+}
+
+static inline int
+krt_scan_full(struct krt_proto *p)
+{
+  return !KRT_CF->full_scan_time || p->full_scan || !p->initialized ||
+    (now >= p->last_full_scan + KRT_CF->full_scan_time);
+}
+
 static void
 krt_prune(struct krt_proto *p)
 {
   struct rtable *t = p->p.table;
 
   KRT_TRACE(p, D_EVENTS, "Pruning table %s", t->name);
+
+  /* Full scan covers all pending incremental updates */
+  krt_resync_flush(p);
+  p->full_scan = 0;
+  p->last_full_scan = now;
+
   FIB_WALK(&t->fib, f)
     {
       net *n = (net *) f;
@@ -843,7 +983,23 @@ krt_got_route_async(struct krt_proto *p, rte *e, int new)
   switch (e->u.krt.src)
     {
     case KRT_SRC_BIRD:
-      ASSERT(0);			/* Should be filtered by the back end */
+      /* Our route changed by someone else, it is fixed by the next scan */
+      if (!p->initialized)
+	break;
+
+      if (new)
+	{
+	  krt_trace_in(p, e, "[bird] changed");
+	  rta *a = e->attrs;
+	  a->source = RTS_DUMMY;
+	  e->attrs = rta_lookup(a);
+	  krt_resync_add(p, net, e);
+	  return;
+	}
+
+      krt_trace_in(p, e, "[bird] removed");
+      krt_resync_add(p, net, NULL);
+      break;
 
     case KRT_SRC_REDIRECT:
       if (new)
@@ -880,6 +1036,18 @@ static void
 krt_scan(timer *t UNUSED)
 {
   struct krt_proto *p;
+  node *n;
+  int full = 0;
+
+  WALK_LIST2(p, n, krt_proto_list, krt_node)
+    full |= krt_scan_full(p);
+
+  if (!full)
+  {
+    WALK_LIST2(p, n, krt_proto_list, krt_node)
+      krt_resync(p);
+    return;
+  }
 
   kif_force_scan();
 
@@ -921,8 +1089,9 @@ krt_scan_timer_stop(struct krt_proto *p UNUSED)
 }
 
 static void
-krt_scan_timer_kick(struct krt_proto *p UNUSED)
+krt_scan_timer_kick(struct krt_proto *p)
 {
+  p->full_scan = 1;
   tm_start(krt_scan_timer, 0);
 }
 
@@ -933,6 +1102,12 @@ krt_scan(timer *t)
 {
   struct krt_proto *p = t->data;
 
+  if (!krt_scan_full(p))
+  {
+    krt_resync(p);
+    return;
+  }
+
   kif_force_scan();
 
   KRT_TRACE(p, D_EVENTS, "Scanning routing table");
@@ -956,12 +1131,33 @@ krt_scan_timer_stop(struct krt_proto *p)
 static void
 krt_scan_timer_kick(struct krt_proto *p)
 {
+  p->full_scan = 1;
   tm_start(p->scan_timer, 0);
 }
 
 #endif
 
+/**
+ * krt_async_lost - report lost async notifications
+ *
+ * This function is called by the OS-dependent code when some async
+ * notifications about kernel routes were lost. All kernel tables then
+ * need a full scan, which is started immediately when incremental scans
+ * are used (otherwise the next regular scan is full anyway).
+ */
+void
+krt_async_lost(void)
+{
+  struct krt_proto *p;
+  node *n;
 
+  WALK_LIST2(p, n, krt_proto_list, krt_node)
+    {
+      p->full_scan = 1;
+      if (KRT_CF->full_scan_time)
+	krt_scan_timer_kick(p);
+    }
+}
 
 
 /*
@@ -1134,6 +1330,8 @@ krt_start(struct proto *P)
   struct krt_proto *p = (struct krt_proto *) P;
 
   add_tail(&krt_proto_list, &p->krt_node);
+  init_list(&p->resync_list);
+  p->resync_slab = sl_new(P->pool, sizeof(struct krt_resync));
 
 #ifdef KRT_ALLOW_LEARN
   krt_learn_init(p);
@@ -1171,6 +1369,7 @@ krt_shutdown(struct proto *P)
     return PS_DOWN;
 
   krt_sys_shutdown(p);
+  krt_resync_flush(p);
   rem_node(&p->krt_node);
 
   return PS_DOWN;
@@ -1186,7 +1385,8 @@ krt_reconfigure(struct proto *p, struct proto_config *new)
     return 0;
 
   /* persist, graceful restart need not be the same */
-  return o->scan_time == n->scan_time && o->learn == n->learn &&
+  return o->scan_time == n->scan_time && o->full_scan_time == n->full_scan_time &&
+    o->learn == n->learn &&
     o->devroutes == n->devroutes && o->merge_paths == n->merge_paths;
 }
 
@@ -1203,7 +1403,7 @@ krt_postconfig(struct proto_config *C)
   struct krt_config *c = (struct krt_config *) C;
 
 #ifdef CONFIG_ALL_TABLES_AT_ONCE
-  if (krt_cf->scan_time != c->scan_time)
+  if ((krt_cf->scan_time != c->scan_time) || (krt_cf->full_scan_time != c->full_scan_time))
     cf_error("All kernel syncers must use the same table scan interval");
 #endif
 
@@ -1266,6 +1466,7 @@ struct protocol proto_unix_kernel = {
   .attr_class =		EAP_KRT,
   .preference =		DEF_PREF_INHERITED,
   .config_size =	sizeof(struct krt_config),
+  .rte_size =		RTE_DATA_SIZE(krt),
   .preconfig =		krt_preconfig,
   .postconfig =		krt_postconfig,
   .init =		krt_init,
@@ -46,6 +46,7 @@ struct krt_config {
   struct krt_params sys;	/* Sysdep params */
   int persist;			/* Keep routes when we exit */
   int scan_time;		/* How often we re-scan routes */
+  int full_scan_time;		/* How often we do full scans, 0 for every scan */
   int learn;			/* Learn routes from other sources */
   int devroutes;		/* Allow export of device routes */
   int graceful_restart;		/* Regard graceful restart recovery */
@@ -65,6 +66,10 @@ struct krt_proto {
 #endif
 
   node krt_node;		/* Node in krt_proto_list */
+  list resync_list;		/* Nets for next incremental scan (struct krt_resync) */
+  slab *resync_slab;
+  bird_clock_t last_full_scan;	/* Time of last full scan */
+  byte full_scan;		/* Next scan must be a full one */
   byte ready;			/* Initial feed has been finished */
   byte initialized;		/* First scan has been finished */
   byte reload;			/* Next scan is doing reload */
@@ -83,6 +88,8 @@ struct proto_config * kif_init_config(int class);
 void kif_request_scan(void);
 void krt_got_route(struct krt_proto *p, struct rte *e);
 void krt_got_route_async(struct krt_proto *p, struct rte *e, int new);
+void krt_got_sync_error(struct krt_proto *p, struct network *n);
+void krt_async_lost(void);
 
 /* Values for rte->u.krt_sync.src */
 #define KRT_SRC_UNKNOWN	-1	/* Nobody knows */
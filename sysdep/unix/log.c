@@ -21,12 +21,15 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "nest/bird.h"
 #include "nest/cli.h"
 #include "nest/mrtdump.h"
 #include "lib/string.h"
 #include "lib/lists.h"
+#include "lib/resource.h"
+#include "lib/timer.h"
 #include "lib/unix.h"
 
 static FILE *dbgf;
@@ -180,19 +183,26 @@ log_msg(const char *msg, ...)
 void
 log_rl(struct tbf *f, const char *msg, ...)
 {
-  int last_hit = f->mark;
+  int last_hit, limited, mark;
   int class = 1;
   va_list args;
 
+  /* Filters may log from import workers, so the bucket is shared */
+  log_lock();
+  last_hit = f->mark;
+  limited = tbf_limit(f);
+  mark = f->mark;
+  log_unlock();
+
   /* Rate limiting is a bit tricky here as it also logs '...' during the first hit */
-  if (tbf_limit(f) && last_hit)
+  if (limited && last_hit)
     return;
 
   if (*msg >= 1 && *msg <= 8)
     class = *msg++;
 
   va_start(args, msg);
-  vlog(class, (f->mark ? "..." : msg), args);
+  vlog(class, (mark ? "..." : msg), args);
   va_end(args);
 }
 
@@ -328,8 +338,197 @@ log_init_debug(char *f)
     setvbuf(dbgf, NULL, _IONBF, 0);
 }
 
+/*
+ *	MRT Streams
+ */
+
+/*
+ * MRT records are collected in a buffer of the stream and written by
+ * large write() calls, when the buffer is full or at latest a second
+ * after the first buffered record, instead of one blocking write() per
+ * record. Only complete records are written, so streams sharing a file
+ * (e.g. the old and the new configuration during reconfiguration) do
+ * not corrupt each other.
+ */
+
+#define MRT_STREAM_BUFFER_SIZE	65536
+#define MRT_STREAM_FLUSH_TIME	1
+
+struct mrt_stream {
+  resource r;
+  node n;				/* Node in mrt_streams */
+  char *name;				/* File name, strftime() pattern if expand is set */
+  int expand;
+  int fd;				/* -1 if the file could not be opened */
+  uint rotate;				/* Rotation period, 0 if not rotated */
+  bird_clock_t rotate_time;		/* Time of the next rotation */
+  uint len;				/* Length of buffered data */
+  byte buf[MRT_STREAM_BUFFER_SIZE];
+};
+
+static list mrt_streams;
+static timer *mrt_flush_timer;
+
+static int
+mrt_stream_open_file(struct mrt_stream *s)
+{
+  char name[256];
+
+  if (s->expand)
+    {
+      time_t t = now_real;
+      if (!strftime(name, sizeof(name), s->name, localtime(&t)))
+	{
+	  errno = ENAMETOOLONG;
+	  return -1;
+	}
+    }
+  else
+    bsnprintf(name, sizeof(name), "%s", s->name);
+
+  s->fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (s->rotate)
+    s->rotate_time = now + s->rotate;
+
+  return s->fd;
+}
+
+static void
+mrt_stream_write_buf(struct mrt_stream *s, byte *buf, uint len)
+{
+  while (len && (s->fd >= 0))
+    {
+      int rv = write(s->fd, buf, len);
+      if (rv < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  log(L_ERR "Error writing MRT file %s: %m", s->name);
+	  return;
+	}
+      buf += rv;
+      len -= rv;
+    }
+}
+
+/**
+ * mrt_stream_flush - write buffered MRT records
+ * @s: MRT stream
+ */
 void
-mrt_dump_message(struct proto *p, u16 type, u16 subtype, byte *buf, u32 len)
+mrt_stream_flush(struct mrt_stream *s)
+{
+  mrt_stream_write_buf(s, s->buf, s->len);
+  s->len = 0;
+}
+
+static void
+mrt_flush_hook(timer *t UNUSED)
+{
+  mrt_flush_all();
+}
+
+/**
+ * mrt_flush_all - write buffered records of all MRT streams
+ *
+ * This function is called periodically and before BIRD exits.
+ */
+void
+mrt_flush_all(void)
+{
+  struct mrt_stream *s;
+  node *n;
+
+  if (!mrt_flush_timer)
+    return;
+
+  WALK_LIST2(s, n, mrt_streams, n)
+    mrt_stream_flush(s);
+}
+
+static void
+mrt_stream_free(resource *r)
+{
+  struct mrt_stream *s = (struct mrt_stream *) r;
+
+  mrt_stream_flush(s);
+  if (s->fd >= 0)
+    close(s->fd);
+  rem_node(&s->n);
+  xfree(s->name);
+}
+
+static void
+mrt_stream_dump(resource *r)
+{
+  struct mrt_stream *s = (struct mrt_stream *) r;
+
+  debug("(file %s, fd %d, %u bytes buffered)\n", s->name, s->fd, s->len);
+}
+
+static struct resclass mrt_stream_class = {
+  "MRT stream",
+  sizeof(struct mrt_stream),
+  mrt_stream_free,
+  mrt_stream_dump,
+  NULL,
+  NULL
+};
+
+/**
+ * mrt_stream_open - open a buffered MRT stream
+ * @p: pool the stream is allocated from
+ * @name: file name
+ * @expand: expand @name by strftime() with the current time
+ * @rotate: rotation period in seconds, 0 for none
+ *
+ * The file is opened for appending. If @rotate is nonzero, the file
+ * is reopened every @rotate seconds, so @name should be expanded to
+ * get a new file. The stream is closed by freeing it by rfree().
+ *
+ * Result: new stream, or NULL (with errno set) if the file cannot be opened.
+ */
+struct mrt_stream *
+mrt_stream_open(pool *p, char *name, int expand, uint rotate)
+{
+  struct mrt_stream *s = ralloc(p, &mrt_stream_class);
+
+  /* The name may come from a config which is freed before the stream */
+  s->name = xmalloc(strlen(name) + 1);
+  strcpy(s->name, name);
+  s->expand = expand;
+  s->rotate = rotate;
+  s->len = 0;
+
+  if (!mrt_flush_timer)
+    {
+      init_list(&mrt_streams);
+      mrt_flush_timer = tm_new_set(&root_pool, mrt_flush_hook, NULL, 0, 0);
+    }
+  add_tail(&mrt_streams, &s->n);
+
+  if (mrt_stream_open_file(s) < 0)
+    {
+      int err = errno;
+      rfree(s);
+      errno = err;
+      return NULL;
+    }
+
+  return s;
+}
+
+/**
+ * mrt_stream_write - write a MRT record
+ * @s: MRT stream
+ * @type: MRT record type
+ * @subtype: MRT record subtype
+ * @buf: record, starting with %MRTDUMP_HDR_LENGTH bytes reserved for the header
+ * @len: length of the record including the header
+ */
+void
+mrt_stream_write(struct mrt_stream *s, u16 type, u16 subtype, byte *buf, u32 len)
 {
   /* Prepare header */
   put_u32(buf+0, now_real);
@@ -337,6 +536,34 @@ mrt_dump_message(struct proto *p, u16 type, u16 subtype, byte *buf, u32 len)
   put_u16(buf+6, subtype);
   put_u32(buf+8, len - MRTDUMP_HDR_LENGTH);
 
-  if (p->cf->global->mrtdump_file != -1)
-    write(p->cf->global->mrtdump_file, buf, len);
+  if (s->rotate && (now >= s->rotate_time))
+    {
+      mrt_stream_flush(s);
+      if (s->fd >= 0)
+	close(s->fd);
+      if (mrt_stream_open_file(s) < 0)
+	log(L_ERR "Unable to open MRT file %s: %m", s->name);
+    }
+
+  if (s->len + len > MRT_STREAM_BUFFER_SIZE)
+    mrt_stream_flush(s);
+
+  if (len > MRT_STREAM_BUFFER_SIZE)
+    {
+      mrt_stream_write_buf(s, buf, len);
+      return;
+    }
+
+  memcpy(s->buf + s->len, buf, len);
+  s->len += len;
+
+  if (!mrt_flush_timer->expires)
+    tm_start(mrt_flush_timer, MRT_STREAM_FLUSH_TIME);
+}
+
+void
+mrt_dump_message(struct proto *p, u16 type, u16 subtype, byte *buf, u32 len)
+{
+  if (p->cf->global->mrtdump_stream)
+    mrt_stream_write(p->cf->global->mrtdump_stream, type, subtype, buf, len);
 }
@@ -33,6 +33,7 @@
 #include "nest/iface.h"
 #include "nest/cli.h"
 #include "nest/locks.h"
+#include "nest/mrtdump.h"
 #include "conf/conf.h"
 #include "filter/filter.h"
 
@@ -563,6 +564,7 @@ sysdep_shutdown_done(void)
 {
   unlink_pid_file();
   unlink(path_control_socket);
+  mrt_flush_all();
   log_msg(L_FATAL "Shutdown completed");
   exit(0);
 }
@@ -15,21 +15,51 @@
 
 typedef time_t bird_clock_t;		/* Use instead of time_t */
 
+/*
+ * Timing wheel of an event loop, see io.c. The main loop has one, BFD loops
+ * running in their own threads have their own. Times are in microseconds
+ * (btime, which is not defined yet here).
+ */
+
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 4
+
+struct timeloop {
+  list wheel[TW_LEVELS][TW_SIZE];
+  u64 tick;				/* Current tick, timers expiring before it were run */
+  uint count;				/* Number of active timers */
+  s64 last_time;			/* Current time of the loop */
+  void (*kick)(struct timeloop *);	/* Called when a timer is started, to wake up the loop */
+};
+
 typedef struct timer {
   resource r;
   void (*hook)(struct timer *);
   void *data;
-  unsigned randomize;			/* Amount of randomization */
-  unsigned recurrent;			/* Timer recurrence */
+  unsigned randomize;			/* Amount of randomization in seconds */
+  unsigned recurrent;			/* Timer recurrence in seconds */
   node n;				/* Internal link */
-  bird_clock_t expires;			/* 0=inactive */
+  s64 expires;				/* Expiration time in microseconds, 0=inactive */
+  struct timeloop *loop;		/* Timing wheel of an active timer */
 } timer;
 
 timer *tm_new(pool *);
 void tm_start(timer *, unsigned after);
+void tm_start_btime(timer *, s64 after);
+void tm_set(timer *, s64 when);
 void tm_stop(timer *);
+bird_clock_t tm_remains(timer *);
 void tm_dump_all(void);
 
+s64 current_time(void);
+s64 current_time_precise(void);
+void timers_init(struct timeloop *);
+void timers_fire(struct timeloop *);
+s64 timers_first(struct timeloop *);
+void timeloop_set_current(struct timeloop *);
+
 extern bird_clock_t now; 		/* Relative, monotonic time in seconds */
 extern bird_clock_t now_real;		/* Time in seconds since fixed known epoch */
 extern bird_clock_t boot_time;
@@ -40,12 +70,6 @@ tm_active(timer *t)
   return t->expires != 0;
 }
 
-static inline bird_clock_t
-tm_remains(timer *t)
-{
-  return t->expires ? t->expires - now : 0;
-}
-
 static inline void
 tm_start_max(timer *t, unsigned after)
 {